@@ -0,0 +1,521 @@
+/* \file camera.c
+
+ *
+ * \brief
+ *         In-process camera capture and streaming, see camera.h
+ *
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
+#include <linux/videodev2.h>
+
+#include "camera.h"
+#include "protocol.h"
+#include "telemetry.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+
+static void pump(struct camera *c);
+
+/*--------------------------------------------------------------------*/
+/*!
+ * Prepare a camera, nothing is opened until camera_start()
+ *
+ * \param c camera
+ * \param source "synthetic", "file:<path>" or a V4L2 device such as
+ *        /dev/video0
+ */
+void camera_init(struct camera *c, const char *source) {
+	memset(c, 0, sizeof(*c));
+	if (strcmp(source, "synthetic") == 0) {
+		c->kind = CAMERA_SYNTHETIC;
+	} else if (strncmp(source, "file:", 5) == 0) {
+		c->kind = CAMERA_FILE;
+		source += 5;
+	} else {
+		c->kind = CAMERA_V4L2;
+	}
+	c->source = source;
+	c->fd = -1;
+	c->timer = -1;
+	c->sock = -1;
+	c->sending = -1;
+}
+
+/*!
+ * Give a buffer back to its source
+ */
+static void release(struct camera *c, int i) {
+	struct v4l2_buffer b;
+
+	c->bufs[i].state = BUF_FREE;
+	if (c->kind != CAMERA_V4L2)
+		return;
+	memset(&b, 0, sizeof(b));
+	b.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	b.memory = V4L2_MEMORY_MMAP;
+	b.index = i;
+	ioctl(c->fd, VIDIOC_QBUF, &b);
+}
+
+/*!
+ * Queue a captured frame for sending, dropping the oldest one when the
+ * queue is full
+ */
+static void push(struct camera *c, int i) {
+	c->captured++;
+	c->bufs[i].seq = c->seq++;
+	c->bufs[i].state = BUF_QUEUED;
+
+	if (c->queued == CAMERA_QUEUE_LEN) {
+		release(c, c->queue[0]);
+		memmove(c->queue, c->queue + 1, (CAMERA_QUEUE_LEN - 1) * sizeof(int));
+		c->queued--;
+		c->dropped++;
+	}
+	c->queue[c->queued++] = i;
+	pump(c);
+}
+
+/*!
+ * V4L2 device callback: dequeue the captured frames
+ */
+static void onCapture(struct evloop *l, int fd, uint32_t events, void *arg) {
+	struct camera *c = arg;
+	struct v4l2_buffer b;
+	struct camera_buffer *buf;
+
+	while (1) {
+		memset(&b, 0, sizeof(b));
+		b.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		b.memory = V4L2_MEMORY_MMAP;
+		if (ioctl(fd, VIDIOC_DQBUF, &b) < 0)
+			return; // EAGAIN: no more frames
+		if (b.index >= (unsigned) c->nbufs)
+			continue;
+		buf = &c->bufs[b.index];
+		buf->used = b.bytesused;
+		if ((b.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK)
+				== V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+			buf->stamp_us = (uint64_t) b.timestamp.tv_sec * 1000000
+					+ b.timestamp.tv_usec;
+		else
+			buf->stamp_us = monotonic_us();
+		push(c, b.index);
+	}
+}
+
+/*!
+ * Fill a buffer with a moving YUYV test pattern
+ */
+static void synthesize(struct camera *c, struct camera_buffer *buf) {
+	unsigned x, y, shift = c->seq * 4;
+	unsigned char *p = buf->start;
+
+	for (y = 0; y < c->height; y++) {
+		for (x = 0; x < c->width; x += 2, p += 4) {
+			p[0] = (x + shift) ^ y;
+			p[1] = 128;
+			p[2] = (x + 1 + shift) ^ y;
+			p[3] = 128;
+		}
+	}
+}
+
+/*!
+ * Read the next frame of the file, starting over at its end
+ *
+ * \return 0 on success, -1 if the file holds no complete frame
+ */
+static int readFrame(struct camera *c, struct camera_buffer *buf) {
+	size_t got = 0;
+	ssize_t n;
+	int rewound = 0;
+
+	while (got < buf->used) {
+		n = read(c->fd, buf->start + got, buf->used - got);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		if (n == 0) {
+			if (rewound || lseek(c->fd, 0, SEEK_SET) < 0)
+				return -1;
+			rewound = 1;
+			got = 0;
+			continue;
+		}
+		got += n;
+	}
+	return 0;
+}
+
+/*!
+ * Capture timer of the file and synthetic sources
+ */
+static void onTick(struct evloop *l, int fd, uint32_t expirations, void *arg) {
+	struct camera *c = arg;
+	struct camera_buffer *buf;
+	int i;
+
+	for (i = 0; i < c->nbufs; i++)
+		if (c->bufs[i].state == BUF_FREE)
+			break;
+	if (i == c->nbufs) {
+		if (c->queued == 0) { // all buffers are still being sent
+			c->seq++;
+			c->dropped++;
+			return;
+		}
+		i = c->queue[0];
+		memmove(c->queue, c->queue + 1, (CAMERA_QUEUE_LEN - 1) * sizeof(int));
+		c->queued--;
+		c->dropped++;
+	}
+
+	buf = &c->bufs[i];
+	buf->stamp_us = monotonic_us();
+	buf->used = (size_t) c->width * c->height * 2;
+	if (c->kind == CAMERA_SYNTHETIC) {
+		synthesize(c, buf);
+	} else if (readFrame(c, buf) < 0) {
+		camera_stop(c);
+		return;
+	}
+	push(c, i);
+}
+
+/*!
+ * Release the buffers whose MSG_ZEROCOPY sends completed
+ *
+ * \return 0 on success, -1 if the socket reported an error
+ */
+static int reapCompletions(struct camera *c) {
+	char control[128];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct sock_extended_err *err;
+	int i, soerr = 0;
+	socklen_t len = sizeof(soerr);
+
+	while (c->zerocopy) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(c->sock, &msg, MSG_ERRQUEUE) < 0)
+			break;
+		for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+			err = (struct sock_extended_err *) CMSG_DATA(cm);
+			if (err->ee_errno != 0 || err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			// ee_data is the last completed send
+			for (i = 0; i < c->nbufs; i++)
+				if (c->bufs[i].state == BUF_INFLIGHT
+						&& (int32_t) (c->bufs[i].zc_id - err->ee_data) <= 0)
+					release(c, i);
+		}
+	}
+
+	if (getsockopt(c->sock, SOL_SOCKET, SO_ERROR, &soerr, &len) < 0 || soerr)
+		return -1;
+	return 0;
+}
+
+/*!
+ * Send the queued frames until the socket is full
+ */
+static void pump(struct camera *c) {
+	struct camera_buffer *buf;
+	struct msghdr msg;
+	struct iovec iov[2];
+	ssize_t n;
+	int i;
+
+	while (c->sock >= 0) {
+		if (c->sending < 0) {
+			if (c->queued == 0) {
+				evloop_modify(c->loop, c->sock, EPOLLIN);
+				return;
+			}
+			c->sending = c->queue[0];
+			memmove(c->queue, c->queue + 1,
+					(CAMERA_QUEUE_LEN - 1) * sizeof(int));
+			c->queued--;
+			c->sent = 0;
+
+			buf = &c->bufs[c->sending];
+			buf->state = BUF_SENDING;
+			put_be32(buf->header, buf->used);
+			put_be32(buf->header + 4, buf->seq);
+			put_be64(buf->header + 8, buf->stamp_us);
+			put_be16(buf->header + 16, c->width);
+			put_be16(buf->header + 18, c->height);
+			put_be32(buf->header + 20, c->fourcc);
+		}
+		buf = &c->bufs[c->sending];
+
+		i = 0;
+		if (c->sent < CAMERA_HEADER_LEN) {
+			iov[i].iov_base = buf->header + c->sent;
+			iov[i].iov_len = CAMERA_HEADER_LEN - c->sent;
+			i++;
+		}
+		iov[i].iov_base = buf->start + (c->sent > CAMERA_HEADER_LEN
+				? c->sent - CAMERA_HEADER_LEN : 0);
+		iov[i].iov_len = buf->used - (c->sent > CAMERA_HEADER_LEN
+				? c->sent - CAMERA_HEADER_LEN : 0);
+		i++;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = i;
+		n = sendmsg(c->sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT
+				| (c->zerocopy ? MSG_ZEROCOPY : 0));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+				evloop_modify(c->loop, c->sock, EPOLLIN | EPOLLOUT);
+				return;
+			}
+			camera_stop(c);
+			return;
+		}
+		if (c->zerocopy)
+			buf->zc_id = c->zc_next++;
+		c->sent += n;
+
+		if (c->sent == CAMERA_HEADER_LEN + buf->used) {
+			c->streamed++;
+			hist_record(&c->latency, (monotonic_us() - buf->stamp_us) * 1000);
+			// with MSG_ZEROCOPY the kernel reads the buffer until it
+			// reports the send complete, see reapCompletions()
+			if (c->zerocopy)
+				buf->state = BUF_INFLIGHT;
+			else
+				release(c, c->sending);
+			c->sending = -1;
+		}
+	}
+}
+
+/*!
+ * Streaming socket callback
+ */
+static void onSocket(struct evloop *l, int fd, uint32_t events, void *arg) {
+	struct camera *c = arg;
+	char junk[256];
+	ssize_t n;
+
+	if ((events & EPOLLERR) && reapCompletions(c) < 0) {
+		camera_stop(c);
+		return;
+	}
+	if (events & (EPOLLIN | EPOLLHUP)) {
+		n = recv(fd, junk, sizeof(junk), MSG_DONTWAIT);
+		if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+			camera_stop(c); // closed by the server
+			return;
+		}
+	}
+	if (events & EPOLLOUT)
+		pump(c);
+}
+
+/*!
+ * Open the V4L2 device and start streaming into mapped buffers
+ */
+static int openV4l2(struct camera *c) {
+	struct v4l2_format fmt;
+	struct v4l2_streamparm parm;
+	struct v4l2_requestbuffers req;
+	struct v4l2_buffer b;
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	int i;
+
+	c->fd = open(c->source, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (c->fd < 0)
+		return -1;
+
+	memset(&fmt, 0, sizeof(fmt));
+	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	fmt.fmt.pix.width = c->width;
+	fmt.fmt.pix.height = c->height;
+	fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV;
+	fmt.fmt.pix.field = V4L2_FIELD_ANY;
+	if (ioctl(c->fd, VIDIOC_S_FMT, &fmt) < 0)
+		return -1;
+	c->width = fmt.fmt.pix.width; // the driver may adjust them
+	c->height = fmt.fmt.pix.height;
+	c->fourcc = fmt.fmt.pix.pixelformat;
+
+	memset(&parm, 0, sizeof(parm));
+	parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	parm.parm.capture.timeperframe.numerator = 1;
+	parm.parm.capture.timeperframe.denominator = c->fps;
+	ioctl(c->fd, VIDIOC_S_PARM, &parm); // best effort
+
+	memset(&req, 0, sizeof(req));
+	req.count = CAMERA_BUFFERS;
+	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.memory = V4L2_MEMORY_MMAP;
+	if (ioctl(c->fd, VIDIOC_REQBUFS, &req) < 0 || req.count < 2)
+		return -1;
+	c->nbufs = req.count < CAMERA_BUFFERS ? req.count : CAMERA_BUFFERS;
+
+	for (i = 0; i < c->nbufs; i++) {
+		memset(&b, 0, sizeof(b));
+		b.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		b.memory = V4L2_MEMORY_MMAP;
+		b.index = i;
+		if (ioctl(c->fd, VIDIOC_QUERYBUF, &b) < 0)
+			return -1;
+		c->bufs[i].start = mmap(NULL, b.length, PROT_READ | PROT_WRITE,
+				MAP_SHARED, c->fd, b.m.offset);
+		if (c->bufs[i].start == MAP_FAILED) {
+			c->bufs[i].start = NULL;
+			return -1;
+		}
+		c->bufs[i].length = b.length;
+		release(c, i);
+	}
+
+	if (ioctl(c->fd, VIDIOC_STREAMON, &type) < 0)
+		return -1;
+	return evloop_add(c->loop, c->fd, EPOLLIN, onCapture, c);
+}
+
+/*!
+ * Open the file or synthetic source, captured on a timer
+ */
+static int openTimed(struct camera *c) {
+	int i;
+
+	if (c->kind == CAMERA_FILE) {
+		c->fd = open(c->source, O_RDONLY | O_CLOEXEC);
+		if (c->fd < 0)
+			return -1;
+	}
+	c->fourcc = V4L2_PIX_FMT_YUYV;
+	c->nbufs = CAMERA_BUFFERS;
+	for (i = 0; i < c->nbufs; i++) {
+		c->bufs[i].length = (size_t) c->width * c->height * 2;
+		c->bufs[i].start = malloc(c->bufs[i].length);
+		if (c->bufs[i].start == NULL)
+			return -1;
+		c->bufs[i].state = BUF_FREE;
+	}
+
+	c->timer = evloop_add_timer(c->loop, onTick, c);
+	if (c->timer < 0)
+		return -1;
+	return evloop_timer_set(c->timer, 1000000 / c->fps, 1000000 / c->fps);
+}
+
+/*--------------------------------------------------------------------*/
+/*!
+ * Start capturing and streaming
+ *
+ * \param c camera, see camera_init()
+ * \param l event loop running the pipeline
+ * \param sock connected (or connecting) non blocking socket of the stream,
+ *        closed by camera_stop()
+ * \param width requested frame width, even
+ * \param height requested frame height
+ * \param fps requested frame rate
+ *
+ * \return 0 on success, -1 on error (the socket is closed)
+ */
+int camera_start(struct camera *c, struct evloop *l, int sock, unsigned width,
+		unsigned height, unsigned fps) {
+	int one = 1, sndbuf;
+
+	camera_stop(c);
+	c->loop = l;
+	c->width = width & ~1u;
+	c->height = height;
+	c->fps = fps;
+	c->seq = 0;
+	c->captured = c->streamed = c->dropped = 0;
+	hist_reset(&c->latency);
+
+	c->sock = sock;
+	c->zerocopy = setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &one,
+			sizeof(one)) == 0;
+	c->zc_next = 0;
+	if (evloop_add(l, sock, EPOLLIN, onSocket, c) < 0) {
+		close(sock);
+		c->sock = -1;
+		return -1;
+	}
+
+	if (c->width == 0 || c->height == 0 || fps == 0
+			|| (c->kind == CAMERA_V4L2 ? openV4l2(c) : openTimed(c)) < 0) {
+		camera_stop(c);
+		return -1;
+	}
+
+	// frames waiting in a large socket buffer could not be dropped: keep
+	// about two frames there, the backlog stays in the frame queue
+	sndbuf = 2 * (CAMERA_HEADER_LEN + c->width * c->height * 2);
+	setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	return 0;
+}
+
+/*!
+ * Stop capturing, close the source and the stream
+ */
+void camera_stop(struct camera *c) {
+	enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	int i;
+
+	if (c->sock >= 0) {
+		evloop_remove(c->loop, c->sock);
+		close(c->sock);
+		c->sock = -1;
+	}
+	if (c->timer >= 0) {
+		evloop_remove(c->loop, c->timer);
+		c->timer = -1;
+	}
+	if (c->kind == CAMERA_V4L2 && c->fd >= 0) {
+		evloop_remove(c->loop, c->fd);
+		ioctl(c->fd, VIDIOC_STREAMOFF, &type);
+	}
+
+	for (i = 0; i < c->nbufs; i++) {
+		if (c->bufs[i].start == NULL)
+			continue;
+		if (c->kind == CAMERA_V4L2)
+			munmap(c->bufs[i].start, c->bufs[i].length);
+		else
+			free(c->bufs[i].start);
+		c->bufs[i].start = NULL;
+	}
+	c->nbufs = 0;
+	c->queued = 0;
+	c->sending = -1;
+
+	if (c->fd >= 0) {
+		close(c->fd);
+		c->fd = -1;
+	}
+}
@@ -0,0 +1,96 @@
+/* \file camera.h
+
+ *
+ * \brief
+ *         In-process camera capture and streaming
+ *
+ * Frames come from a source: a V4L2 device with memory-mapped streaming
+ * buffers, a file of raw frames replayed in a loop, or a synthetic test
+ * pattern. The last two run on a timer at the requested rate and let the
+ * pipeline be measured on any Linux box.
+ *
+ * Captured frames wait in a bounded queue; when it is full the oldest one
+ * is dropped, so a slow link costs frames, never latency. Frames are sent
+ * on their own TCP connection, straight from the capture buffer (with
+ * MSG_ZEROCOPY when the kernel supports it), each preceded by a header,
+ * all fields big endian:
+ *
+ *   offset  size  field
+ *        0     4  length     frame data length in bytes
+ *        4     4  sequence   capture sequence number, gaps are drops
+ *        8     8  timestamp  capture time [us], CLOCK_MONOTONIC as the
+ *                            telemetry timestamps
+ *       16     2  width
+ *       18     2  height
+ *       20     4  fourcc     pixel format, V4L2_PIX_FMT_*
+ *
+ * Everything runs in the event loop thread.
+ *
+ */
+#ifndef CAMERA_H
+#define CAMERA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "evloop.h"
+#include "stats.h"
+
+#define CAMERA_BUFFERS 6     // capture buffers
+#define CAMERA_QUEUE_LEN 3   // frames waiting to be sent
+#define CAMERA_HEADER_LEN 24
+
+/* sources */
+enum {
+	CAMERA_V4L2,
+	CAMERA_FILE,     // raw frames of width * height * 2 bytes (YUYV)
+	CAMERA_SYNTHETIC
+};
+
+/* buffer states */
+enum {
+	BUF_FREE,     // owned by the driver, or unused for the other sources
+	BUF_QUEUED,   // captured, waiting to be sent
+	BUF_SENDING,  // being written to the socket
+	BUF_INFLIGHT  // sent with MSG_ZEROCOPY, the kernel still reads it
+};
+
+struct camera_buffer {
+	unsigned char *start;
+	size_t length;       // mapped or allocated size
+	size_t used;         // frame data length
+	uint64_t stamp_us;   // capture time
+	uint32_t seq;
+	uint32_t zc_id;      // last MSG_ZEROCOPY send of the frame
+	int state;           // BUF_*
+	unsigned char header[CAMERA_HEADER_LEN]; // kept until the frame is sent
+};
+
+struct camera {
+	int kind;            // CAMERA_*
+	const char *source;  // device or file name
+	int fd;              // device or file, -1 when closed
+	int timer;           // capture timer of the file and synthetic sources
+	int sock;            // streaming connection, -1 when not streaming
+	struct evloop *loop;
+	unsigned width, height, fps;
+	uint32_t fourcc;
+	struct camera_buffer bufs[CAMERA_BUFFERS];
+	int nbufs;
+	int queue[CAMERA_QUEUE_LEN]; // buffer indexes, oldest first
+	int queued;
+	int sending;         // buffer being sent, -1 if none
+	size_t sent;         // bytes of header and data already sent
+	int zerocopy;        // MSG_ZEROCOPY enabled on sock
+	uint32_t zc_next;    // id of the next MSG_ZEROCOPY send
+	uint32_t seq;
+	uint32_t captured, streamed, dropped;
+	struct histogram latency; // capture -> frame handed to the socket [ns]
+};
+
+void camera_init(struct camera *c, const char *source);
+int camera_start(struct camera *c, struct evloop *l, int sock, unsigned width,
+		unsigned height, unsigned fps);
+void camera_stop(struct camera *c);
+
+#endif /* CAMERA_H */
@@ -0,0 +1,220 @@
+/* \file connmgr.c
+
+ *
+ * \brief
+ *         Server connection manager, see connmgr.h
+ *
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "connmgr.h"
+#include "telemetry.h"
+
+static void attempt(struct connmgr *m);
+
+/*--------------------------------------------------------------------*/
+/*!
+ * Read the server list
+ *
+ * \param m manager
+ * \param path configuration file
+ * \param default_port port of the servers listed without one
+ *
+ * \return number of servers, -1 if the file cannot be read or lists none
+ */
+int connmgr_load(struct connmgr *m, const char *path, uint16_t default_port) {
+	char addr[100], next[100];
+	struct sockaddr_in *a;
+	FILE *file = fopen(path, "r");
+	long port;
+	char *end;
+	int have, valid;
+
+	m->count = 0;
+	if (file == NULL)
+		return -1;
+
+	have = fscanf(file, "%99s", addr) == 1;
+	while (have && m->count < CONN_MAX_ENDPOINTS) {
+		a = &m->endpoints[m->count];
+		memset(a, 0, sizeof(*a));
+		a->sin_family = AF_INET;
+		a->sin_port = htons(default_port);
+		valid = inet_pton(AF_INET, addr, &a->sin_addr) == 1;
+
+		// an optional port follows, otherwise the next address
+		have = fscanf(file, "%99s", next) == 1;
+		if (have) {
+			port = strtol(next, &end, 10);
+			if (*end == '\0' && port > 0 && port < 65536) {
+				a->sin_port = htons(port);
+				have = fscanf(file, "%99s", next) == 1;
+			}
+		}
+
+		if (valid)
+			m->count++;
+		else
+			fprintf(stderr, "ERROR: bad server address %s\n", addr);
+		strcpy(addr, next);
+	}
+	fclose(file);
+	return m->count > 0 ? m->count : -1;
+}
+
+/*!
+ * Delay before a new round of attempts
+ *
+ * \param round number of failed rounds, 0 after a lost connection
+ * \param rnd random value
+ *
+ * \return delay [us], between half and all of the exponential backoff
+ */
+uint64_t connmgr_backoff_us(unsigned round, uint32_t rnd) {
+	uint64_t delay = CONN_BACKOFF_MIN_US;
+
+	while (round-- > 0 && delay < CONN_BACKOFF_MAX_US)
+		delay *= 2;
+	if (delay > CONN_BACKOFF_MAX_US)
+		delay = CONN_BACKOFF_MAX_US;
+	return delay / 2 + rnd % (delay / 2 + 1);
+}
+
+/*!
+ * Next value of the jitter generator (xorshift32)
+ */
+static uint32_t jitter(struct connmgr *m) {
+	m->rnd ^= m->rnd << 13;
+	m->rnd ^= m->rnd >> 17;
+	m->rnd ^= m->rnd << 5;
+	return m->rnd;
+}
+
+/*!
+ * Wait before the next attempt
+ */
+static void waitRetry(struct connmgr *m, uint64_t delay_us) {
+	m->state = CONN_WAITING;
+	evloop_timer_set(m->timer, delay_us ? delay_us : 1, 0);
+}
+
+/*!
+ * Give up the current attempt and move to the next server, backing off
+ * after the last one
+ */
+static void failed(struct connmgr *m) {
+	if (m->fd >= 0) {
+		evloop_remove(m->loop, m->fd);
+		close(m->fd);
+		m->fd = -1;
+	}
+	m->current = (m->current + 1) % m->count;
+	if (m->current == 0)
+		waitRetry(m, connmgr_backoff_us(++m->round, jitter(m)));
+	else
+		waitRetry(m, 0);
+}
+
+/*!
+ * Socket callback while connecting
+ */
+static void onConnect(struct evloop *l, int fd, uint32_t events, void *arg) {
+	struct connmgr *m = arg;
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+		failed(m);
+		return;
+	}
+	if (!(events & EPOLLOUT))
+		return;
+
+	evloop_remove(l, fd);
+	evloop_timer_set(m->timer, 0, 0);
+	m->fd = -1;
+	m->state = CONN_UP;
+	m->round = 0;
+	m->connects++;
+	m->up(fd, &m->endpoints[m->current], m->arg);
+}
+
+/*!
+ * Timer callback: start an attempt, or time the current one out
+ */
+static void onTimer(struct evloop *l, int fd, uint32_t expirations, void *arg) {
+	struct connmgr *m = arg;
+
+	if (m->state == CONN_CONNECTING)
+		failed(m);
+	else if (m->state == CONN_WAITING)
+		attempt(m);
+}
+
+/*!
+ * Start connecting to the current server
+ */
+static void attempt(struct connmgr *m) {
+	struct sockaddr_in *a = &m->endpoints[m->current];
+
+	m->attempts++;
+	m->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (m->fd < 0) {
+		failed(m);
+		return;
+	}
+	if ((connect(m->fd, (struct sockaddr *) a, sizeof(*a)) < 0
+			&& errno != EINPROGRESS)
+			|| evloop_add(m->loop, m->fd, EPOLLOUT, onConnect, m) < 0) {
+		failed(m);
+		return;
+	}
+	m->state = CONN_CONNECTING;
+	evloop_timer_set(m->timer, CONN_TIMEOUT_US, 0);
+}
+
+/*!
+ * Start connecting, see connmgr_load() for the servers
+ *
+ * \param m manager
+ * \param l event loop
+ * \param up called with each new connection
+ * \param arg argument of up
+ *
+ * \return 0 on success, -1 on error
+ */
+int connmgr_start(struct connmgr *m, struct evloop *l, conn_up_fn up,
+		void *arg) {
+	if (m->count == 0)
+		return -1;
+	m->loop = l;
+	m->up = up;
+	m->arg = arg;
+	m->current = 0;
+	m->fd = -1;
+	m->round = 0;
+	m->rnd = ((uint32_t) monotonic_us() ^ (uint32_t) getpid() << 16) | 1;
+	m->timer = evloop_add_timer(l, onTimer, m);
+	if (m->timer < 0)
+		return -1;
+	attempt(m);
+	return 0;
+}
+
+/*!
+ * Report the loss of the connection given to the up callback (which the
+ * caller closes); a new connection to the same server is attempted after
+ * a short jittered delay
+ */
+void connmgr_lost(struct connmgr *m) {
+	if (m->state != CONN_UP)
+		return;
+	waitRetry(m, connmgr_backoff_us(0, jitter(m)));
+}
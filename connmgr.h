@@ -0,0 +1,71 @@
+/* \file connmgr.h
+
+ *
+ * \brief
+ *         Server connection manager
+ *
+ * Keeps trying the servers of the configuration file in turn until one
+ * accepts the connection. Connections are opened without blocking the
+ * event loop, each attempt is bounded by CONN_TIMEOUT_US, and after a
+ * whole round of failures the next round waits an exponentially growing,
+ * randomly jittered delay so that a fleet of robots does not hammer a
+ * restarting server in step.
+ *
+ * The configuration file lists the servers as address and port pairs
+ * separated by white space, the port being optional:
+ *
+ *   192.168.1.10 20000
+ *   192.168.1.11 20000
+ *
+ */
+#ifndef CONNMGR_H
+#define CONNMGR_H
+
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "evloop.h"
+
+#define CONN_MAX_ENDPOINTS 8
+#define CONN_TIMEOUT_US 2000000    // connect attempt
+#define CONN_BACKOFF_MIN_US 100000 // first retry delay
+#define CONN_BACKOFF_MAX_US 10000000
+
+/* states */
+enum {
+	CONN_WAITING,    // backing off before the next attempt
+	CONN_CONNECTING,
+	CONN_UP
+};
+
+/*!
+ * Connection callback
+ *
+ * \param fd connected non blocking socket, now owned by the callee
+ * \param addr server it is connected to
+ * \param arg user argument
+ */
+typedef void (*conn_up_fn)(int fd, const struct sockaddr_in *addr, void *arg);
+
+struct connmgr {
+	struct sockaddr_in endpoints[CONN_MAX_ENDPOINTS];
+	int count;
+	int current;        // endpoint being tried or connected
+	int state;          // CONN_*
+	int fd;             // socket being connected, -1 if none
+	int timer;          // backoff and connect timeout
+	unsigned round;     // failed rounds since the last connection
+	uint32_t rnd;       // jitter generator state
+	struct evloop *loop;
+	conn_up_fn up;
+	void *arg;
+	uint32_t attempts, connects;
+};
+
+int connmgr_load(struct connmgr *m, const char *path, uint16_t default_port);
+int connmgr_start(struct connmgr *m, struct evloop *l, conn_up_fn up,
+		void *arg);
+void connmgr_lost(struct connmgr *m);
+uint64_t connmgr_backoff_us(unsigned round, uint32_t rnd);
+
+#endif /* CONNMGR_H */
@@ -0,0 +1,252 @@
+/* \file evloop.c
+
+ *
+ * \brief
+ *         Single threaded epoll event loop, see evloop.h
+ *
+ */
+#include <errno.h>
+#include <stddef.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "evloop.h"
+
+/*--------------------------------------------------------------------*/
+/*!
+ * Create the epoll instance
+ *
+ * \return 0 on success, -1 on error
+ */
+int evloop_init(struct evloop *l) {
+	int i;
+
+	for (i = 0; i < EVLOOP_MAX_WATCHES; i++) {
+		l->watches[i].fd = -1;
+		l->watches[i].gen = 0;
+	}
+	l->running = 0;
+	l->epfd = epoll_create1(EPOLL_CLOEXEC);
+	return l->epfd < 0 ? -1 : 0;
+}
+
+/*!
+ * Close the epoll instance and the timers and signal descriptors it created
+ */
+void evloop_close(struct evloop *l) {
+	int i;
+
+	for (i = 0; i < EVLOOP_MAX_WATCHES; i++)
+		if (l->watches[i].fd >= 0 && l->watches[i].kind != WATCH_FD)
+			close(l->watches[i].fd);
+	close(l->epfd);
+}
+
+static struct ev_watch *findWatch(struct evloop *l, int fd) {
+	int i;
+
+	for (i = 0; i < EVLOOP_MAX_WATCHES; i++)
+		if (l->watches[i].fd == fd)
+			return &l->watches[i];
+	return NULL;
+}
+
+/*!
+ * epoll data of a watch: its slot and generation, so that an event pending
+ * for a removed descriptor is not delivered to a new watch in the same slot
+ */
+static inline uint64_t watchKey(const struct evloop *l,
+		const struct ev_watch *w) {
+	return (uint64_t) w->gen << 32 | (uint32_t) (w - l->watches);
+}
+
+static int addWatch(struct evloop *l, int fd, uint32_t events, int kind,
+		ev_handler cb, void *arg) {
+	struct ev_watch *w = findWatch(l, -1);
+	struct epoll_event ev;
+
+	if (w == NULL) {
+		errno = ENOSPC;
+		return -1;
+	}
+	w->gen++;
+	ev.events = events;
+	ev.data.u64 = watchKey(l, w);
+	if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		return -1;
+	w->fd = fd;
+	w->kind = kind;
+	w->cb = cb;
+	w->arg = arg;
+	return 0;
+}
+
+/*!
+ * Watch a file descriptor
+ *
+ * \param l loop
+ * \param fd descriptor, preferably non blocking
+ * \param events EPOLLIN, EPOLLOUT...
+ * \param cb callback
+ * \param arg callback argument
+ *
+ * \return 0 on success, -1 on error
+ */
+int evloop_add(struct evloop *l, int fd, uint32_t events, ev_handler cb,
+		void *arg) {
+	return addWatch(l, fd, events, WATCH_FD, cb, arg);
+}
+
+/*!
+ * Change the events watched on a descriptor
+ */
+int evloop_modify(struct evloop *l, int fd, uint32_t events) {
+	struct ev_watch *w = findWatch(l, fd);
+	struct epoll_event ev;
+
+	if (w == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+	ev.events = events;
+	ev.data.u64 = watchKey(l, w);
+	return epoll_ctl(l->epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+/*!
+ * Stop watching a descriptor; timers and signal descriptors are closed,
+ * other descriptors are not
+ */
+int evloop_remove(struct evloop *l, int fd) {
+	struct ev_watch *w = findWatch(l, fd);
+
+	if (w == NULL) {
+		errno = ENOENT;
+		return -1;
+	}
+	epoll_ctl(l->epfd, EPOLL_CTL_DEL, fd, NULL);
+	if (w->kind != WATCH_FD)
+		close(fd);
+	w->fd = -1;
+	return 0;
+}
+
+/*!
+ * Create a disarmed timer, see evloop_timer_set()
+ *
+ * \return the timer descriptor, -1 on error
+ */
+int evloop_add_timer(struct evloop *l, ev_handler cb, void *arg) {
+	int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	if (tfd < 0)
+		return -1;
+	if (addWatch(l, tfd, EPOLLIN, WATCH_TIMER, cb, arg) < 0) {
+		close(tfd);
+		return -1;
+	}
+	return tfd;
+}
+
+/*!
+ * Arm or disarm a timer
+ *
+ * \param tfd timer descriptor
+ * \param first_us delay before the first expiration, 0 disarms the timer
+ * \param period_us period of the following expirations, 0 for a one shot
+ *
+ * \return 0 on success, -1 on error
+ */
+int evloop_timer_set(int tfd, uint64_t first_us, uint64_t period_us) {
+	struct itimerspec its;
+
+	its.it_value.tv_sec = first_us / 1000000;
+	its.it_value.tv_nsec = (first_us % 1000000) * 1000;
+	its.it_interval.tv_sec = period_us / 1000000;
+	its.it_interval.tv_nsec = (period_us % 1000000) * 1000;
+	return timerfd_settime(tfd, 0, &its, NULL);
+}
+
+/*!
+ * Block the signals of mask and deliver them through the loop
+ *
+ * The callback gets the signal number as its events argument.
+ *
+ * \return the signal descriptor, -1 on error
+ */
+int evloop_add_signals(struct evloop *l, const sigset_t *mask, ev_handler cb,
+		void *arg) {
+	int sfd;
+
+	if (sigprocmask(SIG_BLOCK, mask, NULL) < 0)
+		return -1;
+	sfd = signalfd(-1, mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (sfd < 0)
+		return -1;
+	if (addWatch(l, sfd, EPOLLIN, WATCH_SIGNAL, cb, arg) < 0) {
+		close(sfd);
+		return -1;
+	}
+	return sfd;
+}
+
+/*!
+ * Read a timer or signal descriptor
+ *
+ * \return the value passed to the callback, 0 if nothing was pending
+ */
+static uint32_t drain(struct ev_watch *w) {
+	struct signalfd_siginfo si;
+	uint64_t expirations;
+
+	if (w->kind == WATCH_TIMER) {
+		if (read(w->fd, &expirations, sizeof(expirations))
+				!= sizeof(expirations))
+			return 0;
+		return expirations;
+	}
+	if (read(w->fd, &si, sizeof(si)) != sizeof(si))
+		return 0;
+	return si.ssi_signo;
+}
+
+/*!
+ * Dispatch events until evloop_stop() is called
+ */
+void evloop_run(struct evloop *l) {
+	struct epoll_event events[EVLOOP_MAX_WATCHES];
+	struct ev_watch *w;
+	uint32_t value;
+	int i, n;
+
+	l->running = 1;
+	while (l->running) {
+		n = epoll_wait(l->epfd, events, EVLOOP_MAX_WATCHES, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (i = 0; i < n && l->running; i++) {
+			w = &l->watches[(uint32_t) events[i].data.u64];
+			// removed by an earlier callback, maybe with the slot taken
+			// again since
+			if (w->fd < 0 || w->gen != events[i].data.u64 >> 32)
+				continue;
+			value = events[i].events;
+			if (w->kind != WATCH_FD && (value = drain(w)) == 0)
+				continue;
+			w->cb(l, w->fd, value, w->arg);
+		}
+	}
+	l->running = 0;
+}
+
+/*!
+ * Make evloop_run() return after the current callback
+ */
+void evloop_stop(struct evloop *l) {
+	l->running = 0;
+}
@@ -0,0 +1,72 @@
+/* \file evloop.h
+
+ *
+ * \brief
+ *         Single threaded epoll event loop
+ *
+ * File descriptors, periodic timers (timerfd) and signals (signalfd) are
+ * all watched by one epoll instance; callbacks run one after the other in
+ * the thread calling evloop_run(). Watches live in a fixed table, the loop
+ * never allocates.
+ *
+ */
+#ifndef EVLOOP_H
+#define EVLOOP_H
+
+#include <signal.h>
+#include <stdint.h>
+
+// may be raised at build time, for all the files including this header
+#ifndef EVLOOP_MAX_WATCHES
+#define EVLOOP_MAX_WATCHES 32
+#endif
+
+struct evloop;
+
+/*!
+ * Watch callback
+ *
+ * \param l loop
+ * \param fd watched file descriptor
+ * \param events epoll events, the number of expirations for a timer or the
+ *        signal number for signals
+ * \param arg user argument given at registration
+ */
+typedef void (*ev_handler)(struct evloop *l, int fd, uint32_t events,
+		void *arg);
+
+/* kinds of watch, timers and signals are read by the loop itself */
+enum {
+	WATCH_FD,
+	WATCH_TIMER,
+	WATCH_SIGNAL
+};
+
+struct ev_watch {
+	int fd;       // -1 when the slot is free
+	int kind;     // WATCH_*
+	uint32_t gen; // bumped each time the slot is taken
+	ev_handler cb;
+	void *arg;
+};
+
+struct evloop {
+	int epfd;
+	int running;
+	struct ev_watch watches[EVLOOP_MAX_WATCHES];
+};
+
+int evloop_init(struct evloop *l);
+void evloop_close(struct evloop *l);
+int evloop_add(struct evloop *l, int fd, uint32_t events, ev_handler cb,
+		void *arg);
+int evloop_modify(struct evloop *l, int fd, uint32_t events);
+int evloop_remove(struct evloop *l, int fd);
+int evloop_add_timer(struct evloop *l, ev_handler cb, void *arg);
+int evloop_timer_set(int tfd, uint64_t first_us, uint64_t period_us);
+int evloop_add_signals(struct evloop *l, const sigset_t *mask, ev_handler cb,
+		void *arg);
+void evloop_run(struct evloop *l);
+void evloop_stop(struct evloop *l);
+
+#endif /* EVLOOP_H */
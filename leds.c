@@ -0,0 +1,142 @@
+/* \file leds.c
+
+ *
+ * \brief
+ *         RGB led framebuffer and local animations, see leds.h
+ *
+ */
+#include <string.h>
+
+#include "leds.h"
+
+/*--------------------------------------------------------------------*/
+/*!
+ * Initialise the framebuffer, all leds off
+ *
+ * \param l leds
+ * \param write hardware write of the 9 channels (left R,G,B, ...)
+ */
+void leds_init(struct leds *l, void (*write)(const unsigned char *rgb)) {
+	memset(l, 0, sizeof(*l));
+	l->write = write;
+}
+
+/*!
+ * Set a static color, stopping the animation of that led
+ *
+ * \param l leds
+ * \param led 0..LED_COUNT-1
+ * \param rgb color
+ */
+void leds_set(struct leds *l, int led, const unsigned char rgb[3]) {
+	if (led < 0 || led >= LED_COUNT)
+		return;
+	l->anim[led].count = 0;
+	memcpy(l->want + 3 * led, rgb, 3);
+}
+
+/*!
+ * Start an animation
+ *
+ * \param l leds
+ * \param led 0..LED_COUNT-1
+ * \param keys keyframes, played in order
+ * \param count number of keyframes, 0 stops the animation
+ * \param repeat number of plays, 0 forever; the last color stays afterwards
+ * \param now_us current time
+ *
+ * \return 0 on success, -1 on invalid arguments
+ */
+int leds_animate(struct leds *l, int led, const struct led_keyframe *keys,
+		int count, unsigned repeat, uint64_t now_us) {
+	struct led_animation *a;
+	int i;
+
+	if (led < 0 || led >= LED_COUNT || count < 0 || count > LED_MAX_KEYFRAMES)
+		return -1;
+	a = &l->anim[led];
+	a->period_ms = 0;
+	for (i = 0; i < count; i++)
+		a->period_ms += keys[i].duration_ms;
+	if (count > 0 && a->period_ms == 0)
+		return -1;
+
+	memcpy(a->keys, keys, count * sizeof(*keys));
+	a->count = count;
+	a->repeat = repeat;
+	a->start_us = now_us;
+	return 0;
+}
+
+/*!
+ * Color of an animation at a given time
+ *
+ * \return 1 while the animation runs, 0 once it is over
+ */
+static int animationColor(const struct led_animation *a, uint64_t now_us,
+		unsigned char rgb[3]) {
+	const struct led_keyframe *k, *prev;
+	uint64_t elapsed = (now_us - a->start_us) / 1000;
+	uint32_t t;
+	int i, c;
+
+	if (a->repeat != 0 && elapsed >= (uint64_t) a->period_ms * a->repeat) {
+		memcpy(rgb, a->keys[a->count - 1].rgb, 3);
+		return 0;
+	}
+
+	t = elapsed % a->period_ms;
+	for (i = 0; t >= a->keys[i].duration_ms; i++)
+		t -= a->keys[i].duration_ms;
+	k = &a->keys[i];
+	prev = &a->keys[i > 0 ? i - 1 : a->count - 1];
+
+	for (c = 0; c < 3; c++) {
+		if (k->flags & KEYFRAME_FADE)
+			rgb[c] = prev->rgb[c]
+					+ ((int) k->rgb[c] - prev->rgb[c]) * (int) t / k->duration_ms;
+		else
+			rgb[c] = k->rgb[c];
+	}
+	return 1;
+}
+
+/*!
+ * Advance the animations and write the framebuffer if it changed
+ *
+ * \return 1 if animations are still running and need further ticks
+ */
+int leds_tick(struct leds *l, uint64_t now_us) {
+	int led, running = 0;
+
+	for (led = 0; led < LED_COUNT; led++) {
+		if (l->anim[led].count == 0)
+			continue;
+		if (animationColor(&l->anim[led], now_us, l->want + 3 * led))
+			running = 1;
+		else
+			l->anim[led].count = 0;
+	}
+
+	if (l->synced && memcmp(l->want, l->shown, sizeof(l->want)) == 0) {
+		l->skipped++;
+	} else {
+		l->write(l->want);
+		memcpy(l->shown, l->want, sizeof(l->shown));
+		l->synced = 1;
+		l->writes++;
+	}
+	return running;
+}
+
+/*!
+ * Tell whether an animation is running
+ */
+int leds_animating(const struct leds *l) {
+	int led;
+
+	for (led = 0; led < LED_COUNT; led++)
+		if (l->anim[led].count > 0)
+			return 1;
+	return 0;
+}
@@ -0,0 +1,56 @@
+/* \file leds.h
+
+ *
+ * \brief
+ *         RGB led framebuffer and local animations
+ *
+ * The three RGB leds are held in a framebuffer. Changes only mark it
+ * dirty; leds_tick() writes it to the hardware, once for all the changes
+ * made since the previous tick and only if it differs from what the leds
+ * already show. Animations are lists of keyframes played locally on each
+ * tick, so blinking or pulsing needs neither network nor extra bus traffic.
+ *
+ */
+#ifndef LEDS_H
+#define LEDS_H
+
+#include <stdint.h>
+
+#define LED_COUNT 3
+#define LED_MAX_KEYFRAMES 16
+
+/* keyframe flags */
+#define KEYFRAME_FADE 0x01 // ramp from the previous color instead of a step
+
+struct led_keyframe {
+	uint16_t duration_ms;
+	unsigned char rgb[3];
+	unsigned char flags;
+};
+
+struct led_animation {
+	struct led_keyframe keys[LED_MAX_KEYFRAMES];
+	int count;          // 0 when no animation runs
+	unsigned repeat;    // number of plays, 0 forever
+	uint64_t start_us;
+	uint32_t period_ms; // sum of the keyframe durations
+};
+
+struct leds {
+	unsigned char want[3 * LED_COUNT];  // framebuffer
+	unsigned char shown[3 * LED_COUNT]; // last written to the hardware
+	int synced;                          // 0 until the first write
+	struct led_animation anim[LED_COUNT];
+	void (*write)(const unsigned char rgb[3 * LED_COUNT]);
+	uint32_t writes;   // hardware writes
+	uint32_t skipped;  // ticks with nothing to write
+};
+
+void leds_init(struct leds *l, void (*write)(const unsigned char *rgb));
+void leds_set(struct leds *l, int led, const unsigned char rgb[3]);
+int leds_animate(struct leds *l, int led, const struct led_keyframe *keys,
+		int count, unsigned repeat, uint64_t now_us);
+int leds_tick(struct leds *l, uint64_t now_us);
+int leds_animating(const struct leds *l);
+
+#endif /* LEDS_H */
@@ -0,0 +1,178 @@
+/* \file linefollow.c
+
+ *
+ * \brief
+ *         Local line follower, see linefollow.h
+ *
+ */
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+#include "linefollow.h"
+
+#define LINE_GROUND_FIRST 8 // first ground sensor of kh4_proximity_ir()
+
+/* lateral position of the ground sensors, left is positive [mm] */
+static const double groundY[4] = { 28, 9, -9, -28 };
+
+/*--------------------------------------------------------------------*/
+/*!
+ * Lateral position of the line under the ground sensors
+ *
+ * \param t reading of the proximity sensors
+ * \param lost set to 1 if no line can be told, 0 otherwise
+ *
+ * \return the position [mm], positive to the left, 0 when lost
+ */
+double line_error(const struct telemetry *t, int *lost) {
+	int i, v, bright = 0, dark = 0x7FFF;
+	double weight, sum = 0, moment = 0;
+
+	for (i = 0; i < 4; i++) {
+		v = t->proximity[LINE_GROUND_FIRST + i];
+		if (v > bright)
+			bright = v;
+		if (v < dark)
+			dark = v;
+	}
+	*lost = bright - dark < LINE_MIN_CONTRAST;
+	if (*lost)
+		return 0;
+	for (i = 0; i < 4; i++) {
+		weight = bright - t->proximity[LINE_GROUND_FIRST + i];
+		sum += weight;
+		moment += weight * groundY[i];
+	}
+	return moment / sum;
+}
+
+/*!
+ * Read the ground sensors and steer once
+ *
+ * \param dt time since the previous tick [s]
+ */
+static void tick(struct line_follower *lf, double dt) {
+	struct line_config c;
+	struct telemetry t;
+	double e, de, u, limit;
+	int lost;
+
+	pthread_mutex_lock(&lf->lock);
+	c = lf->config;
+	pthread_mutex_unlock(&lf->lock);
+
+	lf->read(&t);
+	e = line_error(&t, &lost);
+	if (lost) {
+		// turn towards the side the line was last seen on
+		u = lf->error >= 0 ? c.base_speed / 2.0 : -c.base_speed / 2.0;
+		lf->drive(c.base_speed / 2 - u, c.base_speed / 2 + u);
+	} else {
+		de = lf->lost || dt <= 0 ? 0 : (e - lf->error) / dt;
+		lf->integral += e * dt;
+		// no windup: the integral term alone asks the base speed at most
+		if (c.ki != 0) {
+			limit = fabs(c.base_speed / c.ki);
+			lf->integral = fmax(-limit, fmin(limit, lf->integral));
+		}
+		u = c.kp * e + c.ki * lf->integral + c.kd * de;
+		lf->drive(c.base_speed - u, c.base_speed + u);
+	}
+
+	pthread_mutex_lock(&lf->lock);
+	if (!lost)
+		lf->error = e;
+	lf->lost = lost;
+	lf->ticks++;
+	if (lost)
+		lf->lost_ticks++;
+	pthread_mutex_unlock(&lf->lock);
+}
+
+static void *lineThread(void *arg) {
+	struct line_follower *lf = arg;
+	struct timespec ts;
+	uint64_t next = monotonic_ns(), now, prev = 0, period;
+
+	while (__atomic_load_n(&lf->running, __ATOMIC_RELAXED)) {
+		now = monotonic_ns();
+		pthread_mutex_lock(&lf->lock);
+		period = 1000000000ULL / lf->config.rate_hz;
+		if (prev != 0) {
+			hist_record(&lf->period, now - prev);
+			hist_record(&lf->lateness, now - next);
+		}
+		pthread_mutex_unlock(&lf->lock);
+
+		tick(lf, prev != 0 ? (now - prev) * 1e-9 : 0);
+		prev = now;
+
+		// keep a fixed cadence, but do not try to catch up after a stall
+		next += period;
+		now = monotonic_ns();
+		if (next <= now)
+			next = now + period;
+		ts.tv_sec = next / 1000000000;
+		ts.tv_nsec = next % 1000000000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+			;
+	}
+	return NULL;
+}
+
+/*!
+ * Start following the line
+ *
+ * The config, read and drive fields must be set and the lock initialised
+ * before the call. The timing statistics start over.
+ *
+ * \return 0 on success, 1 if already following, -1 if the thread could not
+ *         be created
+ */
+int line_start(struct line_follower *lf) {
+	if (lf->running)
+		return 1;
+	pthread_mutex_lock(&lf->lock);
+	lf->integral = 0;
+	lf->error = 0;
+	lf->lost = 0;
+	lf->ticks = lf->lost_ticks = 0;
+	hist_reset(&lf->period);
+	hist_reset(&lf->lateness);
+	pthread_mutex_unlock(&lf->lock);
+
+	lf->running = 1;
+	if (pthread_create(&lf->thread, NULL, lineThread, lf) != 0) {
+		lf->running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+/*!
+ * Stop following and wait for the control thread; the motors keep the
+ * last speeds written
+ */
+void line_stop(struct line_follower *lf) {
+	if (!lf->running)
+		return;
+	__atomic_store_n(&lf->running, 0, __ATOMIC_RELAXED);
+	pthread_join(lf->thread, NULL);
+}
+
+/*!
+ * \return 1 while following the line
+ */
+int line_following(struct line_follower *lf) {
+	return lf->running;
+}
+
+/*!
+ * Change the gains, base speed or rate, also while following
+ */
+void line_configure(struct line_follower *lf, const struct line_config *c) {
+	pthread_mutex_lock(&lf->lock);
+	lf->config = *c;
+	pthread_mutex_unlock(&lf->lock);
+}
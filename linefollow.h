@@ -0,0 +1,64 @@
+/* \file linefollow.h
+
+ *
+ * \brief
+ *         Local line follower
+ *
+ * While following, a dedicated thread reads the four ground IR sensors
+ * (proximity sensors 8 to 11) at a fixed rate and steers the robot with a
+ * PID controller so that a dark line stays under the middle of the robot.
+ *
+ * The error is the lateral position of the line under the sensors [mm],
+ * positive to the left: the centroid of the sensor positions weighted by
+ * how much darker each one is than the brightest. The correction is added
+ * to the right wheel speed and taken from the left one around the base
+ * speed; the integral is bounded so that its term stays within the base
+ * speed. When the four readings are too close to tell a line, the line is
+ * lost and the robot keeps turning towards the side it was last seen on.
+ *
+ */
+#ifndef LINEFOLLOW_H
+#define LINEFOLLOW_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "sampler.h"
+#include "stats.h"
+
+#define LINE_DEFAULT_HZ 100
+#define LINE_MAX_HZ 1000
+#define LINE_MIN_CONTRAST 150 // raw ground IR difference telling a line
+
+struct line_config {
+	unsigned rate_hz;    // control rate
+	int base_speed;      // forward speed on a straight line
+	double kp;           // [speed / mm]
+	double ki;           // [speed / (mm s)]
+	double kd;           // [speed / (mm / s)]
+};
+
+typedef void (*line_drive_fn)(int left, int right);
+
+struct line_follower {
+	struct line_config config;
+	sampler_read_fn read;      // proximity IR read, ground sensors included
+	line_drive_fn drive;       // motor speed write
+	pthread_mutex_t lock;      // config and statistics
+	double integral;           // control thread only
+	double error;              // last line position [mm]
+	int lost;                  // line lost at the last tick
+	uint32_t ticks, lost_ticks;
+	struct histogram period;   // time between ticks [ns]
+	struct histogram lateness; // tick lateness [ns]
+	int running;
+	pthread_t thread;
+};
+
+int line_start(struct line_follower *lf);
+void line_stop(struct line_follower *lf);
+int line_following(struct line_follower *lf);
+void line_configure(struct line_follower *lf, const struct line_config *c);
+double line_error(const struct telemetry *t, int *lost);
+
+#endif /* LINEFOLLOW_H */
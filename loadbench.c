@@ -0,0 +1,485 @@
+/* \file loadbench.c
+
+ *
+ * \brief
+ *         End to end load benchmark of the command and telemetry protocol
+ *
+ * Runs a reference server and starts a fleet of clients against it on this
+ * machine, each one the client built with the simulated robot (see
+ * robot_sim.c). Once every client is connected and a warm-up period has
+ * passed, the server replays a traffic mix for the requested duration:
+ *
+ *   teleop     OP_VELOCITY commands at the command rate, the speeds of a
+ *              joystick swept back and forth
+ *   telemetry  a push subscription of every sensor group at the telemetry
+ *              rate
+ *   mixed      both at once
+ *
+ * The commands of a rate period are spread over the period rather than sent
+ * to every client at the same instant, as a fleet would. The results are
+ * printed as one JSON object: commands and telemetry frames per second over
+ * the measurement and the command round trip time percentiles, as seen by
+ * the server.
+ *
+ * compile with the client (see prog-template.c) built as khepera4_sim:
+ gcc -DEVLOOP_MAX_WATCHES=1100 loadbench.c protocol.c evloop.c stats.c -o loadbench -lm
+
+ * usage: loadbench [-n clients] [-m teleop|telemetry|mixed] [-d seconds]
+ *                  [-w warm-up seconds] [-r command rate] [-t telemetry rate]
+ *                  [-p port] [-c client program]
+ *
+ * With -n 0 no client is started and the measurement begins after the
+ * warm-up, so the server can also be pointed at real robots. Clients that
+ * have not connected after BENCH_CONNECT_S are left out.
+ *
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+
+#include "evloop.h"
+#include "protocol.h"
+#include "stats.h"
+#include "telemetry.h"
+
+#define BENCH_MAX_CLIENTS (EVLOOP_MAX_WATCHES - 8) // loop slots left for peers
+#define BENCH_INFLIGHT 256   // commands awaiting a reply per client
+#define BENCH_OUT_LEN 4096   // queued bytes per client
+#define BENCH_SLICES 10      // rate period divisions the clients are spread on
+#define BENCH_MAX_SPEED 300  // teleop speed amplitude
+#define BENCH_CONNECT_S 20   // longest wait for the whole fleet
+
+struct mix {
+	const char *name;
+	unsigned command_hz;
+	unsigned telemetry_hz;
+};
+
+static const struct mix mixes[] = {
+	{ "teleop", 50, 0 },
+	{ "telemetry", 0, 100 },
+	{ "mixed", 20, 50 },
+};
+
+struct peer {
+	int fd;
+	int index;
+	struct frame_parser parser;
+	uint64_t sent_ns[BENCH_INFLIGHT]; // by seq modulo BENCH_INFLIGHT, 0 when
+	                                  // answered
+	unsigned inflight;
+	uint16_t seq;
+	unsigned char out[BENCH_OUT_LEN];
+	size_t out_len;
+};
+
+static struct peer *peers[BENCH_MAX_CLIENTS];
+static int npeers, connected, disconnected;
+
+static struct evloop loop;
+static int listenFd, commandTimer, phaseTimer;
+static unsigned commandHz, telemetryHz;
+static unsigned slice;
+static int expected;         // clients started, 0 for an external fleet
+static int measuring;
+static double warmupS = 2, durationS = 10;
+static uint64_t startNs, endNs;
+
+static struct {
+	uint64_t commands;       // sent
+	uint64_t replies;
+	uint64_t failed;         // replies with an error status
+	uint64_t skipped;        // not sent, BENCH_INFLIGHT or queue full
+	uint64_t telemetry;      // telemetry event frames received
+	uint64_t bytes_in, bytes_out;
+	struct histogram rtt;    // command sent -> reply received [ns]
+} counters;
+
+/*--------------------------------------------------------------------*/
+/*!
+ * Write as much of the peer queue as the socket takes
+ *
+ * \return 0 on success, -1 if the connection failed
+ */
+static int flushPeer(struct peer *p) {
+	ssize_t n;
+
+	while (p->out_len > 0) {
+		n = send(p->fd, p->out, p->out_len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			return -1;
+		}
+		memmove(p->out, p->out + n, p->out_len - n);
+		p->out_len -= n;
+		counters.bytes_out += n;
+	}
+	return evloop_modify(&loop, p->fd,
+			EPOLLIN | (p->out_len > 0 ? EPOLLOUT : 0));
+}
+
+/*!
+ * Queue a command to a peer
+ *
+ * \return 0 on success, -1 if it was skipped
+ */
+static int queueCommand(struct peer *p, uint8_t opcode,
+		const unsigned char *payload, uint32_t length) {
+	unsigned char *out = p->out + p->out_len;
+	uint16_t seq = p->seq;
+
+	if (p->inflight >= BENCH_INFLIGHT
+			|| p->out_len + FRAME_HEADER_LEN + length > BENCH_OUT_LEN) {
+		counters.skipped++;
+		return -1;
+	}
+	frame_encode_header(out, opcode, seq, length);
+	memcpy(out + FRAME_HEADER_LEN, payload, length);
+	p->out_len += FRAME_HEADER_LEN + length;
+	p->sent_ns[seq % BENCH_INFLIGHT] = monotonic_ns();
+	p->inflight++;
+	p->seq++;
+	counters.commands++;
+	return 0;
+}
+
+static void dropPeer(struct peer *p) {
+	evloop_remove(&loop, p->fd);
+	close(p->fd);
+	peers[p->index] = NULL;
+	free(p);
+	connected--;
+	disconnected++;
+}
+
+static void handleFrame(struct peer *p, const struct frame *f) {
+	uint64_t *sent;
+
+	if (f->hdr.opcode == OP_EVT_TELEMETRY
+			|| f->hdr.opcode == OP_EVT_TELEMETRY_DELTA) {
+		counters.telemetry++;
+		return;
+	}
+	if (!(f->hdr.opcode & OP_REPLY))
+		return;
+	sent = &p->sent_ns[f->hdr.seq % BENCH_INFLIGHT];
+	if (*sent != 0) {
+		hist_record(&counters.rtt, monotonic_ns() - *sent);
+		*sent = 0;
+		p->inflight--;
+	}
+	counters.replies++;
+	if (f->hdr.length < 1 || f->payload[0] != ST_OK)
+		counters.failed++;
+}
+
+/*!
+ * Peer socket callback: read replies and events, send what is queued
+ */
+static void onPeer(struct evloop *l, int fd, uint32_t events, void *arg) {
+	struct peer *p = arg;
+	struct frame f;
+	unsigned char *space;
+	size_t room;
+	ssize_t n;
+	int rc;
+
+	if ((events & EPOLLOUT) && flushPeer(p) < 0) {
+		dropPeer(p);
+		return;
+	}
+	if (!(events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+		return;
+	for (;;) {
+		space = frame_parser_space(&p->parser, &room);
+		n = read(fd, space, room);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno == EAGAIN)
+			return;
+		if (n <= 0) {
+			dropPeer(p);
+			return;
+		}
+		counters.bytes_in += n;
+		frame_parser_commit(&p->parser, n);
+		while ((rc = frame_parser_next(&p->parser, &f)) > 0)
+			handleFrame(p, &f);
+		if (rc < 0) {
+			fprintf(stderr, "client %d: protocol error\n", p->index);
+			dropPeer(p);
+			return;
+		}
+	}
+}
+
+/*!
+ * Start the measurement, or end it
+ */
+static void onPhaseTimer(struct evloop *l, int fd, uint32_t events,
+		void *arg) {
+	if (measuring) {
+		endNs = monotonic_ns();
+		evloop_stop(l);
+		return;
+	}
+	memset(&counters, 0, sizeof(counters));
+	measuring = 1;
+	startNs = monotonic_ns();
+	evloop_timer_set(phaseTimer, (uint64_t) (durationS * 1e6), 0);
+	fprintf(stderr, "measuring %d clients for %.1f s\n", connected,
+			durationS);
+}
+
+/*!
+ * Listening socket callback: accept clients and subscribe them
+ */
+static void onAccept(struct evloop *l, int fd, uint32_t events, void *arg) {
+	unsigned char sub[5];
+	struct peer *p;
+	int s, i, one = 1;
+
+	while ((s = accept(fd, NULL, NULL)) >= 0) {
+		fcntl(s, F_SETFL, O_NONBLOCK);
+		fcntl(s, F_SETFD, FD_CLOEXEC);
+		for (i = 0; i < BENCH_MAX_CLIENTS && peers[i] != NULL; i++)
+			;
+		p = i < BENCH_MAX_CLIENTS ? calloc(1, sizeof(*p)) : NULL;
+		if (p == NULL || evloop_add(l, s, EPOLLIN, onPeer, p) < 0) {
+			fprintf(stderr, "too many clients, connection refused\n");
+			free(p);
+			close(s);
+			continue;
+		}
+		setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		p->fd = s;
+		p->index = i;
+		frame_parser_init(&p->parser);
+		peers[i] = p;
+		if (i >= npeers)
+			npeers = i + 1;
+		connected++;
+
+		if (telemetryHz > 0) {
+			put_be16(sub, GROUP_ALL);
+			put_be16(sub + 2, telemetryHz);
+			sub[4] = ENCODING_PLAIN;
+			queueCommand(p, OP_SUBSCRIBE, sub, sizeof(sub));
+			if (flushPeer(p) < 0)
+				dropPeer(p);
+		}
+		// warm up once the whole fleet is there
+		if (expected > 0 && connected == expected && !measuring)
+			evloop_timer_set(phaseTimer, (uint64_t) (warmupS * 1e6), 0);
+	}
+}
+
+/*!
+ * Command timer callback: send the commands of one slice of the clients
+ */
+static void onCommandTimer(struct evloop *l, int fd, uint32_t events,
+		void *arg) {
+	unsigned char v[8];
+	double t = monotonic_ns() * 1e-9;
+	int i, left, right;
+
+	for (i = slice; i < npeers; i += BENCH_SLICES) {
+		struct peer *p = peers[i];
+
+		if (p == NULL)
+			continue;
+		// joystick swept forward, back and sideways, out of phase per robot
+		left = (int) (BENCH_MAX_SPEED * sin(t + i));
+		right = (int) (BENCH_MAX_SPEED * sin(1.3 * t + i));
+		put_be32(v, (uint32_t) left);
+		put_be32(v + 4, (uint32_t) right);
+		queueCommand(p, OP_VELOCITY, v, sizeof(v));
+		if (flushPeer(p) < 0)
+			dropPeer(p);
+	}
+	slice = (slice + 1) % BENCH_SLICES;
+}
+
+static void onSignal(struct evloop *l, int fd, uint32_t events, void *arg) {
+	endNs = monotonic_ns();
+	evloop_stop(l);
+}
+
+/*!
+ * Start a client connecting to the server of a configuration file
+ *
+ * \return the child pid, -1 on error
+ */
+static pid_t spawnClient(const char *program, const char *config) {
+	pid_t pid = fork();
+	int null;
+
+	if (pid != 0)
+		return pid;
+	prctl(PR_SET_PDEATHSIG, SIGTERM); // do not outlive the benchmark
+	null = open("/dev/null", O_RDWR);
+	dup2(null, 0);
+	dup2(null, 1);
+	dup2(null, 2);
+	execl(program, program, "-f", config, (char *) NULL);
+	_exit(127);
+}
+
+static void printResults(const char *mixName) {
+	double s = startNs != 0 && endNs > startNs ? (endNs - startNs) * 1e-9 : 0;
+
+	printf("{\"mix\": \"%s\", \"clients\": %d, \"connected\": %d, "
+			"\"disconnected\": %d, \"command_rate_hz\": %u, "
+			"\"telemetry_rate_hz\": %u, \"duration_s\": %.3f, ", mixName,
+			expected, connected, disconnected, commandHz, telemetryHz, s);
+	printf("\"commands\": %llu, \"replies\": %llu, \"failed\": %llu, "
+			"\"skipped\": %llu, \"telemetry_frames\": %llu, ",
+			(unsigned long long) counters.commands,
+			(unsigned long long) counters.replies,
+			(unsigned long long) counters.failed,
+			(unsigned long long) counters.skipped,
+			(unsigned long long) counters.telemetry);
+	printf("\"commands_per_s\": %.1f, \"telemetry_frames_per_s\": %.1f, "
+			"\"bytes_in_per_s\": %.0f, \"bytes_out_per_s\": %.0f, ",
+			s > 0 ? counters.replies / s : 0,
+			s > 0 ? counters.telemetry / s : 0,
+			s > 0 ? counters.bytes_in / s : 0,
+			s > 0 ? counters.bytes_out / s : 0);
+	printf("\"rtt_ns\": {\"p50\": %llu, \"p99\": %llu, \"p999\": %llu, "
+			"\"max\": %llu}}\n",
+			(unsigned long long) hist_percentile(&counters.rtt, 50),
+			(unsigned long long) hist_percentile(&counters.rtt, 99),
+			(unsigned long long) hist_percentile(&counters.rtt, 99.9),
+			(unsigned long long) counters.rtt.max);
+}
+
+int main(int argc, char *argv[]) {
+	const char *program = "./khepera4_sim";
+	const struct mix *mix = &mixes[2];
+	char config[] = "/tmp/loadbench.XXXXXX";
+	struct sockaddr_in addr;
+	socklen_t addrLen = sizeof(addr);
+	sigset_t signals;
+	pid_t *children;
+	int i, n, cfd, port = 0, one = 1, rateHz = -1, telemetryRate = -1;
+	FILE *f;
+
+	expected = 100;
+	for (i = 1; i < argc - 1; i += 2) {
+		if (strcmp(argv[i], "-n") == 0)
+			expected = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-m") == 0) {
+			for (n = 0; n < (int) (sizeof(mixes) / sizeof(mixes[0])); n++)
+				if (strcmp(argv[i + 1], mixes[n].name) == 0)
+					break;
+			if (n == sizeof(mixes) / sizeof(mixes[0])) {
+				fprintf(stderr, "unknown mix %s\n", argv[i + 1]);
+				return 1;
+			}
+			mix = &mixes[n];
+		} else if (strcmp(argv[i], "-d") == 0)
+			durationS = atof(argv[i + 1]);
+		else if (strcmp(argv[i], "-w") == 0)
+			warmupS = atof(argv[i + 1]);
+		else if (strcmp(argv[i], "-r") == 0)
+			rateHz = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-t") == 0)
+			telemetryRate = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-p") == 0)
+			port = atoi(argv[i + 1]);
+		else if (strcmp(argv[i], "-c") == 0)
+			program = argv[i + 1];
+	}
+	if (expected < 0 || expected > BENCH_MAX_CLIENTS) {
+		fprintf(stderr, "at most %d clients, see EVLOOP_MAX_WATCHES\n",
+				BENCH_MAX_CLIENTS);
+		return 1;
+	}
+	commandHz = rateHz >= 0 ? (unsigned) rateHz : mix->command_hz;
+	telemetryHz = telemetryRate >= 0 ? (unsigned) telemetryRate
+			: mix->telemetry_hz;
+
+	listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(expected > 0 ? INADDR_LOOPBACK : INADDR_ANY);
+	addr.sin_port = htons(port);
+	setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (listenFd < 0 || bind(listenFd, (struct sockaddr *) &addr, sizeof(addr))
+			< 0 || listen(listenFd, 1024) < 0
+			|| getsockname(listenFd, (struct sockaddr *) &addr, &addrLen) < 0) {
+		perror("server socket");
+		return 1;
+	}
+
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigprocmask(SIG_BLOCK, &signals, NULL);
+	if (evloop_init(&loop) < 0
+			|| evloop_add(&loop, listenFd, EPOLLIN, onAccept, NULL) < 0
+			|| (phaseTimer = evloop_add_timer(&loop, onPhaseTimer, NULL)) < 0
+			|| (commandTimer = evloop_add_timer(&loop, onCommandTimer, NULL))
+					< 0 || evloop_add_signals(&loop, &signals, onSignal, NULL)
+			< 0) {
+		perror("event loop");
+		return 1;
+	}
+	if (commandHz > 0)
+		evloop_timer_set(commandTimer, 1,
+				1000000 / (commandHz * BENCH_SLICES));
+	// measure with the clients that made it if some never connect
+	evloop_timer_set(phaseTimer, (uint64_t) ((warmupS
+			+ (expected > 0 ? BENCH_CONNECT_S : 0)) * 1e6), 0);
+
+	// the clients read the server address from a configuration file
+	children = calloc(expected + 1, sizeof(*children));
+	if (expected > 0) {
+		if ((cfd = mkstemp(config)) < 0 || (f = fdopen(cfd, "w")) == NULL) {
+			perror("client configuration");
+			return 1;
+		}
+		fprintf(f, "127.0.0.1 %u\n", ntohs(addr.sin_port));
+		fclose(f);
+	}
+	for (i = 0; i < expected; i++) {
+		children[i] = spawnClient(program, config);
+		if (children[i] < 0) {
+			perror("fork");
+			expected = i;
+			break;
+		}
+	}
+	fprintf(stderr, "%s mix, %d clients, server port %u\n", mix->name,
+			expected, ntohs(addr.sin_port));
+
+	evloop_run(&loop);
+
+	printResults(mix->name);
+	fflush(stdout);
+
+	for (i = 0; i < expected; i++)
+		kill(children[i], SIGTERM);
+	for (i = 0; i < expected; i++)
+		waitpid(children[i], NULL, 0);
+	if (expected > 0)
+		unlink(config);
+	evloop_close(&loop);
+	return 0;
+}
@@ -0,0 +1,321 @@
+/* \file microbench.c
+
+ *
+ * \brief
+ *         Microbenchmarks of the client hot paths
+ *
+ * Each benchmark times one operation of the client alone, outside of the
+ * network and of the robot: frame parsing, command dispatch, color lookup,
+ * sensor reads (buffer decoding included), telemetry formatting and
+ * timeval_diff(). The client is compiled in (its main() renamed) and linked
+ * with the robot backend below, which answers every call at once from
+ * canned buffers, so a slower stage shows up here before it gets lost in
+ * the end to end figures.
+ *
+ * For every benchmark the report gives the number of operations timed,
+ * [ns/op], heap allocations per operation (malloc, calloc and realloc
+ * calls, glibc only) and user space instructions per operation (from the
+ * perf events of the kernel, "-" where they are not available).
+ *
+ * compile for the host:
+ gcc -O2 microbench.c protocol.c telemetry.c sampler.c evloop.c stats.c sensorcache.c leds.c upload.c script.c camera.c connmgr.c udpctl.c reflex.c linefollow.c trajectory.c odometry.c ultrasound.c -o microbench -lpthread -lm
+
+ * or the robot:
+ arm-angstrom-linux-gnueabi-gcc -O2 microbench.c protocol.c telemetry.c sampler.c evloop.c stats.c sensorcache.c leds.c upload.c script.c camera.c connmgr.c udpctl.c reflex.c linefollow.c trajectory.c odometry.c ultrasound.c -o microbench -lpthread -lm
+
+ * usage: microbench [benchmark name prefix]
+ *
+ */
+#define main khepera4_main
+#include "prog-template.c"
+#undef main
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#define BENCH_MIN_NS 200000000ULL // time each benchmark at least that long
+
+/*--------------------------------------------------------------------*/
+/*
+ * Allocation counting, by replacing the glibc allocator entry points
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+extern void __libc_free(void *p);
+
+static unsigned long allocations;
+
+void *malloc(size_t size) {
+	allocations++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+	allocations++;
+	return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+	allocations++;
+	return __libc_realloc(p, size);
+}
+
+void free(void *p) {
+	__libc_free(p);
+}
+
+/*
+ * Robot backend: canned buffers, no bus
+ */
+static const char cannedProximity[24] = { 10, 0, 20, 0, 200, 3, 255, 3, 5, 0,
+		7, 0, 9, 0, 11, 0, 182, 3, 120, 0, 118, 0, 190, 3 };
+static const char cannedAmbient[24] = { 60, 15, 61, 15, 62, 15, 63, 15, 64,
+		15, 65, 15, 66, 15, 67, 15, 68, 15, 69, 15, 70, 15, 71, 15 };
+static const char cannedUs[10] = { 28, 0, 108, 0, 93, 0, 50, 0, 232, 3 };
+static const char cannedBattery[12] = { 0, 120, 5, 80, 128, 248, 128, 248, 0,
+		25, 248, 2 };
+
+int robot_init(int argc, char *argv[]) { return 0; }
+int robot_revision(char *buf) { buf[0] = 0x21; return 0; }
+int robot_set_mode(int mode) { return 0; }
+int robot_set_speed(int left, int right) { return 0; }
+int robot_set_position(int left, int right) { return 0; }
+int robot_get_speed(int *left, int *right) { *left = *right = 300; return 0; }
+int robot_get_position(int *left, int *right) { *left = *right = 44985; return 0; }
+int robot_reset_encoders(void) { return 0; }
+int robot_set_speed_profile(int acc_inc, int acc_div, int min_speed_acc,
+		int min_speed_dec, int max_speed) { return 0; }
+int robot_configure_pid(int kp, int ki, int kd) { return 0; }
+int robot_set_position_margin(int margin) { return 0; }
+int robot_proximity_ir(char *buf) { memcpy(buf, cannedProximity, 24); return 0; }
+int robot_ambient_ir(char *buf) { memcpy(buf, cannedAmbient, 24); return 0; }
+int robot_measure_us(char *buf) { memcpy(buf, cannedUs, 10); return 0; }
+int robot_activate_us(int mask) { return 0; }
+int robot_measure_gyro(char *buf) { memset(buf, 0, 60); return 0; }
+int robot_battery_status(char *buf) { memcpy(buf, cannedBattery, 12); return 0; }
+int robot_battery_charge(void) { return 0; }
+int robot_set_rgb_leds(char left_r, char left_g, char left_b, char right_r,
+		char right_g, char right_b, char back_r, char back_g, char back_b) {
+	return 0;
+}
+void robot_clear_screen(void) { }
+void robot_restore_terminal(void) { }
+
+/*
+ * Benchmarks, each runs n operations
+ */
+static volatile unsigned long sink; // keeps the results alive
+
+static unsigned char formatFrame[FRAME_HEADER_LEN + 1];
+
+static void benchParse(long n) {
+	static struct frame_parser p;
+	unsigned char *space;
+	struct frame f;
+	size_t room;
+	long i;
+
+	frame_parser_init(&p);
+	for (i = 0; i < n; i++) {
+		space = frame_parser_space(&p, &room);
+		memcpy(space, formatFrame, sizeof(formatFrame));
+		frame_parser_commit(&p, sizeof(formatFrame));
+		if (frame_parser_next(&p, &f) > 0)
+			sink += f.hdr.length;
+	}
+}
+
+static void benchDispatch(long n) {
+	struct frame f;
+	struct reply r;
+	long i;
+
+	frame_decode_header(formatFrame, &f.hdr);
+	f.payload = formatFrame + FRAME_HEADER_LEN;
+	for (i = 0; i < n; i++) {
+		r.data = NULL;
+		r.len = 0;
+		sink += runCommand(&f, &r);
+	}
+}
+
+static void benchColor(long n) {
+	static const char *names[8] = { "off", "red", "blue", "yellow", "pink",
+			"purple", "orange", "black" };
+	long i;
+
+	for (i = 0; i < n; i++)
+		sink += findColor(names[i & 7]) != NULL;
+}
+
+static void benchProximity(long n) {
+	struct telemetry t;
+	long i;
+
+	for (i = 0; i < n; i++) {
+		proximitySensor(&t);
+		sink += t.proximity[i % 12];
+	}
+}
+
+static void benchAmbient(long n) {
+	struct telemetry t;
+	long i;
+
+	for (i = 0; i < n; i++) {
+		ambientSensor(&t);
+		sink += t.ambient[i % 12];
+	}
+}
+
+static void benchUs(long n) {
+	struct telemetry t;
+	long i;
+
+	for (i = 0; i < n; i++) {
+		uaSensor(&t);
+		sink += t.us[i % 5];
+	}
+}
+
+static void benchBattery(long n) {
+	struct telemetry t;
+	long i;
+
+	for (i = 0; i < n; i++) {
+		batterySensor(&t);
+		sink += t.battery_voltage;
+	}
+}
+
+static struct telemetry sample;
+
+static void benchFormatText(long n) {
+	static char text[4096];
+	long i;
+
+	for (i = 0; i < n; i++)
+		sink += formatTelemetry(&sample, text, sizeof(text));
+}
+
+static void benchFormatBinary(long n) {
+	unsigned char out[TELEMETRY_RECORD_LEN];
+	long i;
+
+	for (i = 0; i < n; i++)
+		sink += telemetry_pack(&sample, out);
+}
+
+static void benchTimevalDiff(long n) {
+	struct timeval start = { 100, 999999 }, end = { 105, 1 }, d;
+	long i;
+
+	for (i = 0; i < n; i++) {
+		end.tv_usec = i & 0xFFFFF;
+		sink += timeval_diff(&d, &end, &start);
+	}
+}
+
+struct bench {
+	const char *name;
+	void (*run)(long n);
+};
+
+static const struct bench benches[] = {
+	{ "parse", benchParse },
+	{ "dispatch", benchDispatch },
+	{ "color_lookup", benchColor },
+	{ "read_proximity", benchProximity },
+	{ "read_ambient", benchAmbient },
+	{ "read_us", benchUs },
+	{ "read_battery", benchBattery },
+	{ "format_text", benchFormatText },
+	{ "format_binary", benchFormatBinary },
+	{ "timeval_diff", benchTimevalDiff },
+};
+
+/*!
+ * Open a counter of the user space instructions of this thread
+ *
+ * \return the perf event descriptor, -1 if not available
+ */
+static int openInstructionCounter(void) {
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/*!
+ * Run a benchmark long enough and print its line of the report
+ */
+static void runBench(const struct bench *b, int counter) {
+	unsigned long allocs;
+	uint64_t start, elapsed, instructions = 0;
+	long n = 1000;
+
+	// grow the count until the run is long enough to be timed
+	for (;;) {
+		start = monotonic_ns();
+		b->run(n);
+		elapsed = monotonic_ns() - start;
+		if (elapsed >= BENCH_MIN_NS / 10)
+			break;
+		n *= 10;
+	}
+	n = (long) ((double) n * BENCH_MIN_NS / (elapsed + 1)) + 1;
+
+	allocs = allocations;
+	if (counter >= 0) {
+		ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+		ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+	}
+	start = monotonic_ns();
+	b->run(n);
+	elapsed = monotonic_ns() - start;
+	if (counter >= 0) {
+		ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(counter, &instructions, sizeof(instructions))
+				!= sizeof(instructions))
+			counter = -1;
+	}
+	allocs = allocations - allocs;
+
+	printf("%-16s %12ld %10.1f %10.3f ", b->name, n, (double) elapsed / n,
+			(double) allocs / n);
+	if (counter >= 0)
+		printf("%12.1f\n", (double) instructions / n);
+	else
+		printf("%12s\n", "-");
+}
+
+int main(int argc, char *argv[]) {
+	const char *only = argc > 1 ? argv[1] : "";
+	int i, counter;
+
+	frame_encode_header(formatFrame, OP_FORMAT, 1, 1);
+	formatFrame[FRAME_HEADER_LEN] = TELEMETRY_BINARY;
+	proximitySensor(&sample);
+	ambientSensor(&sample);
+	measureUs(sample.us); // uaSensor() only reads what the scheduler keeps
+	mottorSensor(&sample);
+	batterySensor(&sample);
+
+	counter = openInstructionCounter();
+	printf("%-16s %12s %10s %10s %12s\n", "benchmark", "ops", "ns/op",
+			"allocs/op", "instr/op");
+	for (i = 0; i < (int) (sizeof(benches) / sizeof(benches[0])); i++)
+		if (strncmp(benches[i].name, only, strlen(only)) == 0)
+			runBench(&benches[i], counter);
+	if (counter >= 0)
+		close(counter);
+	return 0;
+}
@@ -0,0 +1,238 @@
+/* \file odometry.c
+
+ *
+ * \brief
+ *         Onboard odometry, see odometry.h
+ *
+ */
+#include <math.h>
+#include <string.h>
+#include <time.h>
+
+#include "odometry.h"
+#include "robot.h"
+#include "telemetry.h"
+
+/*--------------------------------------------------------------------*/
+/*!
+ * Covariance propagation P = F P F' + G Q G'
+ *
+ * \param F motion model jacobian of the pose
+ * \param G motion model jacobian of the increments (travel, heading)
+ * \param Q increment covariance
+ */
+static void propagate(double P[3][3], const double F[3][3],
+		const double G[3][2], const double Q[2][2]) {
+	double FP[3][3], GQ[3][2];
+	int i, j, k;
+
+	for (i = 0; i < 3; i++)
+		for (j = 0; j < 3; j++)
+			for (FP[i][j] = 0, k = 0; k < 3; k++)
+				FP[i][j] += F[i][k] * P[k][j];
+	for (i = 0; i < 3; i++)
+		for (j = 0; j < 2; j++)
+			GQ[i][j] = G[i][0] * Q[0][j] + G[i][1] * Q[1][j];
+	for (i = 0; i < 3; i++)
+		for (j = 0; j < 3; j++) {
+			for (P[i][j] = 0, k = 0; k < 3; k++)
+				P[i][j] += FP[i][k] * F[j][k];
+			P[i][j] += GQ[i][0] * G[j][0] + GQ[i][1] * G[j][1];
+		}
+}
+
+/*!
+ * Read the encoders (and the gyro) once and integrate
+ *
+ * \param dt time since the previous tick [s]
+ *
+ * \return 0 if the encoder reading was the one of the previous tick and
+ *         nothing was integrated, 1 otherwise
+ */
+static int tick(struct odometry *o, double dt) {
+	struct odometry_config c;
+	double dl, dr, vl, vr, ds, dtheta, vs, vtheta, cst, rate, g, vg, k;
+	double m, cm, sm;
+	uint64_t stamp, now;
+	int left, right, have = 0, fresh = 0;
+
+	pthread_mutex_lock(&o->lock);
+	c = o->config;
+	pthread_mutex_unlock(&o->lock);
+
+	stamp = o->read_encoders(&left, &right);
+	if (stamp == o->last_us)
+		return 0;
+	o->last_us = stamp;
+	dl = (int32_t) ((uint32_t) left - (uint32_t) o->last[0]) * ROBOT_PULSE_TO_MM;
+	dr = (int32_t) ((uint32_t) right - (uint32_t) o->last[1]) * ROBOT_PULSE_TO_MM;
+	o->last[0] = left;
+	o->last[1] = right;
+
+	vl = c.wheel_var * fabs(dl);
+	vr = c.wheel_var * fabs(dr);
+	ds = (dl + dr) / 2;
+	dtheta = (dr - dl) / ROBOT_WHEEL_BASE_MM;
+	vs = (vl + vr) / 4;
+	vtheta = (vl + vr) / (ROBOT_WHEEL_BASE_MM * ROBOT_WHEEL_BASE_MM);
+	cst = (vr - vl) / (2 * ROBOT_WHEEL_BASE_MM);
+
+	if (c.gyro) {
+		// reading the gyro again within its sample period only returns the
+		// same sample
+		now = monotonic_us();
+		if (now - o->gyro_us < ROBOT_GYRO_PERIOD_US) {
+			rate = o->rate;
+			have = 1;
+		} else if (o->read_gyro(&rate) == 0) {
+			o->gyro_us = now;
+			have = fresh = 1;
+		}
+	}
+	if (have) {
+		if (dl == 0 && dr == 0) {
+			// standing still: whatever the gyro reads is its bias
+			if (fresh)
+				o->bias += (rate - o->bias) * ODOMETRY_BIAS_GAIN;
+		} else {
+			// the rate is sampled at the ends of the tick
+			g = ((rate + o->rate) / 2 - o->bias) * dt;
+			vg = c.gyro_var * dt;
+			k = vtheta + vg > 0 ? vtheta / (vtheta + vg) : 0;
+			dtheta += k * (g - dtheta);
+			vtheta = (1 - k) * (1 - k) * vtheta + k * k * vg;
+			cst *= 1 - k;
+		}
+		o->rate = rate;
+	}
+
+	pthread_mutex_lock(&o->lock);
+	m = o->theta + dtheta / 2;
+	cm = cos(m);
+	sm = sin(m);
+	{
+		const double F[3][3] = { { 1, 0, -ds * sm }, { 0, 1, ds * cm },
+				{ 0, 0, 1 } };
+		const double G[3][2] = { { cm, -ds * sm / 2 }, { sm, ds * cm / 2 },
+				{ 0, 1 } };
+		const double Q[2][2] = { { vs, cst }, { cst, vtheta } };
+
+		propagate(o->P, F, G, Q);
+	}
+	o->x += ds * cm;
+	o->y += ds * sm;
+	o->theta = remainder(o->theta + dtheta, 2 * M_PI);
+	o->stamp_us = monotonic_us();
+	o->ticks++;
+	pthread_mutex_unlock(&o->lock);
+	return 1;
+}
+
+static void *odometryThread(void *arg) {
+	struct odometry *o = arg;
+	struct timespec ts;
+	uint64_t next = monotonic_ns(), now, prev = next, period;
+
+	while (__atomic_load_n(&o->running, __ATOMIC_RELAXED)) {
+		now = monotonic_ns();
+		// a reading seen before leaves the time to the next one
+		if (tick(o, (now - prev) * 1e-9))
+			prev = now;
+
+		// keep a fixed cadence, but do not try to catch up after a stall
+		period = 1000000000ULL / __atomic_load_n(&o->config.rate_hz,
+				__ATOMIC_RELAXED);
+		next += period;
+		now = monotonic_ns();
+		if (next <= now)
+			next = now + period;
+		ts.tv_sec = next / 1000000000;
+		ts.tv_nsec = next % 1000000000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+			;
+		pthread_mutex_lock(&o->lock);
+		hist_record(&o->lateness, monotonic_ns() - next);
+		pthread_mutex_unlock(&o->lock);
+	}
+	return NULL;
+}
+
+/*!
+ * Start the odometry thread, from the pose (0, 0, 0)
+ *
+ * The config, read_encoders and read_gyro fields must be set and the lock
+ * initialised before the call.
+ *
+ * \return 0 on success, -1 on error
+ */
+int odometry_start(struct odometry *o) {
+	int left, right;
+
+	o->last_us = o->read_encoders(&left, &right);
+	o->last[0] = left;
+	o->last[1] = right;
+	o->gyro_us = 0;
+	o->bias = 0;
+	o->rate = 0;
+	o->ticks = 0;
+	hist_reset(&o->lateness);
+	odometry_reset(o, 0, 0, 0);
+
+	o->running = 1;
+	if (pthread_create(&o->thread, NULL, odometryThread, o) != 0) {
+		o->running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+/*!
+ * Stop the odometry thread and wait for it
+ */
+void odometry_stop(struct odometry *o) {
+	if (!o->running)
+		return;
+	__atomic_store_n(&o->running, 0, __ATOMIC_RELAXED);
+	pthread_join(o->thread, NULL);
+}
+
+/*!
+ * Get the current pose and its covariance
+ */
+void odometry_get(struct odometry *o, struct odometry_pose *p) {
+	pthread_mutex_lock(&o->lock);
+	p->timestamp_us = o->stamp_us;
+	p->x = o->x;
+	p->y = o->y;
+	p->theta = o->theta;
+	p->cov[0] = o->P[0][0];
+	p->cov[1] = o->P[0][1];
+	p->cov[2] = o->P[0][2];
+	p->cov[3] = o->P[1][1];
+	p->cov[4] = o->P[1][2];
+	p->cov[5] = o->P[2][2];
+	pthread_mutex_unlock(&o->lock);
+}
+
+/*!
+ * Set the pose, known exactly: the covariance starts over from 0
+ */
+void odometry_reset(struct odometry *o, double x, double y, double theta) {
+	pthread_mutex_lock(&o->lock);
+	o->x = x;
+	o->y = y;
+	o->theta = remainder(theta, 2 * M_PI);
+	memset(o->P, 0, sizeof(o->P));
+	o->stamp_us = monotonic_us();
+	pthread_mutex_unlock(&o->lock);
+}
+
+/*!
+ * Change the configuration, also while running
+ */
+void odometry_configure(struct odometry *o, const struct odometry_config *c) {
+	pthread_mutex_lock(&o->lock);
+	o->config = *c;
+	hist_reset(&o->lateness);
+	pthread_mutex_unlock(&o->lock);
+}
@@ -0,0 +1,81 @@
+/* \file odometry.h
+
+ *
+ * \brief
+ *         Onboard odometry
+ *
+ * A dedicated thread reads the wheel encoders at a fixed rate and
+ * integrates their increments into a pose (x, y, theta) in the frame of
+ * the last reset, x forward and theta counterclockwise from there, along
+ * with its covariance. Each wheel travel d is taken with a variance of
+ * wheel_var * |d|, and the covariance is propagated through the motion
+ * model at every tick.
+ *
+ * With gyro correction, the heading increment is the variance weighted
+ * mean of the encoder one and of the gyro rate integrated over the tick
+ * (variance gyro_var * dt). While the wheels do not move, the heading is
+ * kept and the gyro readings only update its bias estimate. The gyro is
+ * read once per ROBOT_GYRO_PERIOD_US at most, its sample period; the rate
+ * holds in between.
+ *
+ * The encoder reading may be shared with other readers (a sensor cache):
+ * a tick that gets the same reading as the previous one waits for the next
+ * one rather than taking the robot for stopped.
+ *
+ */
+#ifndef ODOMETRY_H
+#define ODOMETRY_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "stats.h"
+
+#define ODOMETRY_DEFAULT_HZ 200
+#define ODOMETRY_MAX_HZ 1000
+#define ODOMETRY_BIAS_GAIN 0.01 // gyro bias low pass, per still tick
+
+struct odometry_config {
+	unsigned rate_hz;
+	int gyro;              // 1 corrects the heading with the gyro
+	double wheel_var;      // wheel travel variance [mm^2 / mm]
+	double gyro_var;       // gyro heading variance [rad^2 / s]
+};
+
+struct odometry_pose {
+	uint64_t timestamp_us; // CLOCK_MONOTONIC time of the last tick
+	double x, y;           // [mm]
+	double theta;          // [rad], -pi..pi
+	double cov[6];         // xx, xy, xtheta, yy, ytheta, thetatheta
+};
+
+/* encoder read, returns the time of the reading [us] */
+typedef uint64_t (*odometry_encoders_fn)(int *left, int *right);
+typedef int (*odometry_gyro_fn)(double *rate); // [rad/s], 0 on success
+
+struct odometry {
+	struct odometry_config config;
+	odometry_encoders_fn read_encoders;
+	odometry_gyro_fn read_gyro;
+	pthread_mutex_t lock;       // pose, config and statistics
+	double x, y, theta;
+	double P[3][3];             // pose covariance
+	uint64_t stamp_us;
+	int32_t last[2];            // encoders at the last tick, thread only
+	uint64_t last_us;           // time of that reading, thread only
+	uint64_t gyro_us;           // last gyro read, thread only
+	double rate;                // last gyro reading [rad/s], thread only
+	double bias;                // gyro bias [rad/s], thread only
+	uint32_t ticks;
+	struct histogram lateness;  // tick lateness [ns]
+	int running;
+	pthread_t thread;
+};
+
+int odometry_start(struct odometry *o);
+void odometry_stop(struct odometry *o);
+void odometry_get(struct odometry *o, struct odometry_pose *p);
+void odometry_reset(struct odometry *o, double x, double y, double theta);
+void odometry_configure(struct odometry *o, const struct odometry_config *c);
+
+#endif /* ODOMETRY_H */
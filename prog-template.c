@@ -12,11 +12,13 @@
  * \todo     nothing.
 
  * compile with command (don't forget to source the env.sh of your development folder!):
- arm-angstrom-linux-gnueabi-gcc kh4test.c -o khepera4_test -I $INCPATH -L $LIBPATH -lkhepera
+ arm-angstrom-linux-gnueabi-gcc prog-template.c protocol.c telemetry.c sampler.c evloop.c stats.c sensorcache.c leds.c upload.c script.c camera.c connmgr.c udpctl.c reflex.c linefollow.c trajectory.c odometry.c ultrasound.c robot_kh4.c -o khepera4_test -I $INCPATH -L $LIBPATH -lkhepera -lpthread -lm
+
+ * or, to run it on a Linux PC with a simulated robot (see robot_sim.c):
+ gcc prog-template.c protocol.c telemetry.c sampler.c evloop.c stats.c sensorcache.c leds.c upload.c script.c camera.c connmgr.c udpctl.c reflex.c linefollow.c trajectory.c odometry.c ultrasound.c robot_sim.c -o khepera4_sim -lpthread -lm
 
 
  */
-#include <khepera/khepera.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -30,6 +32,37 @@
 #include <ctype.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
+
+#include "camera.h"
+#include "connmgr.h"
+#include "evloop.h"
+#include "leds.h"
+#include "linefollow.h"
+#include "odometry.h"
+#include "protocol.h"
+#include "reflex.h"
+#include "robot.h"
+#include "sampler.h"
+#include "script.h"
+#include "sensorcache.h"
+#include "stats.h"
+#include "telemetry.h"
+#include "trajectory.h"
+#include "udpctl.h"
+#include "ultrasound.h"
+#include "upload.h"
 
 #define ROTATE_HIGH_SPEED_FACT 0.5
 #define PORT 20000
@@ -37,12 +70,253 @@
 
 //#define DEBUG 1
 
-static knet_dev_t * dsPic; // robot pic microcontroller access
+// serialises robot accesses of the acquisition thread and the main loop
+static pthread_mutex_t busLock = PTHREAD_MUTEX_INITIALIZER;
+static int motorMode = ROBOT_IDLE; // last robot_set_mode(), under busLock
+#define BUS_LOCK() pthread_mutex_lock(&busLock)
+#define BUS_UNLOCK() pthread_mutex_unlock(&busLock)
+
+static unsigned long busTransactions; // dsPic I2C transactions since start
+#define BUS(call) (__atomic_add_fetch(&busTransactions, 1, __ATOMIC_RELAXED), (call))
 
 int maxsp, accinc, accdiv, minspacc, minspdec; // for speed profile
 
 static int quitReq = 0; // quit variable for loop
 
+static struct evloop loop; // main event loop
+
+#define OUTQ_LEN 65536 // replies and events waiting for the socket
+
+/* connection to the server */
+struct connection {
+	int fd;
+	struct frame_parser parser;
+	unsigned char out[OUTQ_LEN]; // data the socket did not accept yet
+	size_t out_len;
+	uint64_t rx_ns;              // time the last bytes were received
+};
+
+static struct connection conn;
+
+static struct connmgr connmgr; // servers of configFile, reconnection
+
+static struct sockaddr_in serverAddr; // video streams go to the same host
+
+/* session with the server, kept across reconnections, see OP_HELLO */
+static uint64_t sessionToken;
+static unsigned heartbeatMs; // 0 when the server sends no heartbeat
+static int heartbeatTimer;
+
+static struct udp_channel udp; // optional steering channel, see OP_UDP
+
+#define HEARTBEAT_MISSES 3 // intervals without data before the link is dead
+#define LINK_TIMEOUT_S 2   // TCP detection without heartbeat, see onServerUp()
+
+static struct camera camera;
+static const char *cameraSource = "/dev/video0"; // see camera_init() (-c)
+static const char *configFile = "/tmp/config.cfg"; // servers, see connmgr_load() (-f)
+
+/* latency of each command, from reception to reply, see OP_STATS */
+enum {
+	STAGE_PARSE, // received -> dispatched (parsing, earlier frames of the read)
+	STAGE_EXEC,  // handler, hardware calls included
+	STAGE_REPLY, // reply built and handed to the socket
+	STAGE_TOTAL, // received -> replied
+	STAGE_COUNT
+};
+
+#define STATS_OPCODES 64 // opcodes below this are measured
+
+static struct histogram latency[STATS_OPCODES][STAGE_COUNT];
+
+static int motorSpeed = 100; // speed used by up/down/left/right
+
+// rgb leds, written by onLedTimer() at most once per tick
+static struct leds leds;
+static int ledTimer;
+
+#define LED_TICK_US 20000 // animation step
+
+#define SCRIPT_PATH "script.sh"
+
+static struct upload scriptUpload; // OP_UPLOAD* in progress
+
+// in-process script engine, see OP_RUNSCRIPT
+static struct script_program scriptProgram;
+static struct script_vm script;
+static int scriptTimer;
+static uint64_t scriptTickNs;  // scheduled time of the next tick
+static struct histogram scriptStart;  // command received -> first step
+static struct histogram scriptJitter; // tick lateness
+
+#define SCRIPT_TICK_US 1000
+#define SCRIPT_MAX_LEN 65536
+
+// onboard trajectory executor, see OP_TRAJECTORY
+static struct traj_program trajProgram;
+static struct traj_exec trajectory;
+static int trajTimer;
+static uint16_t trajSeq; // OP_EVT_TRAJECTORY sequence
+
+#define TRAJ_TICK_US 10000
+
+static FILE *telemetryLog = NULL; // optional copy of every alldata snapshot (-l)
+
+static int telemetryFormat = TELEMETRY_TEXT; // alldata reply format
+
+void proximitySensor(struct telemetry *t);
+void uaSensor(struct telemetry *t);
+void ambientSensor(struct telemetry *t);
+void mottorSensor(struct telemetry *t);
+void batterySensor(struct telemetry *t);
+void poseSensor(struct telemetry *t);
+static uint64_t readEncoders(int *left, int *right);
+static int readGyro(double *rate);
+static int writeSpeed(int left, int right);
+static void cachedProximity(struct telemetry *t);
+static void readUs(short value[ROBOT_US_COUNT],
+		uint32_t age_us[ROBOT_US_COUNT]);
+static int activateUs(int mask);
+static int measureUs(short value[ROBOT_US_COUNT]);
+
+// ultrasound ranging in the background, the front transducers more often,
+// see OP_US
+#define US_SETTINGS { ROBOT_US_ALL, { 200, 100, 100, 100, 200 } }
+static struct us_scheduler ultrasound = {
+	.config = US_SETTINGS,
+	.activate = activateUs,
+	.measure = measureUs,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// obstacle reflex in front of every motor speed write, see OP_REFLEX
+#define REFLEX_SETTINGS { REFLEX_DEFAULT_HZ, 300, 700, 40, 25, 100, 150 }
+static struct reflex reflex = {
+	.config = REFLEX_SETTINGS,
+	.read_ir = cachedProximity,
+	.read_us = readUs,
+	.set_speed = writeSpeed,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+static uint16_t reflexSeq; // OP_EVT_REFLEX sequence
+
+// pose integrated from the encoders and the gyro, see OP_POSE
+#define ODOMETRY_SETTINGS { ODOMETRY_DEFAULT_HZ, 1, 0.01, 1e-4 }
+static struct odometry odometry = {
+	.config = ODOMETRY_SETTINGS,
+	.read_encoders = readEncoders,
+	.read_gyro = readGyro,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void lineDrive(int left, int right);
+
+// local line follower, see OP_LINE
+#define LINE_SETTINGS { LINE_DEFAULT_HZ, 150, 6.0, 0.0, 0.1 }
+static struct line_follower lineFollower = {
+	.config = LINE_SETTINGS,
+	.read = cachedProximity,
+	.drive = lineDrive,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* telemetry pushed to the server without request, see OP_SUBSCRIBE */
+struct subscription {
+	unsigned mask;    // GROUP_BIT() of the subscribed groups, 0 when idle
+	unsigned rate_hz; // push rate
+	int timer;        // push timer descriptor
+	uint16_t seq;     // sequence number of the pushed frames
+	int encoding;     // ENCODING_*
+	unsigned keyframe_interval; // frames between two keyframes (delta)
+	unsigned since_key;         // frames sent since the last keyframe
+	struct telemetry_codec codec;
+};
+
+static struct subscription subscription;
+
+#define SUBSCRIBE_MAX_RATE 1000 // [Hz]
+#define SUBSCRIBE_KEYFRAME_INTERVAL 50 // default for delta encoding
+
+// sensor reads go through this cache, freshness budget of each group
+static struct sensor_cache cache = {
+	.groups = {
+		// just under the reflex period: the reflex reads the bus on each of
+		// its ticks, the line follower and the sampler share its readings
+		[GROUP_PROXIMITY] = { .read = proximitySensor, .ttl_us = 4000 },
+		[GROUP_AMBIENT] = { .read = ambientSensor, .ttl_us = 10000 },
+		[GROUP_US] = { .read = uaSensor, .ttl_us = 50000 },
+		// just under the odometry period, each of its ticks reads the bus
+		[GROUP_MOTORS] = { .read = mottorSensor, .ttl_us = 4000 },
+		[GROUP_BATTERY] = { .read = batterySensor, .ttl_us = 1000000 },
+	},
+};
+
+static void cachedProximity(struct telemetry *t) {
+	sensor_cache_read(&cache, GROUP_PROXIMITY, t);
+}
+
+static void cachedAmbient(struct telemetry *t) {
+	sensor_cache_read(&cache, GROUP_AMBIENT, t);
+}
+
+static void cachedUs(struct telemetry *t) {
+	sensor_cache_read(&cache, GROUP_US, t);
+}
+
+static void cachedMotors(struct telemetry *t) {
+	sensor_cache_read(&cache, GROUP_MOTORS, t);
+}
+
+static void cachedBattery(struct telemetry *t) {
+	sensor_cache_read(&cache, GROUP_BATTERY, t);
+}
+
+// background acquisition, default rate of each sensor group in [Hz]
+static struct sampler sampler = {
+	.groups = {
+		[GROUP_PROXIMITY] = { cachedProximity, 50 },
+		[GROUP_AMBIENT] = { cachedAmbient, 10 },
+		[GROUP_US] = { cachedUs, 10 },
+		[GROUP_MOTORS] = { cachedMotors, 100 },
+		[GROUP_BATTERY] = { cachedBattery, 1 },
+		[GROUP_POSE] = { poseSensor, 50 },
+	},
+};
+
+/* data returned by a command handler along with its status */
+struct reply {
+	const void *data;
+	size_t len;
+};
+
+typedef int (*command_handler)(const struct frame *f, struct reply *r);
+
+struct command {
+	const char *name;
+	command_handler handler; // returns a ST_* status
+};
+
+/* rgb led colors, robot_set_rgb_leds() values */
+struct color {
+	const char *name;
+	char r, g, b;
+};
+
+// perfect hash of the color names below, see findColor()
+#define COLOR_HASH(s) (((s)[0] * 3 + (s)[1]) & 15)
+
+static const struct color colors[16] = {
+	[3] = { "off", 0, 0, 0 },
+	[11] = { "red", 1, 0, 0 },
+	[2] = { "blue", 0, 0, 1 },
+	[0] = { "yellow", 63, 63, 0 },
+	[9] = { "pink", 30, 0, 10 },
+	[5] = { "purple", 20, 0, 40 },
+	[15] = { "orange", 63, 20, 0 },
+	[7] = { "green", 0, 1, 0 },
+	[13] = { "white", 60, 60, 60 },
+};
+
 void error(const char *msg) {
 	perror(msg);
 	exit(1);
@@ -50,19 +324,12 @@ void error(const char *msg) {
 
 /*--------------------------------------------------------------------*/
 /*!
- * Make sure the program terminate properly on a ctrl-c
+ * Make sure the program terminate properly on a ctrl-c (or SIGTERM),
+ * delivered through the event loop; main() stops the robot on the way out
  */
-static void ctrlc_handler(int sig) {
+static void ctrlc_handler(struct evloop *l, int fd, uint32_t sig, void *arg) {
 	quitReq = 1;
-
-	kh4_set_speed(0, 0, dsPic); // stop robot
-	kh4_SetMode(kh4RegIdle, dsPic);
-
-	kh4_SetRGBLeds(0, 0, 0, 0, 0, 0, 0, 0, 0, dsPic); // clear rgb leds because consumes energy
-
-	kb_change_term_mode(0); // revert to original terminal if called
-
-	exit(0);
+	evloop_stop(l);
 }
 /*!
  * Compute time difference
@@ -96,13 +363,31 @@ long long timeval_diff(struct timeval *difference, struct timeval *end_time,
 	return 1000000LL * difference->tv_sec + difference->tv_usec;
 
 } /* timeval_diff() */
-void proximitySensor(int i, char *Buffer, short *sensors, char* fs_name);
-void uaSensor(int i, char *Buffer, short *usvalues, char* fs_name);
-void ambientSensor(int i, char *Buffer, short *sensors, char* fs_name);
-void mottorSensor(char *Buffer, char* fs_name);
-void batterySensor(char *Buffer, char* fs_name);
+size_t formatTelemetry(const struct telemetry *t, char *out, size_t size);
 void go(int num1, int num2, double rotate);
-void diodeControl(int nr, char *color);
+void stopMotors(void);
+void diodeControl(int nr, const char *color);
+int dispatchFrame(struct connection *c, const struct frame *f);
+const struct color *findColor(const char *name);
+int sendReply(struct connection *c, const struct frame *f, int status,
+		const void *data, size_t len);
+int sendEvent(struct connection *c, uint8_t opcode, uint16_t seq,
+		const void *data, size_t len);
+void onServer(struct evloop *l, int fd, uint32_t events, void *arg);
+void onSubscriptionTimer(struct evloop *l, int fd, uint32_t expirations,
+		void *arg);
+void onLedTimer(struct evloop *l, int fd, uint32_t expirations, void *arg);
+void onScriptTimer(struct evloop *l, int fd, uint32_t expirations, void *arg);
+void onTrajTimer(struct evloop *l, int fd, uint32_t expirations, void *arg);
+void onHeartbeatTimer(struct evloop *l, int fd, uint32_t expirations,
+		void *arg);
+void onServerUp(int fd, const struct sockaddr_in *addr, void *arg);
+void onUdp(struct evloop *l, int fd, uint32_t events, void *arg);
+void onReflex(struct evloop *l, int fd, uint32_t events, void *arg);
+static void closeUdp(void);
+static void endTrajectory(int state);
+static void linkLost(struct connection *c);
+static void writeLeds(const unsigned char *rgb);
 /*--------------------------------------------------------------------*/
 /*!
  * Main
@@ -116,7 +401,7 @@ int main(int argc, char * argv[]) {
 #define MAX_G 2 		// max acceleration in g
 
 // convert US value to text comment
-#define US_VAL(val) ((val)==KH4_US_DISABLED_SENSOR ? "Not activated" : ((val)==KH4_US_NO_OBJECT_IN_RANGE ? "No object in range" : ((val)==KH4_US_OBJECT_NEAR ? "Object at less than 25cm" : "Object in range 25..250cm")))
+#define US_VAL(val) ((val)==ROBOT_US_DISABLED ? "Not activated" : ((val)==ROBOT_US_NO_OBJECT ? "No object in range" : ((val)==ROBOT_US_OBJECT_NEAR ? "Object at less than 25cm" : "Object in range 25..250cm")))
 
 	double fpos, dval, dmean;
 	long lpos, rpos;
@@ -124,35 +409,49 @@ int main(int argc, char * argv[]) {
 	int i, n, type_of_test = 0, sl, sr, pl, pr;
 	short index, value, sensors[12], usvalues[5];
 	char c;
-	int motorSpeed = 100;
 	char line[80], l[9];
 	int kp, ki, kd;
 	int pmarg;
-	char* fs_name = "data.csv";
 
-	// initiate libkhepera and robot access
-	if (kh4_init(argc, argv) != 0) {
-		printf("\nERROR: could not initiate the libkhepera!\n\n");
-		return -1;
+	// optional telemetry log: -l <file> appends every alldata snapshot
+	// camera source: -c <device|file:<path>|synthetic>
+	// server list: -f <file>
+	for (i = 1; i < argc - 1; i++) {
+		if (strcmp(argv[i], "-c") == 0)
+			cameraSource = argv[i + 1];
+		if (strcmp(argv[i], "-f") == 0)
+			configFile = argv[i + 1];
+		if (strcmp(argv[i], "-l") == 0) {
+			telemetryLog = fopen(argv[i + 1], "a");
+			if (telemetryLog == NULL) {
+				printf("\nERROR: could not open log file %s\n\n", argv[i + 1]);
+				return -3;
+			}
+		}
 	}
 
-	/* open robot socket and store the handle in their respective pointers */
-	dsPic = knet_open("Khepera4:dsPic", KNET_BUS_I2C, 0, NULL);
-
-	if (dsPic == NULL) {
+	// initiate libkhepera and robot access
+	switch (robot_init(argc, argv)) {
+	case 0:
+		break;
+	case -2:
 		printf("\nERROR: could not initiate communication with Kh4 dsPic\n\n");
 		return -2;
+	default:
+		printf("\nERROR: could not initiate the libkhepera!\n\n");
+		return -1;
 	}
 
 	/* initialize the motors controlers*/
 
 	/* tuned parameters */
 	pmarg = 20;
-	kh4_SetPositionMargin(pmarg, dsPic); 			// position control margin
+	robot_set_position_margin(pmarg); 			// position control margin
+	trajectory.margin = pmarg;
 	kp = 10;
 	ki = 5;
 	kd = 1;
-	kh4_ConfigurePID(kp, ki, kd, dsPic); 		// configure P,I,D
+	robot_configure_pid(kp, ki, kd); 		// configure P,I,D
 
 	accinc = 3; 		//3;
 	accdiv = 0;
@@ -160,555 +459,1832 @@ int main(int argc, char * argv[]) {
 	minspdec = 1;
 	maxsp = 400;
 	// configure acceleration slope
-	kh4_SetSpeedProfile(accinc, accdiv, minspacc, minspdec, maxsp, dsPic); // Acceleration increment ,  Acceleration divider, Minimum speed acc, Minimum speed dec, maximum speed
+	robot_set_speed_profile(accinc, accdiv, minspacc, minspdec, maxsp); // Acceleration increment ,  Acceleration divider, Minimum speed acc, Minimum speed dec, maximum speed
 
-	kh4_SetMode(kh4RegIdle, dsPic);  			// Put in idle mode (no control)
+	robot_set_mode(ROBOT_IDLE);  			// Put in idle mode (no control)
 
 	// get revision
-	if (kh4_revision(Buffer, dsPic) == 0) {
+	if (robot_revision(Buffer) == 0) {
 		version = (Buffer[0] >> 4) + 'A';
 		revision = Buffer[0] & 0x0F;
 		printf("\r\nVersion = %c, Revision = %u\r\n", version, revision);
 	}
 
-	/* Variable Definition */
-	int sockfd;
-	struct sockaddr_in remote_addr;
-	char message[1000], server_reply[2000];
-	/* Get the Socket file descriptor */
-	if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-		fprintf(stderr,
-				"ERROR: Failed to obtain Socket Descriptor! (errno = %d)\n",
-				errno);
-		kh4_SetRGBLeds(1, 0, 0, 0, 0, 0, 0, 0, 0, dsPic); // clear rgb leds because consumes energy
-		exit(1);
+	// servers to connect to, the default port is for lines without one
+	if (connmgr_load(&connmgr, configFile, PORT) < 0) {
+		printf("Could not open file. Exiting application. Bye");
+		return 1;
 	}
 
+	leds_init(&leds, writeLeds);
+	diodeControl(3, "red"); // turns green when connected
+	leds_tick(&leds, monotonic_us());
 
+	// camera, started by OP_CAMERA
+	camera_init(&camera, cameraSource);
 
-	char adr[100];
-	char junk[100];
-	char port[100];
-	FILE *file = fopen("/tmp/config.cfg","r");
-	
-	if(!file) {
-    	printf("Could not open file. Exiting application. Bye");
-    	return 1;
+	//keep communicating with server
+	sigset_t signals;
+
+	upload_init(&scriptUpload);
+	udpctl_init(&udp);
+
+	conn.fd = -1;
+
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+
+	if (evloop_init(&loop) < 0
+			|| (subscription.timer = evloop_add_timer(&loop,
+					onSubscriptionTimer, &conn)) < 0
+			|| (ledTimer = evloop_add_timer(&loop, onLedTimer, NULL)) < 0
+			|| (scriptTimer = evloop_add_timer(&loop, onScriptTimer, NULL)) < 0
+			|| (trajTimer = evloop_add_timer(&loop, onTrajTimer, &conn)) < 0
+			|| (heartbeatTimer = evloop_add_timer(&loop, onHeartbeatTimer,
+					&conn)) < 0
+			|| evloop_add_signals(&loop, &signals, ctrlc_handler, NULL) < 0
+			|| connmgr_start(&connmgr, &loop, onServerUp, &conn) < 0) {
+		fprintf(stderr, "ERROR: could not set up the event loop (errno = %d)\n",
+				errno);
+		return -5;
 	}
 
-    	fscanf(file,"%[^ \n\t\r]s",adr); //Get text
-       	fscanf(file,"%[ \n\t\r]s",junk); //Remove any 'white space' characters
-    	fscanf(file,"%[^ \n\t\r]s",port); //Get text
+	// start sampling the sensors in the background, after the signals are
+	// blocked so that they are only delivered through the loop
+	sensor_cache_init(&cache);
+	if (sampler_start(&sampler) != 0) {
+		printf("\nERROR: could not start the sensor acquisition thread\n\n");
+		return -4;
+	}
+	if (us_start(&ultrasound) != 0) {
+		printf("\nERROR: could not start the ultrasound ranging\n\n");
+		return -4;
+	}
+	if (odometry_start(&odometry) != 0) {
+		printf("\nERROR: could not start the odometry\n\n");
+		return -4;
+	}
+	if (reflex_start(&reflex) != 0
+			|| evloop_add(&loop, reflex.notify, EPOLLIN, onReflex, &conn) < 0) {
+		printf("\nERROR: could not start the obstacle reflex\n\n");
+		return -4;
+	}
 
+	evloop_run(&loop);
 
-	fclose(file);
-	/* Fill the socket address struct */
-	remote_addr.sin_family = AF_INET;
-	remote_addr.sin_port = htons(PORT);
-	inet_pton(AF_INET, adr, &remote_addr.sin_addr);
-	bzero(&(remote_addr.sin_zero), 8);
+	camera_stop(&camera);
+	closeUdp();
+	evloop_close(&loop);
+	if (conn.fd >= 0)
+		close(conn.fd);
+	subscription.mask = 0;
 
-	/* Try to connect the remote */
-	if (connect(sockfd, (struct sockaddr *) &remote_addr,
-			sizeof(struct sockaddr)) == -1) {
-		fprintf(stderr, "ERROR: Failed to connect to the host! (errno = %d)\n",
-		errno);
-		exit(1);
-	} else
-		printf("[Client] Connected to server at port %d...ok!\n", PORT);
-	kh4_SetRGBLeds(0, 0, 0, 0, 0, 0, 0, 1, 0, dsPic); // enable green diode when connect
+	line_stop(&lineFollower);
+	reflex_stop(&reflex);
+	sampler_stop(&sampler);
+	odometry_stop(&odometry);
+	us_stop(&ultrasound);
 
-	// Initialize camera
-	system("./camera.sh &");
+	robot_set_speed(0, 0); // stop robot
+	robot_set_mode(ROBOT_IDLE); // set motors to idle
 
-	//keep communicating with server
-	while (1) {
+	robot_set_rgb_leds(0, 0, 0, 0, 0, 0, 0, 0, 0); // clear rgb leds because consumes energy
+	robot_restore_terminal(); // revert to original terminal if called
 
-		kh4_battery_status(Buffer, dsPic);
-		int battery = Buffer[3];
-		sprintf(message, "%d", battery);
+	return 0;
+}
 
-		if (recv(sockfd, server_reply, 2000, 0) < 0) {
-			puts("recv failed");
-			break;
-		}
+/*!
+ * Decode a little endian 16 bit sensor value from a libkhepera buffer
+ */
+static inline unsigned short sensorValue(const char *Buffer, int i) {
+	const unsigned char *b = (const unsigned char *) Buffer;
 
-		puts("Server reply :");
-		puts(server_reply);
+	return b[i * 2] | b[i * 2 + 1] << 8;
+}
 
-		if (strcmp(server_reply, "stop") == 0) {
-			printf("stop");
-			kh4_set_speed(0, 0, dsPic); // stop robot
-			kh4_SetMode(kh4RegIdle, dsPic); // set motors to idle
+void proximitySensor(struct telemetry *t) {
+	char Buffer[100];
+	int i;
 
-		}
+	BUS_LOCK();
+	BUS(robot_proximity_ir(Buffer));
+	BUS_UNLOCK();
+	for (i = 0; i < 12; i++)
+		t->proximity[i] = sensorValue(Buffer, i);
+}
 
-		if (strcmp(server_reply, "runscript") == 0) {
-			printf("script_run");
-			system("./script.sh &");
-		}
-		if (strcmp(server_reply, "loadscript") == 0) {
-			printf("load cript");
-
-			printf(
-					"[Client] Receiveing file from Server and saving it as final.txt...");
-			char revbuf[LENGTH];
-			char* fr_name = "script.sh";
-			FILE *fr = fopen(fr_name, "a");
-			if (fr == NULL)
-				printf("File %s Cannot be opened.\n", fr_name);
-			else {
-				bzero(revbuf, LENGTH);
-				int fr_block_sz = 0;
-				while ((fr_block_sz = recv(sockfd, revbuf, LENGTH, 0)) > 0) {
-					int write_sz = fwrite(revbuf, sizeof(char), fr_block_sz,
-							fr);
-					if (write_sz < fr_block_sz) {
-						error("File write failed.\n");
-					}
-					bzero(revbuf, LENGTH);
-					if (fr_block_sz == 0 || fr_block_sz != 512) {
-						break;
-					}
-				}
-				if (fr_block_sz < 0) {
-					if (errno == EAGAIN) {
-						printf("recv() timed out.\n");
-					} else {
-						fprintf(stderr, "recv() failed due to errno = %d\n",
-								errno);
-					}
-				}
-				printf("Ok received from server!\n");
-				fclose(fr);
+/*!
+ * Last completed ultrasound measurements, no bus access: the ranging runs
+ * in the background, see ultrasound.h
+ */
+void uaSensor(struct telemetry *t) {
+	us_get(&ultrasound, t->us, NULL);
+}
 
-			}
+static void readUs(short value[ROBOT_US_COUNT],
+		uint32_t age_us[ROBOT_US_COUNT]) {
+	us_get(&ultrasound, value, age_us);
+}
 
-		}
+static int activateUs(int mask) {
+	int rc;
 
-		if (strcmp(server_reply, "line") == 0) {
-			printf("line");
-			//line_following(message, sockfd ,server_reply);
-		}
+	BUS_LOCK();
+	rc = BUS(robot_activate_us(mask));
+	BUS_UNLOCK();
+	return rc;
+}
 
-		if (strcmp(server_reply, "up") == 0) {
-			printf("przod");
-			go(motorSpeed, motorSpeed, 1);
+static int measureUs(short value[ROBOT_US_COUNT]) {
+	char Buffer[100];
+	int i, rc;
 
-		}
+	BUS_LOCK();
+	rc = BUS(robot_measure_us(Buffer));
+	BUS_UNLOCK();
+	for (i = 0; i < ROBOT_US_COUNT; i++)
+		value[i] = (short) sensorValue(Buffer, i);
+	return rc < 0 ? rc : 0;
+}
 
-		if (strcmp(server_reply, "down") == 0) {
-			printf("tyl");
-			go(-motorSpeed, -motorSpeed, 1);
+void ambientSensor(struct telemetry *t) {
+	char Buffer[100];
+	int i;
 
-		}
-		if (strcmp(server_reply, "left") == 0) {
+	BUS_LOCK();
+	BUS(robot_ambient_ir(Buffer));
+	BUS_UNLOCK();
+	for (i = 0; i < 12; i++)
+		t->ambient[i] = sensorValue(Buffer, i);
+}
 
-			printf("lewo");
-			go(-motorSpeed, motorSpeed, ROTATE_HIGH_SPEED_FACT);
-		}
-		if (strcmp(server_reply, "right") == 0) {
-			printf("prawo");
-			go(motorSpeed, -motorSpeed, ROTATE_HIGH_SPEED_FACT);
-		}
-		if (strcmp(server_reply, "speed") == 0) {
-			printf("speed");
-			memset(server_reply, 0, 255);
-			//sET SPEED
-			if (send(sockfd, message, strlen(message), 0) < 0) {
-				puts("Send failed");
-				return 1;
-			}
+void mottorSensor(struct telemetry *t) {
+	int sl, sr, pl, pr;
 
-			if (recv(sockfd, server_reply, 2000, 0) < 0) {
-				puts("recv failed");
-				break;
-			}
+	BUS_LOCK();
+	BUS(robot_get_speed(&sl, &sr));
+	BUS(robot_get_position(&pl, &pr));
+	BUS_UNLOCK();
+	t->speed[0] = sl;
+	t->speed[1] = sr;
+	t->position[0] = pl;
+	t->position[1] = pr;
+}
 
-			sscanf(server_reply, "%d", &motorSpeed);
+void batterySensor(struct telemetry *t) {
+	char Buffer[100];
+	int charger;
+
+	BUS_LOCK();
+	BUS(robot_battery_status(Buffer));
+	charger = BUS(robot_battery_charge());
+	BUS_UNLOCK();
+	t->battery_status = Buffer[0];
+	t->battery_capacity = sensorValue(Buffer + 1, 0);
+	t->battery_percent = Buffer[3];
+	t->battery_current = (short) sensorValue(Buffer + 4, 0);
+	t->battery_avg_current = (short) sensorValue(Buffer + 6, 0);
+	t->battery_temperature = (short) sensorValue(Buffer + 8, 0);
+	t->battery_voltage = sensorValue(Buffer + 10, 0);
+	t->battery_charger = charger ? 1 : 0;
+}
 
-			memset(server_reply, 0, 255);
+static inline int saturate32(double v) {
+	return v >= INT32_MAX ? INT32_MAX : v <= INT32_MIN ? INT32_MIN : lround(v);
+}
 
-		}
+/*!
+ * Latest odometry pose, in the units of the telemetry record, and its time
+ */
+void poseSensor(struct telemetry *t) {
+	static const double scale[3] = { 10, 10, 10000 }; // [0.1 mm], [0.1 mrad]
+	static const int row[6] = { 0, 0, 0, 1, 1, 2 }, col[6] = { 0, 1, 2, 1, 2, 2 };
+	struct odometry_pose p;
+	int i;
+
+	odometry_get(&odometry, &p);
+	t->timestamp_us = p.timestamp_us;
+	t->pose[0] = saturate32(p.x * scale[0]);
+	t->pose[1] = saturate32(p.y * scale[1]);
+	t->pose[2] = saturate32(p.theta * scale[2]);
+	for (i = 0; i < 6; i++)
+		t->pose_cov[i] = saturate32(p.cov[i] * scale[row[i]] * scale[col[i]]);
+}
 
-		if (strcmp(server_reply, "diode") == 0) {
-			printf("diode");
-			memset(server_reply, 0, 255);
-			//sET SPEED
-			if (send(sockfd, message, strlen(message), 0) < 0) {
-				puts("Send failed");
-				return 1;
-			}
+/*!
+ * Encoders through the cache, shared by the odometry, the trajectories and
+ * the sampler
+ *
+ * \return the time of the bus read [us]
+ */
+static uint64_t readEncoders(int *left, int *right) {
+	struct telemetry t;
+	uint64_t stamp;
+
+	sensor_cache_read_stamped(&cache, GROUP_MOTORS, &t, &stamp);
+	*left = t.position[0];
+	*right = t.position[1];
+	return stamp;
+}
 
-			if (recv(sockfd, server_reply, 2000, 0) < 0) {
-				puts("recv failed");
-				break;
-			}
-			int nr;
-			sscanf(server_reply, "%d", &nr);
+static void trajEncoders(int *left, int *right) {
+	readEncoders(left, right);
+}
 
-			memset(server_reply, 0, 255);
-			printf("diodanr");
-			printf("%d", nr);
+/*!
+ * Turn rate of the robot from the most recent gyro sample
+ */
+static int readGyro(double *rate) {
+	char Buffer[100];
+	int rc;
+
+	BUS_LOCK();
+	rc = BUS(robot_measure_gyro(Buffer));
+	BUS_UNLOCK();
+	if (rc < 0)
+		return -1;
+	// 10 samples of X, then of Y, then of Z, the last one is the newest
+	*rate = (short) sensorValue(Buffer, 29) * ROBOT_GYRO_DEG_S * M_PI / 180;
+	return 0;
+}
 
-			/////////get diode nr
+/*!
+ * Append formatted text to a buffer, truncating when it is full
+ */
+static void appendf(char *out, size_t size, size_t *len, const char *fmt,
+		...) {
+	va_list ap;
+	int n;
+
+	if (*len >= size)
+		return;
+	va_start(ap, fmt);
+	n = vsnprintf(out + *len, size - *len, fmt, ap);
+	va_end(ap);
+	if (n > 0)
+		*len = (*len + n < size) ? *len + n : size - 1;
+}
 
-			if (send(sockfd, message, strlen(message), 0) < 0) {
-				puts("Send failed");
-				return 1;
-			}
+/*!
+ * Format a telemetry snapshot as the text the server always received
+ * (formerly the content of data.csv)
+ *
+ * \param t snapshot
+ * \param out destination buffer
+ * \param size size of out
+ *
+ * \return length of the text, without the terminating NUL
+ */
+size_t formatTelemetry(const struct telemetry *t, char *out, size_t size) {
+	const unsigned short *s;
+	size_t len = 0;
 
-			if (recv(sockfd, server_reply, 2000, 0) < 0) {
-				puts("recv failed");
-				break;
-			}
-			///////////
-			//	ktora dioda
+	s = t->proximity;
+	appendf(out, size, &len,
+			"Proximity Sensors\
+ \nback left :; %4u; \nleft :; %4u\
+ \nfront left :; %4u; \nfront :; %4u\
+ \nfront right :; %4u; \nright :; %4u\
+ \nback right :; %4u; \nback :; %4u\
+ \nground left :; %4u; \ngnd front left :; %4u\
+ \ngnd front right:; %4u; \nground right :; %4u\n",
+			s[0], s[1], s[2], s[3], s[4], s[5], s[6], s[7], s[8], s[9], s[10],
+			s[11]);
+
+	appendf(out, size, &len, "\n");
+	appendf(out, size, &len,
+			"\nUS sensors : distance [cm]\
+							  \nleft 90:; %4d;\nleft 45:; %4d;\
+							  \nfront:; %4d;\nright 45:; %4d;\nright 90:; %4d;\n",
+			t->us[0], t->us[1], t->us[2], t->us[3], t->us[4]);
 
-			//kolor
-			printf(server_reply);
-			diodeControl(nr, server_reply);
-			//if (send(sockfd, message, strlen(message), 0) < 0) {
-			//	puts("Send failed");
-			//return 1;
-			//}
+	s = t->ambient;
+	appendf(out, size, &len, "\n");
+	appendf(out, size, &len,
+			"Ambiant Sensors\
+						 \nback left      :; %4.4u;  \nleft           :; %4.4u\
+						 \nfront left     :; %4.4u;  \nfront          :;%4.4u\
+						 \nfront right    :; %4.4u;  \nright          :; %4.4u\
+						 \nback right     :; %4.4u;  \nback           :; %4.4u\
+						 \nground left    :; %4.4u;  \ngnd front left :; %4.4u\
+						 \ngnd front right:; %4.4u;  \nground right   :; %4.4u\n",
+			s[0], s[1], s[2], s[3], s[4], s[5], s[6], s[7], s[8], s[9], s[10],
+			s[11]);
 
-		}
+	appendf(out, size, &len, "\nmotor speed and position");
+	appendf(out, size, &len,
+			"motors speed [mm/s (pulse/)]:; left:; %7.1f;  (%5d)  | right:; %7.1f; (%5d)\n",
+			t->speed[0] * ROBOT_SPEED_TO_MM_S, t->speed[0],
+			t->speed[1] * ROBOT_SPEED_TO_MM_S, t->speed[1]);
+	appendf(out, size, &len,
+			"motors position [mm (pulse)]:; left:; %7.1f; (%7d) | right:; %7.1f; (%7d)\n",
+			t->position[0] * ROBOT_PULSE_TO_MM, t->position[0],
+			t->position[1] * ROBOT_PULSE_TO_MM, t->position[1]);
+
+	appendf(out, size, &len, "\n");
+	appendf(out, size, &len, "Battery:\n  status (DS2781)   :;  0x%x\n",
+			t->battery_status);
+	appendf(out, size, &len, "  remaining capacity:;  %4.0f mAh\n",
+			t->battery_capacity * 1.6);
+	appendf(out, size, &len, "  remaining capacity:;   %3d %%\n",
+			t->battery_percent);
+	appendf(out, size, &len, "  current           :; %4.0f mA\n",
+			t->battery_current * 0.07813);
+	appendf(out, size, &len, "  average current   :;  %4.0f mA\n",
+			t->battery_avg_current * 0.07813);
+	appendf(out, size, &len, "  temperature       :;  %3.1f C \n",
+			t->battery_temperature * 0.003906);
+	appendf(out, size, &len, "  voltage           :;  %4.0f mV \n",
+			t->battery_voltage * 9.76);
+	appendf(out, size, &len, "  charger           :;  %s\n",
+			t->battery_charger ? "plugged" : "unplugged");
+
+	appendf(out, size, &len,
+			"\npose [mm, deg]:; x:; %8.1f; y:; %8.1f; theta:; %6.1f\n",
+			t->pose[0] / 10.0, t->pose[1] / 10.0,
+			t->pose[2] / 10000.0 * 180 / M_PI);
+
+	return len;
+}
 
-		if (strcmp(server_reply, "alldata") == 0) {
+/*!
+ * Set the motor control mode, ROBOT_IDLE, ROBOT_SPEED...
+ */
+static void setMotorMode(int mode) {
+	BUS_LOCK();
+	BUS(robot_set_mode(mode));
+	motorMode = mode;
+	BUS_UNLOCK();
+}
 
-			//send file
+/*!
+ * Motor speed write behind the obstacle reflex, see reflex_set_speed()
+ *
+ * \return 0 if the motors follow the speeds in their current mode, -1
+ *         otherwise
+ */
+static int writeSpeed(int left, int right) {
+	int taken;
+
+	BUS_LOCK();
+	BUS(robot_set_speed(left, right));
+	taken = motorMode == ROBOT_SPEED || motorMode == ROBOT_SPEED_PROFILE;
+	BUS_UNLOCK();
+	return taken ? 0 : -1;
+}
 
-			proximitySensor(i, Buffer, sensors, fs_name);
-			uaSensor(i, Buffer, usvalues, fs_name);
-			ambientSensor(i, Buffer, sensors, fs_name);
-			mottorSensor(Buffer, fs_name);
-			batterySensor(Buffer, fs_name);
+/*!
+ * Motor speed write of the line follower, the motors already in speed mode
+ */
+static void lineDrive(int left, int right) {
+	reflex_set_speed(&reflex, left, right);
+}
 
-			char sdbuf[LENGTH];
-			printf("[Client] Sending %s to the Server... ", fs_name);
-			FILE *fs = fopen(fs_name, "r");
-			if (fs == NULL) {
-				printf("ERROR: File %s not found.\n", fs_name);
-				break;
-			}
+void go(int num1, int num2, double rotate) {
 
-			bzero(sdbuf, LENGTH);
-			int fs_block_sz;
-			while ((fs_block_sz = fread(sdbuf, sizeof(char), LENGTH, fs)) > 0) {
-				if (send(sockfd, sdbuf, fs_block_sz, 0) < 0) {
-					fprintf(stderr,
-							"ERROR: Failed to send file %s. (errno = %d)\n",
-							fs_name, errno);
-					break;
-				}
-				bzero(sdbuf, LENGTH);
-			}
-			printf("Ok File %s from Client was Sent!\n", fs_name);
+	line_stop(&lineFollower); // any other motion request takes over
+	endTrajectory(TRAJ_ABORTED);
+	setMotorMode(ROBOT_SPEED);
+	reflex_set_speed(&reflex, num1 * rotate, num2 * rotate);
+	//usleep(100000);
+	//robot_set_speed(0, 0); // stop robot
+	//robot_set_mode(ROBOT_IDLE); // set motors to idle
 
-		}
+}
+
+void stopMotors(void) {
+	line_stop(&lineFollower);
+	endTrajectory(TRAJ_ABORTED);
+	reflex_set_speed(&reflex, 0, 0); // stop robot
+	setMotorMode(ROBOT_IDLE); // set motors to idle
+}
+
+/*!
+ * Look up a color name in the color table
+ *
+ * The table index is a perfect hash of the two first letters of the names
+ * below, so a lookup costs one hash and one strcmp whatever the color.
+ *
+ * \return the table entry, or NULL for an unknown color
+ */
+const struct color *findColor(const char *name) {
+	const struct color *c;
+
+	if (name[0] == '\0' || name[1] == '\0')
+		return NULL;
+	c = &colors[COLOR_HASH(name)];
+	if (c->name == NULL || strcmp(c->name, name) != 0)
+		return NULL;
+	return c;
+}
+
+/*!
+ * Hardware write of the led framebuffer, see leds_init()
+ */
+static void writeLeds(const unsigned char *rgb) {
+	BUS_LOCK();
+	BUS(robot_set_rgb_leds(rgb[0], rgb[1], rgb[2], rgb[3], rgb[4], rgb[5],
+			rgb[6], rgb[7], rgb[8]));
+	BUS_UNLOCK();
+}
 
-		kb_clrscr();
+/*!
+ * Have the led framebuffer written once the commands of the current read
+ * are executed, so that several changes cost a single bus write
+ */
+static void ledsChanged(void) {
+	if (ledTimer > 0)
+		evloop_timer_set(ledTimer, 1, 0);
+}
 
-//Send some data
-		if (send(sockfd, message, strlen(message), 0) < 0) {
-			puts("Send failed");
-			return 1;
+/*!
+ * Set the color of one led, leaving the two others as they are
+ */
+void diodeControl(int nr, const char *color) {
+	const struct color *c = findColor(color);
+	unsigned char rgb[3];
+
+	if (c == NULL || nr < 1 || nr > 3)
+		return;
+
+	rgb[0] = c->r;
+	rgb[1] = c->g;
+	rgb[2] = c->b;
+	leds_set(&leds, nr - 1, rgb);
+	ledsChanged();
+}
+
+/*--------------------------------------------------------------------*/
+/*!
+ * Send an iovec array to the server without blocking
+ *
+ * What the socket does not take at once is queued and flushed by
+ * onServer() when the socket becomes writable again.
+ *
+ * \return 0 on success, -1 if the socket failed or the queue overflowed
+ */
+static int connWrite(struct connection *c, struct iovec *iov, int iovcnt) {
+	struct msghdr msg;
+	ssize_t n = 0;
+	size_t rest = 0;
+	int i;
+
+	if (c->out_len == 0) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		do
+			n = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+		while (n < 0 && errno == EINTR);
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
+			n = 0;
 		}
+	}
 
-		memset(server_reply, 0, 255);
+	// skip what was sent, queue the rest
+	for (i = 0; i < iovcnt; i++) {
+		if ((size_t) n >= iov[i].iov_len) {
+			n -= iov[i].iov_len;
+			continue;
+		}
+		rest += iov[i].iov_len - n;
+		if (c->out_len + rest > sizeof(c->out)) {
+			puts("Send queue overflow");
+			return -1;
+		}
+		memcpy(c->out + c->out_len + rest - (iov[i].iov_len - n),
+				(char *) iov[i].iov_base + n, iov[i].iov_len - n);
+		n = 0;
+	}
+	if (rest > 0) {
+		if (c->out_len == 0)
+			evloop_modify(&loop, c->fd, EPOLLIN | EPOLLOUT);
+		c->out_len += rest;
+	}
+	return 0;
+}
 
+/*!
+ * Flush the send queue
+ *
+ * \return 0 on success, -1 if the socket failed
+ */
+static int connFlush(struct connection *c) {
+	ssize_t n;
+
+	while (c->out_len > 0) {
+		n = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+		memmove(c->out, c->out + n, c->out_len - n);
+		c->out_len -= n;
 	}
+	evloop_modify(&loop, c->fd, EPOLLIN);
+	return 0;
+}
 
-	close(sockfd);
-	printf("[Client] Connection lost.\n");
+/*!
+ * Send the reply frame for a command
+ *
+ * The reply payload is the status byte, the battery remaining capacity in
+ * percent (the acknowledge the server always got) and the optional data.
+ *
+ * \param c server connection
+ * \param f command being answered
+ * \param status ST_* status
+ * \param data command specific reply data, may be NULL
+ * \param len length of data
+ *
+ * \return 0 on success, -1 if the socket failed
+ */
+int sendReply(struct connection *c, const struct frame *f, int status,
+		const void *data, size_t len) {
+	unsigned char head[FRAME_HEADER_LEN + 2];
+	struct telemetry t;
+	struct iovec iov[2];
+
+	sampler_get(&sampler, &t);
 
-	kh4_set_speed(0, 0, dsPic); // stop robot
-	kh4_SetMode(kh4RegIdle, dsPic); // set motors to idle
-	kh4_SetRGBLeds(0, 0, 0, 0, 0, 0, 1, 0, 0, dsPic); // clear rgb leds because consumes energy
+	frame_encode_header(head, f->hdr.opcode | OP_REPLY, f->hdr.seq, len + 2);
+	head[FRAME_HEADER_LEN] = status;
+	head[FRAME_HEADER_LEN + 1] = t.battery_percent;
 
+	iov[0].iov_base = head;
+	iov[0].iov_len = sizeof(head);
+	iov[1].iov_base = (void *) data;
+	iov[1].iov_len = len;
+
+	if (connWrite(c, iov, len ? 2 : 1) < 0) {
+		puts("Send failed");
+		return -1;
+	}
 	return 0;
 }
 
-void proximitySensor(int i, char *Buffer, short *sensors, char* fs_name) {
+/*!
+ * Send a frame the server did not ask for (OP_EVT_*)
+ *
+ * \return 0 on success, -1 if the socket failed
+ */
+int sendEvent(struct connection *c, uint8_t opcode, uint16_t seq,
+		const void *data, size_t len) {
+	unsigned char head[FRAME_HEADER_LEN];
+	struct iovec iov[2];
+
+	frame_encode_header(head, opcode, seq, len);
+	iov[0].iov_base = head;
+	iov[0].iov_len = sizeof(head);
+	iov[1].iov_base = (void *) data;
+	iov[1].iov_len = len;
+
+	if (connWrite(c, iov, len ? 2 : 1) < 0) {
+		puts("Send failed");
+		return -1;
+	}
+	return 0;
+}
 
-	FILE *file = fopen(fs_name, "w+");
-	if (file == NULL) {
-		printf("Error opening file!\n");
-		exit(1);
+/*!
+ * Server socket callback: flush pending output, read and execute commands
+ */
+void onServer(struct evloop *l, int fd, uint32_t events, void *arg) {
+	struct connection *c = arg;
+	struct frame frame;
+	unsigned char *space;
+	size_t room;
+	ssize_t received;
+	int rc;
+
+	if ((events & EPOLLOUT) && connFlush(c) < 0) {
+		puts("Send failed");
+		linkLost(c);
+		return;
 	}
-	kh4_proximity_ir(Buffer, dsPic);
-	for (i = 0; i < 12; i++) {
-		sensors[i] = (Buffer[i * 2] | Buffer[i * 2 + 1] << 8);
+	if (!(events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+		return;
 
+	while (1) {
+		space = frame_parser_space(&c->parser, &room);
+		received = recv(fd, space, room, 0);
+		if (received < 0 && errno == EINTR)
+			continue;
+		if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (received <= 0) {
+			puts("recv failed");
+			linkLost(c);
+			return;
+		}
+		frame_parser_commit(&c->parser, received);
+		c->rx_ns = monotonic_ns();
+
+		// a single read may hold several frames, or only part of one
+		while ((rc = frame_parser_next(&c->parser, &frame)) > 0) {
+			if (dispatchFrame(c, &frame) < 0) {
+				linkLost(c);
+				return;
+			}
+		}
+		if (rc < 0) {
+			puts("protocol error");
+			linkLost(c);
+			return;
+		}
 	}
-	fprintf(file,
-			"Proximity Sensors\
- \nback left :; %4u; \nleft :; %4u\
- \nfront left :; %4u; \nfront :; %4u\
- \nfront right :; %4u; \nright :; %4u\
- \nback right :; %4u; \nback :; %4u\
- \nground left :; %4u; \ngnd front left :; %4u\
- \ngnd front right:; %4u; \nground right :; %4u\n",
-			sensors[0], sensors[1], sensors[2], sensors[3], sensors[4],
-			sensors[5], sensors[6], sensors[7], sensors[8], sensors[9],
-			sensors[10], sensors[11]);
 
-	fclose(file);
+	robot_clear_screen();
 }
 
-void uaSensor(int i, char *Buffer, short *usvalues, char* fs_name) {
-
-	FILE *file = fopen(fs_name, "a+");
-	if (file == NULL) {
-		printf("Error opening file!\n");
-		exit(1);
+/*!
+ * Subscription timer callback: push a telemetry sample
+ *
+ * A sample is skipped rather than queued while the socket is backed up, so
+ * the server always gets recent data.
+ */
+void onSubscriptionTimer(struct evloop *l, int fd, uint32_t expirations,
+		void *arg) {
+	unsigned char sample[TELEMETRY_DELTA_MAX];
+	struct connection *c = arg;
+	struct telemetry t;
+	size_t len;
+	int key, rc;
+
+	if (subscription.mask == 0 || c->fd < 0 || c->out_len > 0)
+		return;
+
+	sampler_get(&sampler, &t);
+	if (subscription.encoding == ENCODING_PLAIN) {
+		len = telemetry_pack_sample(&t, subscription.mask, sample);
+		rc = sendEvent(c, OP_EVT_TELEMETRY, subscription.seq++, sample, len);
+	} else {
+		key = telemetry_encode(&subscription.codec, &t, subscription.mask,
+				subscription.since_key >= subscription.keyframe_interval,
+				sample, &len);
+		subscription.since_key = key ? 1 : subscription.since_key + 1;
+		rc = sendEvent(c, key ? OP_EVT_TELEMETRY : OP_EVT_TELEMETRY_DELTA,
+				subscription.seq++, sample, len);
 	}
-	kh4_measure_us(Buffer, dsPic);
-	for (i = 0; i < 5; i++) {
-		usvalues[i] = (short) (Buffer[i * 2] | Buffer[i * 2 + 1] << 8);
+	if (rc < 0)
+		linkLost(c);
+}
 
+/*!
+ * Connection manager callback: a server accepted the connection
+ */
+void onServerUp(int fd, const struct sockaddr_in *addr, void *arg) {
+	struct connection *c = arg;
+	int on = 1, idle = 1, count = LINK_TIMEOUT_S;
+	unsigned timeout = LINK_TIMEOUT_S * 1000;
+
+	// without heartbeat, a silent link is still declared dead within a few
+	// seconds: keepalive probes every second, unacknowledged data
+	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &idle, sizeof(idle));
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+	setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, sizeof(timeout));
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+	if (evloop_add(&loop, fd, EPOLLIN, onServer, c) < 0) {
+		close(fd);
+		connmgr_lost(&connmgr);
+		return;
 	}
-	fprintf(file, "\n");
-	fprintf(file,
-			"\nUS sensors : distance [cm]\
-							  \nleft 90:; %4d;\nleft 45:; %4d;\
-							  \nfront:; %4d;\nright 45:; %4d;\nright 90:; %4d;\n",
-			usvalues[0], usvalues[1], usvalues[2], usvalues[3], usvalues[4]);
-	fclose(file);
+	c->fd = fd;
+	c->out_len = 0;
+	c->rx_ns = monotonic_ns();
+	frame_parser_init(&c->parser);
+	serverAddr = *addr;
+
+	// the pushed telemetry starts over with a keyframe
+	subscription.since_key = 0;
+	telemetry_codec_init(&subscription.codec);
+
+	printf("[Client] Connected to server %s port %d...ok!\n",
+			inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+	diodeControl(3, "green"); // enable green diode when connect
 }
 
-void ambientSensor(int i, char *Buffer, short *sensors, char* fs_name) {
+/*!
+ * Drop a dead connection: stop the robot right away, then let the
+ * connection manager reconnect. The session survives, see OP_HELLO.
+ */
+static void linkLost(struct connection *c) {
+	if (c->fd < 0)
+		return;
+	printf("[Client] Connection lost.\n");
+	evloop_remove(&loop, c->fd);
+	close(c->fd);
+	c->fd = -1;
+	c->out_len = 0;
+	evloop_timer_set(heartbeatTimer, 0, 0);
+	closeUdp(); // no steering without the link that can stop it
+
+	script_stop(&script);
+	stopMotors();
+	diodeControl(3, "red");
+	connmgr_lost(&connmgr);
+}
 
-	FILE *file = fopen(fs_name, "a+");
-	if (file == NULL) {
-		printf("Error opening file!\n");
-		exit(1);
+/*!
+ * Heartbeat timer callback: declare the link dead when the server stayed
+ * silent for HEARTBEAT_MISSES intervals
+ */
+void onHeartbeatTimer(struct evloop *l, int fd, uint32_t expirations,
+		void *arg) {
+	struct connection *c = arg;
+
+	if (c->fd >= 0 && heartbeatMs > 0 && monotonic_ns() - c->rx_ns
+			> (uint64_t) HEARTBEAT_MISSES * heartbeatMs * 1000000) {
+		puts("Heartbeat lost");
+		linkLost(c);
 	}
-	kh4_ambiant_ir(Buffer, dsPic);
-	for (i = 0; i < 12; i++) {
-		sensors[i] = (Buffer[i * 2] | Buffer[i * 2 + 1] << 8);
+}
+
+/*!
+ * Led timer callback: write the pending changes, step the animations
+ */
+void onLedTimer(struct evloop *l, int fd, uint32_t expirations, void *arg) {
+	if (leds_tick(&leds, monotonic_us()))
+		evloop_timer_set(fd, LED_TICK_US, 0);
+}
+
+/*!
+ * Script timer callback: run the script up to its next wait
+ */
+void onScriptTimer(struct evloop *l, int fd, uint32_t expirations, void *arg) {
+	scriptTickNs += (uint64_t) expirations * SCRIPT_TICK_US * 1000;
+	hist_record(&scriptJitter, monotonic_ns() - scriptTickNs);
+	if (script_step(&script, scriptTickNs / 1000) != SCRIPT_RUNNING)
+		evloop_timer_set(fd, 0, 0);
+}
+
+/*!
+ * Report the segment being run, or how the trajectory ended
+ */
+static void trajectoryEvent(struct connection *c) {
+	unsigned char evt[5];
+
+	if (c->fd < 0)
+		return;
+	evt[0] = trajectory.state;
+	put_be16(evt + 1, traj_segment(&trajectory));
+	put_be16(evt + 3, trajProgram.segments);
+	if (sendEvent(c, OP_EVT_TRAJECTORY, trajSeq++, evt, sizeof(evt)) < 0)
+		linkLost(c);
+}
+
+/*!
+ * Stop a running trajectory in the given TRAJ_* state
+ */
+static void endTrajectory(int state) {
+	if (trajectory.state != TRAJ_RUNNING)
+		return;
+	traj_stop(&trajectory, state);
+	evloop_timer_set(trajTimer, 0, 0);
+	trajectoryEvent(&conn);
+}
+
+/*!
+ * Apply the reflex bound of the way the trajectory goes: position mode
+ * moves do not go through reflex_set_speed(), a slow bound lowers their
+ * speed limit and a stop ends the trajectory
+ */
+static void trajObstacle(void) {
+	int dir = traj_direction(&trajectory), level, slow;
+
+	if (dir == 0)
+		return;
+	pthread_mutex_lock(&reflex.lock);
+	level = dir > 0 ? reflex.front : reflex.back;
+	slow = reflex.config.slow_speed;
+	pthread_mutex_unlock(&reflex.lock);
+	if (level == REFLEX_STOP)
+		endTrajectory(TRAJ_BLOCKED);
+	else
+		traj_limit(&trajectory, level == REFLEX_SLOW ? slow : 0);
+}
+
+/*!
+ * Trajectory timer callback: follow the trajectory
+ */
+void onTrajTimer(struct evloop *l, int fd, uint32_t expirations, void *arg) {
+	int move = trajectory.move, report;
+
+	report = traj_step(&trajectory, monotonic_us());
+	if (report && trajectory.state != TRAJ_RUNNING)
+		evloop_timer_set(fd, 0, 0);
+	if (report)
+		trajectoryEvent(arg);
+	// a new move may head for an obstacle already there
+	if (trajectory.move != move)
+		trajObstacle();
+}
+
+/* hardware access of the scripts */
+
+static void scriptGo(int left, int right) {
+	go(left, right, 1);
+}
 
+static int scriptKnownColor(const char *color) {
+	return findColor(color) != NULL;
+}
+
+static int scriptSensor(int kind, int index) {
+	struct telemetry t;
+
+	sampler_get(&sampler, &t);
+	switch (kind) {
+	case SENSOR_PROX:
+		return t.proximity[index];
+	case SENSOR_AMB:
+		return t.ambient[index];
+	case SENSOR_US:
+		return t.us[index];
+	case SENSOR_SPEED:
+		return t.speed[index];
+	default:
+		return t.position[index];
 	}
-	fprintf(file, "\n");
-	fprintf(file,
-			"Ambiant Sensors\
-						 \nback left      :; %4.4u;  \nleft           :; %4.4u\
-						 \nfront left     :; %4.4u;  \nfront          :;%4.4u\
-						 \nfront right    :; %4.4u;  \nright          :; %4.4u\
-						 \nback right     :; %4.4u;  \nback           :; %4.4u\
-						 \nground left    :; %4.4u;  \ngnd front left :; %4.4u\
-						 \ngnd front right:; %4.4u;  \nground right   :; %4.4u\n",
-			sensors[0], sensors[1], sensors[2], sensors[3], sensors[4],
-			sensors[5], sensors[6], sensors[7], sensors[8], sensors[9],
-			sensors[10], sensors[11]);
-	fclose(file);
 }
 
-void mottorSensor(char *Buffer, char* fs_name) {
+static const struct script_ops scriptOps = {
+	.go = scriptGo,
+	.stop = stopMotors,
+	.led = diodeControl,
+	.known_color = scriptKnownColor,
+	.sensor = scriptSensor,
+};
+
+/* hardware access of the trajectories */
 
-	FILE *file = fopen(fs_name, "a+");
-	if (file == NULL) {
-		printf("Error opening file!\n");
-		exit(1);
+static void trajPosition(int left, int right) {
+	BUS_LOCK();
+	BUS(robot_set_position(left, right));
+	BUS_UNLOCK();
+}
+
+static void trajSpeed(int left, int right) {
+	reflex_set_speed(&reflex, left, right);
+}
+
+static void trajMaxSpeed(int max) {
+	BUS_LOCK();
+	BUS(robot_set_speed_profile(accinc, accdiv, minspacc, minspdec,
+			max != 0 ? max : maxsp));
+	BUS_UNLOCK();
+}
+
+static const struct traj_ops trajOps = {
+	.set_mode = setMotorMode,
+	.set_position = trajPosition,
+	.set_speed = trajSpeed,
+	.set_max_speed = trajMaxSpeed,
+	.get_position = trajEncoders,
+};
+
+/*--------------------------------------------------------------------*/
+/* command handlers, see the commands[] table */
+
+static inline void putSaturated32(unsigned char *p, uint64_t v) {
+	put_be32(p, v > UINT32_MAX ? UINT32_MAX : v);
+}
+
+static int cmdStop(const struct frame *f, struct reply *r) {
+	script_stop(&script);
+	stopMotors();
+	return ST_OK;
+}
+
+static int cmdRunScript(const struct frame *f, struct reply *r) {
+	static char text[SCRIPT_MAX_LEN];
+	static unsigned char line[2];
+	FILE *fr;
+	size_t len;
+	int error;
+
+	if (f->hdr.length >= 1 && (f->payload[0] & RUNSCRIPT_SHELL)) {
+		system("./" SCRIPT_PATH " &");
+		return ST_OK;
 	}
 
-	int sl, sr, pl, pr;
-	kh4_get_speed(&sl, &sr, dsPic);
-	kh4_get_position(&pl, &pr, dsPic);
-	fprintf(file, "\nmotor speed and position");
-	fprintf(file,
-			"motors speed [mm/s (pulse/)]:; left:; %7.1f;  (%5d)  | right:; %7.1f; (%5d)\n",
-			sl * KH4_SPEED_TO_MM_S, sl, sr * KH4_SPEED_TO_MM_S, sr);
-	fprintf(file,
-			"motors position [mm (pulse)]:; left:; %7.1f; (%7d) | right:; %7.1f; (%7d)\n",
-			pl * KH4_PULSE_TO_MM, pl, pr * KH4_PULSE_TO_MM, pr);
+	fr = fopen(SCRIPT_PATH, "r");
+	if (fr == NULL) {
+		printf("File %s Cannot be opened.\n", SCRIPT_PATH);
+		return ST_FAILED;
+	}
+	len = fread(text, sizeof(char), sizeof(text), fr);
+	fclose(fr);
+
+	script_stop(&script);
+	error = len == sizeof(text) ? 1
+			: script_compile(&scriptProgram, text, len, &scriptOps);
+	if (error != 0) {
+		put_be16(line, error);
+		r->data = line;
+		r->len = sizeof(line);
+		return ST_FAILED;
+	}
 
-	fclose(file);
+	scriptTickNs = monotonic_ns();
+	script_start(&script, &scriptProgram, &scriptOps, scriptTickNs / 1000);
+	if (script_step(&script, scriptTickNs / 1000) == SCRIPT_RUNNING)
+		evloop_timer_set(scriptTimer, SCRIPT_TICK_US, SCRIPT_TICK_US);
+	hist_record(&scriptStart, monotonic_ns() - conn.rx_ns);
+	return ST_OK;
 }
 
-void batterySensor(char *Buffer, char* fs_name) {
+static int cmdScriptStatus(const struct frame *f, struct reply *r) {
+	static unsigned char out[3 + 2 * 20];
+	const struct histogram *h[2] = { &scriptStart, &scriptJitter };
+	int i;
+
+	out[0] = script.state;
+	put_be16(out + 1, script.state == SCRIPT_RUNNING ? script_line(&script) : 0);
+	for (i = 0; i < 2; i++) {
+		put_be32(out + 3 + 20 * i, h[i]->count);
+		putSaturated32(out + 7 + 20 * i, hist_percentile(h[i], 50));
+		putSaturated32(out + 11 + 20 * i, hist_percentile(h[i], 99));
+		putSaturated32(out + 15 + 20 * i, hist_percentile(h[i], 99.9));
+		putSaturated32(out + 19 + 20 * i, h[i]->max);
+	}
+	if (f->hdr.length >= 1 && f->payload[0] == 1) {
+		hist_reset(&scriptStart);
+		hist_reset(&scriptJitter);
+	}
+
+	r->data = out;
+	r->len = sizeof(out);
+	return ST_OK;
+}
 
-	FILE *file = fopen(fs_name, "a+");
-	if (file == NULL) {
-		printf("Error opening file!\n");
-		exit(1);
+static int cmdLoadScript(const struct frame *f, struct reply *r) {
+	char* fr_name = SCRIPT_PATH;
+	FILE *fr = fopen(fr_name, "a");
+
+	if (fr == NULL) {
+		printf("File %s Cannot be opened.\n", fr_name);
+		return ST_FAILED;
+	}
+	if (fwrite(f->payload, sizeof(char), f->hdr.length, fr) < f->hdr.length) {
+		fclose(fr);
+		return ST_FAILED;
 	}
+	fclose(fr);
+	return ST_OK;
+}
 
-	kh4_battery_status(Buffer, dsPic);
-	fprintf(file, "\n");
-	fprintf(file, "Battery:\n  status (DS2781)   :;  0x%x\n", Buffer[0]);
-	fprintf(file, "  remaining capacity:;  %4.0f mAh\n",
-			(Buffer[1] | Buffer[2] << 8) * 1.6);
-	fprintf(file, "  remaining capacity:;   %3d %%\n", Buffer[3]);
-	fprintf(file, "  current           :; %4.0f mA\n",
-			(short) (Buffer[4] | Buffer[5] << 8) * 0.07813);
-	fprintf(file, "  average current   :;  %4.0f mA\n",
-			(short) (Buffer[6] | Buffer[7] << 8) * 0.07813);
-	fprintf(file, "  temperature       :;  %3.1f C \n",
-			(short) (Buffer[8] | Buffer[9] << 8) * 0.003906);
-	fprintf(file, "  voltage           :;  %4.0f mV \n",
-			(Buffer[10] | Buffer[11] << 8) * 9.76);
-	fprintf(file, "  charger           :;  %s\n",
-			kh4_battery_charge(dsPic) ? "plugged" : "unplugged");
+/*!
+ * Reply data of the upload commands: the acknowledged offset
+ */
+static void uploadAck(struct reply *r) {
+	static unsigned char ack[4];
 
-	fclose(file);
+	put_be32(ack, scriptUpload.offset);
+	r->data = ack;
+	r->len = sizeof(ack);
 }
-void go(int num1, int num2, double rotate) {
 
-	kh4_SetMode(kh4RegSpeed, dsPic);
-	kh4_set_speed(num1 * rotate, num2 * rotate, dsPic);
-	//usleep(100000);
-	//kh4_set_speed(0, 0, dsPic); // stop robot
-	//kh4_SetMode(kh4RegIdle, dsPic); // set motors to idle
+static int cmdUpload(const struct frame *f, struct reply *r) {
+	if (f->hdr.length < 8)
+		return ST_BAD_PAYLOAD;
+	if (upload_begin(&scriptUpload, SCRIPT_PATH, get_be32(f->payload),
+			get_be32(f->payload + 4)) < 0) {
+		printf("File %s Cannot be opened.\n", scriptUpload.tmp);
+		return ST_FAILED;
+	}
+	uploadAck(r);
+	return ST_OK;
+}
 
+static int cmdUploadData(const struct frame *f, struct reply *r) {
+	int rc;
+
+	if (f->hdr.length < 4)
+		return ST_BAD_PAYLOAD;
+	rc = upload_write(&scriptUpload, get_be32(f->payload), f->payload + 4,
+			f->hdr.length - 4);
+	uploadAck(r);
+	if (rc == UPLOAD_GAP || rc == UPLOAD_RANGE)
+		return ST_BAD_PAYLOAD;
+	return rc == UPLOAD_OK ? ST_OK : ST_FAILED;
 }
 
-void diodeControl(int nr, char *color) {
-	if (nr == 1) {
-		if (strcmp(color, "off") == 0) {
-			//printf("set red diode");
+static int cmdUploadEnd(const struct frame *f, struct reply *r) {
+	uploadAck(r);
+	return upload_finish(&scriptUpload) == 0 ? ST_OK : ST_FAILED;
+}
 
-			kh4_SetRGBLeds(0, 0, 0, 0, 0, 0, 0, 0, 0, dsPic);
-		}
+/*!
+ * Fill a buffer with random bytes
+ *
+ * \return 0 on success, -1 if /dev/urandom could not be read
+ */
+static int randomBytes(void *out, size_t len) {
+	FILE *fr = fopen("/dev/urandom", "r");
+	int rc = -1;
+
+	if (fr != NULL) {
+		if (fread(out, len, 1, fr) == 1)
+			rc = 0;
+		fclose(fr);
+	}
+	return rc;
+}
 
-		if (strcmp(color, "red") == 0) {
-			//printf("set red diode");
+/*!
+ * Draw a new session token
+ */
+static uint64_t newToken(void) {
+	uint64_t token = 0;
 
-			kh4_SetRGBLeds(1, 0, 0, 0, 0, 0, 0, 0, 0, dsPic);
-		}
-		if (strcmp(color, "blue") == 0) {
-			//printf("set red diode");
+	if (randomBytes(&token, sizeof(token)) < 0 || token == 0)
+		token = monotonic_ns() ^ (uint64_t) getpid() << 32;
+	return token ? token : 1;
+}
 
-			kh4_SetRGBLeds(0, 0, 1, 0, 0, 0, 0, 0, 0, dsPic);
-		}
-		if (strcmp(color, "yellow") == 0) {
-			//printf("set red diode");
+static void closeUdp(void) {
+	if (udp.fd >= 0)
+		evloop_remove(&loop, udp.fd);
+	udpctl_close(&udp);
+}
 
-			kh4_SetRGBLeds(63, 63, 0, 0, 0, 0, 0, 0, 0, dsPic);
+static int cmdUdp(const struct frame *f, struct reply *r) {
+	static unsigned char out[2 + UDP_KEY_LEN + 12];
+	static int port; // local port of the open channel
+	unsigned char key[UDP_KEY_LEN];
+	struct sockaddr_in addr = serverAddr;
+
+	if (f->hdr.length == 1)
+		return ST_BAD_PAYLOAD;
+	if (f->hdr.length >= 2) {
+		closeUdp();
+		if (get_be16(f->payload) != 0) {
+			addr.sin_port = htons(get_be16(f->payload));
+			if (randomBytes(key, sizeof(key)) < 0
+					|| (port = udpctl_open(&udp, &addr, key)) < 0
+					|| evloop_add(&loop, udp.fd, EPOLLIN, onUdp, NULL) < 0) {
+				udpctl_close(&udp);
+				return ST_FAILED;
+			}
 		}
-		if (strcmp(color, "pink") == 0) {
-			//printf("set red diode");
+	}
 
-			kh4_SetRGBLeds(30, 0, 10, 0, 0, 0, 0, 0, 0, dsPic);
-		}
-		if (strcmp(color, "purple") == 0) {
-			//printf("set red diode");
+	memset(out, 0, 2 + UDP_KEY_LEN);
+	if (udp.fd >= 0) {
+		put_be16(out, port);
+		memcpy(out + 2, udp.key, UDP_KEY_LEN);
+	}
+	put_be32(out + 2 + UDP_KEY_LEN, udp.accepted);
+	put_be32(out + 6 + UDP_KEY_LEN, udp.stale);
+	put_be32(out + 10 + UDP_KEY_LEN, udp.rejected);
+	r->data = out;
+	r->len = sizeof(out);
+	return ST_OK;
+}
 
-			kh4_SetRGBLeds(20, 0, 40, 0, 0, 0, 0, 0, 0, dsPic);
-		}
-		if (strcmp(color, "orange") == 0) {
-			//printf("set red diode");
+static int cmdReflex(const struct frame *f, struct reply *r) {
+	static unsigned char out[14 + 12 + 2 * 16 + 2];
+	const struct histogram *h[2] = { &reflex.latency, &reflex.lateness };
+	struct reflex_config c;
+	int i;
+
+	if (f->hdr.length > 0) {
+		if (f->hdr.length < 12)
+			return ST_BAD_PAYLOAD;
+		pthread_mutex_lock(&reflex.lock);
+		c.us_max_age_ms = reflex.config.us_max_age_ms;
+		pthread_mutex_unlock(&reflex.lock);
+		if (f->hdr.length >= 14)
+			c.us_max_age_ms = get_be16(f->payload + 12);
+		c.rate_hz = get_be16(f->payload);
+		c.ir_slow = get_be16(f->payload + 2);
+		c.ir_stop = get_be16(f->payload + 4);
+		c.us_slow = get_be16(f->payload + 6);
+		c.us_stop = get_be16(f->payload + 8);
+		c.slow_speed = get_be16(f->payload + 10);
+		if (c.rate_hz > REFLEX_MAX_HZ || c.ir_slow > c.ir_stop
+				|| c.us_slow < c.us_stop)
+			return ST_BAD_PAYLOAD;
+		reflex_configure(&reflex, &c);
+	}
 
-			kh4_SetRGBLeds(63, 20, 0, 0, 0, 0, 0, 0, 0, dsPic);
-		}
-		if (strcmp(color, "green") == 0) {
-			//printf("set red diode");
+	pthread_mutex_lock(&reflex.lock);
+	c = reflex.config;
+	put_be16(out, c.rate_hz);
+	put_be16(out + 2, c.ir_slow);
+	put_be16(out + 4, c.ir_stop);
+	put_be16(out + 6, c.us_slow);
+	put_be16(out + 8, c.us_stop);
+	put_be16(out + 10, c.slow_speed);
+	out[12] = reflex.front;
+	out[13] = reflex.back;
+	put_be32(out + 14, reflex.ticks);
+	put_be32(out + 18, reflex.triggers);
+	put_be32(out + 22, reflex.brakes);
+	for (i = 0; i < 2; i++) {
+		putSaturated32(out + 26 + 16 * i, hist_percentile(h[i], 50));
+		putSaturated32(out + 30 + 16 * i, hist_percentile(h[i], 99));
+		putSaturated32(out + 34 + 16 * i, hist_percentile(h[i], 99.9));
+		putSaturated32(out + 38 + 16 * i, h[i]->max);
+	}
+	put_be16(out + 58, c.us_max_age_ms);
+	pthread_mutex_unlock(&reflex.lock);
 
-			kh4_SetRGBLeds(0, 1, 0, 0, 0, 0, 0, 0, 0, dsPic);
-		}
-		if (strcmp(color, "white") == 0) {
-			//printf("set red diode");
+	r->data = out;
+	r->len = sizeof(out);
+	return ST_OK;
+}
 
-			kh4_SetRGBLeds(60, 60, 60, 0, 0, 0, 0, 0, 0, dsPic);
-		}
+/*!
+ * Start a new session from the state of a fresh start, see OP_HELLO
+ */
+static void resetSession(void) {
+	static const struct us_config us = US_SETTINGS;
+	static const struct reflex_config rc = REFLEX_SETTINGS;
+	static const struct odometry_config oc = ODOMETRY_SETTINGS;
+	static const struct line_config lc = LINE_SETTINGS;
+	static const unsigned char off[3] = { 0, 0, 0 };
+
+	script_stop(&script);
+	stopMotors();
+	subscription.mask = 0;
+	evloop_timer_set(subscription.timer, 0, 0);
+	telemetryFormat = TELEMETRY_TEXT;
+	motorSpeed = 100;
+
+	us_configure(&ultrasound, &us);
+	reflex_configure(&reflex, &rc);
+	odometry_configure(&odometry, &oc);
+	line_configure(&lineFollower, &lc);
+
+	leds_set(&leds, 0, off);
+	leds_set(&leds, 1, off);
+	diodeControl(3, "green"); // also ends an animation of the status led
+	camera_stop(&camera);
+	closeUdp();
+}
+
+static int cmdHello(const struct frame *f, struct reply *r) {
+	static unsigned char out[9];
+	int resumed;
+
+	if (f->hdr.length < 8)
+		return ST_BAD_PAYLOAD;
+	resumed = sessionToken != 0 && get_be64(f->payload) == sessionToken;
+	if (!resumed) {
+		sessionToken = newToken();
+		resetSession();
 	}
-	if (nr == 2) {
-		if (strcmp(color, "off") == 0) {
-			//printf("set red diode");
 
-			kh4_SetRGBLeds(0, 0, 0, 0, 0, 0, 0, 0, 0, dsPic);
-		}
+	heartbeatMs = f->hdr.length >= 10 ? get_be16(f->payload + 8) : 0;
+	evloop_timer_set(heartbeatTimer, heartbeatMs * 1000, heartbeatMs * 1000);
 
-		if (strcmp(color, "red") == 0) {
-			//printf("set red diode");
+	put_be64(out, sessionToken);
+	out[8] = resumed;
+	r->data = out;
+	r->len = sizeof(out);
+	return ST_OK;
+}
 
-			kh4_SetRGBLeds(0, 0, 0, 1, 0, 0, 0, 0, 0, dsPic);
-		}
-		if (strcmp(color, "blue") == 0) {
-			//printf("set red diode");
+static int cmdHeartbeat(const struct frame *f, struct reply *r) {
+	return ST_OK;
+}
 
-			kh4_SetRGBLeds(0, 0, 0, 0, 0, 1, 0, 0, 0, dsPic);
-		}
-		if (strcmp(color, "yellow") == 0) {
-			//printf("set red diode");
+static int cmdLine(const struct frame *f, struct reply *r) {
+	static unsigned char out[2 + 16 + 2 + 8 + 2 * 16];
+	const struct histogram *h[2] = { &lineFollower.period,
+			&lineFollower.lateness };
+	struct line_config c;
+	int action = f->hdr.length > 0 ? f->payload[0] : LINE_START;
+	int i;
+
+	if (action > LINE_REPORT || (f->hdr.length > 1 && f->hdr.length < 17))
+		return ST_BAD_PAYLOAD;
+	if (f->hdr.length >= 17) {
+		c.rate_hz = get_be16(f->payload + 1);
+		c.base_speed = (int16_t) get_be16(f->payload + 3);
+		c.kp = (int32_t) get_be32(f->payload + 5) / 1000.0;
+		c.ki = (int32_t) get_be32(f->payload + 9) / 1000.0;
+		c.kd = (int32_t) get_be32(f->payload + 13) / 1000.0;
+		if (c.rate_hz == 0 || c.rate_hz > LINE_MAX_HZ)
+			return ST_BAD_PAYLOAD;
+		line_configure(&lineFollower, &c);
+	}
 
-			kh4_SetRGBLeds(0, 0, 0, 63, 63, 0, 0, 0, 0, dsPic);
-		}
-		if (strcmp(color, "pink") == 0) {
-			//printf("set red diode");
+	if (action == LINE_STOP) {
+		stopMotors();
+	} else if (action == LINE_START && !line_following(&lineFollower)) {
+		script_stop(&script);
+		endTrajectory(TRAJ_ABORTED);
+		setMotorMode(ROBOT_SPEED);
+		if (line_start(&lineFollower) != 0)
+			return ST_FAILED;
+	}
 
-			kh4_SetRGBLeds(0, 0, 0, 30, 0, 10, 0, 0, 0, dsPic);
-		}
-		if (strcmp(color, "purple") == 0) {
-			//printf("set red diode");
+	pthread_mutex_lock(&lineFollower.lock);
+	c = lineFollower.config;
+	out[0] = line_following(&lineFollower);
+	out[1] = lineFollower.lost;
+	put_be16(out + 2, c.rate_hz);
+	put_be16(out + 4, c.base_speed);
+	put_be32(out + 6, (int32_t) (c.kp * 1000));
+	put_be32(out + 10, (int32_t) (c.ki * 1000));
+	put_be32(out + 14, (int32_t) (c.kd * 1000));
+	put_be16(out + 18, (int16_t) (lineFollower.error * 10));
+	put_be32(out + 20, lineFollower.ticks);
+	put_be32(out + 24, lineFollower.lost_ticks);
+	for (i = 0; i < 2; i++) {
+		putSaturated32(out + 28 + 16 * i, hist_percentile(h[i], 50));
+		putSaturated32(out + 32 + 16 * i, hist_percentile(h[i], 99));
+		putSaturated32(out + 36 + 16 * i, hist_percentile(h[i], 99.9));
+		putSaturated32(out + 40 + 16 * i, h[i]->max);
+	}
+	pthread_mutex_unlock(&lineFollower.lock);
 
-			kh4_SetRGBLeds(0, 0, 0, 20, 0, 40, 0, 0, 0, dsPic);
-		}
-		if (strcmp(color, "orange") == 0) {
-			//printf("set red diode");
+	r->data = out;
+	r->len = sizeof(out);
+	return ST_OK;
+}
 
-			kh4_SetRGBLeds(0, 0, 0, 63, 20, 0, 0, 0, 0, dsPic);
+static int cmdTrajectory(const struct frame *f, struct reply *r) {
+	static unsigned char out[6];
+	int error;
+
+	if (f->hdr.length > 0) {
+		if (f->hdr.length % TRAJ_SEGMENT_LEN != 0)
+			return ST_BAD_PAYLOAD;
+		script_stop(&script);
+		stopMotors(); // ends line following or the running trajectory
+		error = traj_compile(&trajProgram, f->payload, f->hdr.length, maxsp);
+		if (error != 0) {
+			put_be16(out, error - 1);
+			r->data = out;
+			r->len = 2;
+			return ST_BAD_PAYLOAD;
 		}
-		if (strcmp(color, "green") == 0) {
-			//printf("set red diode");
+		traj_start(&trajectory, &trajProgram, &trajOps, monotonic_us());
+		if (trajectory.state == TRAJ_RUNNING)
+			evloop_timer_set(trajTimer, TRAJ_TICK_US, TRAJ_TICK_US);
+		trajObstacle();
+	}
 
-			kh4_SetRGBLeds(0, 0, 0, 0, 1, 0, 0, 0, 0, dsPic);
-		}
-		if (strcmp(color, "white") == 0) {
-			//printf("set red diode");
+	out[0] = trajectory.state;
+	put_be16(out + 1, traj_segment(&trajectory));
+	put_be16(out + 3, trajProgram.segments);
+	out[5] = traj_progress(&trajectory);
+	r->data = out;
+	r->len = sizeof(out);
+	return ST_OK;
+}
 
-			kh4_SetRGBLeds(0, 0, 0, 60, 60, 60, 0, 0, 0, dsPic);
-		}
+static int cmdPose(const struct frame *f, struct reply *r) {
+	static unsigned char out[8 + 36 + 8 + 4 + 16];
+	const unsigned char *pose = f->payload + 1, *settings;
+	struct odometry_config c;
+	struct telemetry t;
+	int flags = f->hdr.length > 0 ? f->payload[0] : 0, i;
+
+	settings = pose + (flags & POSE_RESET ? 12 : 0);
+	if (f->hdr.length > 0 && f->hdr.length
+			< settings - f->payload + (flags & POSE_CONFIGURE ? 8 : 0))
+		return ST_BAD_PAYLOAD;
+	if (flags & POSE_CONFIGURE) {
+		c.rate_hz = get_be16(settings);
+		c.gyro = settings[2] != 0;
+		c.wheel_var = get_be16(settings + 4) * 1e-4;
+		c.gyro_var = get_be16(settings + 6) * 1e-6;
+		if (c.rate_hz == 0 || c.rate_hz > ODOMETRY_MAX_HZ)
+			return ST_BAD_PAYLOAD;
+		odometry_configure(&odometry, &c);
 	}
-	if (nr == 3) {
-		if (strcmp(color, "off") == 0) {
-			//printf("set red diode");
+	if (flags & POSE_RESET)
+		odometry_reset(&odometry, (int32_t) get_be32(pose) / 10.0,
+				(int32_t) get_be32(pose + 4) / 10.0,
+				(int32_t) get_be32(pose + 8) / 10000.0);
+
+	poseSensor(&t);
+	put_be64(out, t.timestamp_us);
+	for (i = 0; i < 3; i++)
+		put_be32(out + 8 + 4 * i, t.pose[i]);
+	for (i = 0; i < 6; i++)
+		put_be32(out + 20 + 4 * i, t.pose_cov[i]);
+
+	pthread_mutex_lock(&odometry.lock);
+	c = odometry.config;
+	put_be16(out + 44, c.rate_hz);
+	out[46] = c.gyro;
+	out[47] = 0;
+	put_be16(out + 48, lround(c.wheel_var * 1e4));
+	put_be16(out + 50, lround(c.gyro_var * 1e6));
+	put_be32(out + 52, odometry.ticks);
+	putSaturated32(out + 56, hist_percentile(&odometry.lateness, 50));
+	putSaturated32(out + 60, hist_percentile(&odometry.lateness, 99));
+	putSaturated32(out + 64, hist_percentile(&odometry.lateness, 99.9));
+	putSaturated32(out + 68, odometry.lateness.max);
+	pthread_mutex_unlock(&odometry.lock);
+
+	r->data = out;
+	r->len = sizeof(out);
+	return ST_OK;
+}
 
-			kh4_SetRGBLeds(0, 0, 0, 0, 0, 0, 0, 0, 0, dsPic);
+static int cmdUs(const struct frame *f, struct reply *r) {
+	static unsigned char out[1 + 2 * ROBOT_US_COUNT + 10 * ROBOT_US_COUNT + 20];
+	struct us_config c;
+	short value[ROBOT_US_COUNT];
+	uint32_t age[ROBOT_US_COUNT];
+	unsigned char *p;
+	int i;
+
+	if (f->hdr.length >= 1 + 2 * ROBOT_US_COUNT) {
+		c.mask = f->payload[0];
+		if (c.mask & ~ROBOT_US_ALL)
+			return ST_BAD_PAYLOAD;
+		for (i = 0; i < ROBOT_US_COUNT; i++) {
+			c.period_ms[i] = get_be16(f->payload + 1 + 2 * i);
+			if (c.period_ms[i] > US_MAX_PERIOD_MS)
+				return ST_BAD_PAYLOAD;
 		}
+		us_configure(&ultrasound, &c);
+	} else if (f->hdr.length != 0) {
+		return ST_BAD_PAYLOAD;
+	}
 
-		if (strcmp(color, "red") == 0) {
-			//printf("set red diode");
+	us_get(&ultrasound, value, age);
+	pthread_mutex_lock(&ultrasound.lock);
+	c = ultrasound.config;
+	out[0] = c.mask;
+	p = out + 1;
+	for (i = 0; i < ROBOT_US_COUNT; i++, p += 2)
+		put_be16(p, c.period_ms[i]);
+	for (i = 0; i < ROBOT_US_COUNT; i++, p += 10) {
+		put_be16(p, value[i]);
+		put_be32(p + 2, age[i]);
+		put_be32(p + 6, ultrasound.count[i]);
+	}
+	put_be32(p, ultrasound.errors);
+	putSaturated32(p + 4, hist_percentile(&ultrasound.lateness, 50));
+	putSaturated32(p + 8, hist_percentile(&ultrasound.lateness, 99));
+	putSaturated32(p + 12, hist_percentile(&ultrasound.lateness, 99.9));
+	putSaturated32(p + 16, ultrasound.lateness.max);
+	pthread_mutex_unlock(&ultrasound.lock);
+
+	r->data = out;
+	r->len = sizeof(out);
+	return ST_OK;
+}
 
-			kh4_SetRGBLeds(0, 0, 0, 0, 0, 0, 1, 0, 0, dsPic);
-		}
-		if (strcmp(color, "blue") == 0) {
-			//printf("set red diode");
+static int cmdUp(const struct frame *f, struct reply *r) {
+	go(motorSpeed, motorSpeed, 1);
+	return ST_OK;
+}
 
-			kh4_SetRGBLeds(0, 0, 0, 0, 0, 0, 0, 0, 1, dsPic);
-		}
-		if (strcmp(color, "yellow") == 0) {
-			//printf("set red diode");
+static int cmdDown(const struct frame *f, struct reply *r) {
+	go(-motorSpeed, -motorSpeed, 1);
+	return ST_OK;
+}
 
-			kh4_SetRGBLeds(0, 0, 0, 0, 0, 0, 63, 63, 0, dsPic);
-		}
-		if (strcmp(color, "pink") == 0) {
-			//printf("set red diode");
+static int cmdLeft(const struct frame *f, struct reply *r) {
+	go(-motorSpeed, motorSpeed, ROTATE_HIGH_SPEED_FACT);
+	return ST_OK;
+}
 
-			kh4_SetRGBLeds(0, 0, 0, 0, 0, 0, 30, 0, 10, dsPic);
-		}
-		if (strcmp(color, "purple") == 0) {
-			//printf("set red diode");
+static int cmdRight(const struct frame *f, struct reply *r) {
+	go(motorSpeed, -motorSpeed, ROTATE_HIGH_SPEED_FACT);
+	return ST_OK;
+}
 
-			kh4_SetRGBLeds(0, 0, 0, 0, 0, 0, 20, 0, 40, dsPic);
-		}
-		if (strcmp(color, "orange") == 0) {
-			//printf("set red diode");
+static int cmdVelocity(const struct frame *f, struct reply *r) {
+	if (f->hdr.length < 8)
+		return ST_BAD_PAYLOAD;
+	go((int32_t) get_be32(f->payload), (int32_t) get_be32(f->payload + 4), 1);
+	return ST_OK;
+}
+
+static int cmdSpeed(const struct frame *f, struct reply *r) {
+	if (f->hdr.length < 4)
+		return ST_BAD_PAYLOAD;
+	motorSpeed = (int32_t) get_be32(f->payload);
+	return ST_OK;
+}
+
+static int cmdDiode(const struct frame *f, struct reply *r) {
+	char color[16];
+	size_t len;
+
+	if (f->hdr.length < 2 || f->hdr.length - 1 >= sizeof(color))
+		return ST_BAD_PAYLOAD;
+	len = f->hdr.length - 1;
+	memcpy(color, f->payload + 1, len);
+	color[len] = '\0';
+	if (f->payload[0] < 1 || f->payload[0] > 3 || findColor(color) == NULL)
+		return ST_BAD_PAYLOAD;
+	diodeControl(f->payload[0], color);
+	return ST_OK;
+}
+
+static int cmdLedAnim(const struct frame *f, struct reply *r) {
+	struct led_keyframe keys[LED_MAX_KEYFRAMES];
+	const unsigned char *p = f->payload + 2;
+	uint64_t now = monotonic_us();
+	int i, count;
+
+	if (f->hdr.length < 2 || (f->hdr.length - 2) % 6 != 0
+			|| (f->hdr.length - 2) / 6 > LED_MAX_KEYFRAMES
+			|| (f->payload[0] & ~7) != 0)
+		return ST_BAD_PAYLOAD;
+	count = (f->hdr.length - 2) / 6;
+	for (i = 0; i < count; i++, p += 6) {
+		keys[i].duration_ms = get_be16(p);
+		memcpy(keys[i].rgb, p + 2, 3);
+		keys[i].flags = p[5];
+	}
+
+	for (i = 0; i < LED_COUNT; i++)
+		if ((f->payload[0] & (1 << i))
+				&& leds_animate(&leds, i, keys, count, f->payload[1], now) < 0)
+			return ST_BAD_PAYLOAD;
+	ledsChanged();
+	return ST_OK;
+}
+
+static int cmdAllData(const struct frame *f, struct reply *r) {
+	static char text[FRAME_MAX_PAYLOAD - 2]; // reused for every request
+	static unsigned char record[TELEMETRY_RECORD_LEN];
+	struct telemetry t;
+	size_t len = 0;
+
+	sampler_get(&sampler, &t); // latest snapshot, no bus access
+
+	// the text is only formatted when someone reads it
+	if (telemetryFormat == TELEMETRY_TEXT || telemetryLog != NULL)
+		len = formatTelemetry(&t, text, sizeof(text));
+
+	if (telemetryLog != NULL) {
+		fwrite(text, sizeof(char), len, telemetryLog);
+		fflush(telemetryLog);
+	}
 
-			kh4_SetRGBLeds(0, 0, 0, 0, 0, 0, 63, 20, 0, dsPic);
+	if (telemetryFormat == TELEMETRY_BINARY) {
+		r->data = record;
+		r->len = telemetry_pack(&t, record);
+	} else {
+		r->data = text;
+		r->len = len;
+	}
+	return ST_OK;
+}
+
+static int cmdFormat(const struct frame *f, struct reply *r) {
+	if (f->hdr.length < 1)
+		return ST_BAD_PAYLOAD;
+	if (f->payload[0] != TELEMETRY_TEXT && f->payload[0] != TELEMETRY_BINARY)
+		return ST_BAD_PAYLOAD; // server falls back to the text format
+	telemetryFormat = f->payload[0];
+	return ST_OK;
+}
+
+static int cmdSampling(const struct frame *f, struct reply *r) {
+	int i;
+
+	if (f->hdr.length < 2 * GROUP_POSE)
+		return ST_BAD_PAYLOAD;
+	for (i = 0; i < GROUP_COUNT && 2 * i + 2 <= (int) f->hdr.length; i++)
+		sampler_set_rate(&sampler, i, get_be16(f->payload + 2 * i));
+	return ST_OK;
+}
+
+static int cmdSubscribe(const struct frame *f, struct reply *r) {
+	unsigned mask, hz, interval = SUBSCRIBE_KEYFRAME_INTERVAL;
+	int i, encoding = ENCODING_PLAIN;
+
+	if (f->hdr.length < 4)
+		return ST_BAD_PAYLOAD;
+	mask = get_be16(f->payload) & GROUP_ALL;
+	hz = get_be16(f->payload + 2);
+	if (f->hdr.length >= 5)
+		encoding = f->payload[4];
+	if (f->hdr.length >= 6 && f->payload[5] > 0)
+		interval = f->payload[5];
+	if (mask == 0 || hz == 0 || hz > SUBSCRIBE_MAX_RATE
+			|| (encoding != ENCODING_PLAIN && encoding != ENCODING_DELTA))
+		return ST_BAD_PAYLOAD;
+
+	// sample the subscribed groups at least as fast as they are pushed
+	for (i = 0; i < GROUP_COUNT; i++)
+		if ((mask & GROUP_BIT(i)) && sampler_get_rate(&sampler, i) < hz)
+			sampler_set_rate(&sampler, i, hz);
+
+	subscription.mask = mask;
+	subscription.rate_hz = hz;
+	subscription.encoding = encoding;
+	subscription.keyframe_interval = interval;
+	subscription.since_key = 0;
+	telemetry_codec_init(&subscription.codec);
+	evloop_timer_set(subscription.timer, 1, 1000000 / hz);
+	return ST_OK;
+}
+
+static int cmdUnsubscribe(const struct frame *f, struct reply *r) {
+	subscription.mask = 0;
+	evloop_timer_set(subscription.timer, 0, 0);
+	return ST_OK;
+}
+
+static int cmdBatch(const struct frame *f, struct reply *r);
+
+static int cmdCamera(const struct frame *f, struct reply *r) {
+	static unsigned char out[28];
+	struct sockaddr_in addr = serverAddr;
+	uint16_t port;
+	int fd;
+
+	if (f->hdr.length != 0 && f->hdr.length != 2 && f->hdr.length < 8)
+		return ST_BAD_PAYLOAD;
+	port = f->hdr.length >= 2 ? get_be16(f->payload) : 0;
+	// only a stop goes without the width, height and fps
+	if (port != 0 && f->hdr.length < 8)
+		return ST_BAD_PAYLOAD;
+	if (f->hdr.length >= 2)
+		camera_stop(&camera);
+
+	if (port != 0) {
+		// the stream has its own connection, opened without blocking
+		addr.sin_port = htons(port);
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			return ST_FAILED;
+		if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+				&& errno != EINPROGRESS) {
+			close(fd);
+			return ST_FAILED;
+		}
+		if (camera_start(&camera, &loop, fd, get_be16(f->payload + 2),
+				get_be16(f->payload + 4), get_be16(f->payload + 6)) < 0) {
+			printf("Camera %s Cannot be opened.\n", cameraSource);
+			return ST_FAILED;
 		}
-		if (strcmp(color, "green") == 0) {
-			//printf("set red diode");
+	}
+
+	put_be32(out, camera.captured);
+	put_be32(out + 4, camera.streamed);
+	put_be32(out + 8, camera.dropped);
+	putSaturated32(out + 12, hist_percentile(&camera.latency, 50));
+	putSaturated32(out + 16, hist_percentile(&camera.latency, 99));
+	putSaturated32(out + 20, hist_percentile(&camera.latency, 99.9));
+	putSaturated32(out + 24, camera.latency.max);
+	r->data = out;
+	r->len = sizeof(out);
+	return ST_OK;
+}
+
+static int cmdCache(const struct frame *f, struct reply *r) {
+	static unsigned char out[12 * GROUP_POSE + 4];
+	uint64_t ttl;
+	uint32_t hits, misses;
+	int i;
+
+	// the groups before the pose, which is no bus read
+	if (f->hdr.length >= 4 * GROUP_POSE)
+		for (i = 0; i < GROUP_POSE; i++)
+			sensor_cache_set_ttl(&cache, i, get_be32(f->payload + 4 * i));
+	else if (f->hdr.length != 0)
+		return ST_BAD_PAYLOAD;
+
+	for (i = 0; i < GROUP_POSE; i++) {
+		sensor_cache_counters(&cache, i, &ttl, &hits, &misses);
+		put_be32(out + 12 * i, ttl);
+		put_be32(out + 12 * i + 4, hits);
+		put_be32(out + 12 * i + 8, misses);
+	}
+	put_be32(out + 12 * GROUP_POSE,
+			__atomic_load_n(&busTransactions, __ATOMIC_RELAXED));
+
+	r->data = out;
+	r->len = sizeof(out);
+	return ST_OK;
+}
 
-			kh4_SetRGBLeds(0, 0, 0, 0, 0, 0, 0, 1, 0, dsPic);
+static int cmdStats(const struct frame *f, struct reply *r) {
+	static unsigned char out[FRAME_MAX_PAYLOAD - 2];
+	const struct histogram *h;
+	unsigned char *p = out + 1;
+	int op, stage, count = 0;
+
+	for (op = 0; op < STATS_OPCODES; op++) {
+		if (latency[op][STAGE_EXEC].count == 0)
+			continue;
+		if (p + 1 + STAGE_COUNT * 20 > out + sizeof(out))
+			break;
+		*p++ = op;
+		for (stage = 0; stage < STAGE_COUNT; stage++, p += 20) {
+			h = &latency[op][stage];
+			put_be32(p, h->count);
+			putSaturated32(p + 4, hist_percentile(h, 50));
+			putSaturated32(p + 8, hist_percentile(h, 99));
+			putSaturated32(p + 12, hist_percentile(h, 99.9));
+			putSaturated32(p + 16, h->max);
 		}
-		if (strcmp(color, "white") == 0) {
-			//printf("set red diode");
+		count++;
+	}
+	out[0] = count;
 
-			kh4_SetRGBLeds(0, 0, 0, 0, 0, 0, 60, 60, 60, dsPic);
+	if (f->hdr.length >= 1 && f->payload[0] == 1)
+		memset(latency, 0, sizeof(latency));
 
+	r->data = out;
+	r->len = p - out;
+	return ST_OK;
+}
+
+/*!
+ * Command table, indexed by opcode. To add a command give it an OP_* code
+ * in protocol.h and an entry here; unused slots answer ST_UNKNOWN_OP.
+ */
+static const struct command commands[256] = {
+	[OP_STOP] = { "stop", cmdStop },
+	[OP_RUNSCRIPT] = { "runscript", cmdRunScript },
+	[OP_LOADSCRIPT] = { "loadscript", cmdLoadScript },
+	[OP_LINE] = { "line", cmdLine },
+	[OP_UP] = { "up", cmdUp },
+	[OP_DOWN] = { "down", cmdDown },
+	[OP_LEFT] = { "left", cmdLeft },
+	[OP_RIGHT] = { "right", cmdRight },
+	[OP_SPEED] = { "speed", cmdSpeed },
+	[OP_DIODE] = { "diode", cmdDiode },
+	[OP_ALLDATA] = { "alldata", cmdAllData },
+	[OP_FORMAT] = { "format", cmdFormat },
+	[OP_SAMPLING] = { "sampling", cmdSampling },
+	[OP_SUBSCRIBE] = { "subscribe", cmdSubscribe },
+	[OP_UNSUBSCRIBE] = { "unsubscribe", cmdUnsubscribe },
+	[OP_BATCH] = { "batch", cmdBatch },
+	[OP_STATS] = { "stats", cmdStats },
+	[OP_CACHE] = { "cache", cmdCache },
+	[OP_LEDANIM] = { "ledanim", cmdLedAnim },
+	[OP_UPLOAD] = { "upload", cmdUpload },
+	[OP_UPLOAD_DATA] = { "uploaddata", cmdUploadData },
+	[OP_UPLOAD_END] = { "uploadend", cmdUploadEnd },
+	[OP_SCRIPTSTATUS] = { "scriptstatus", cmdScriptStatus },
+	[OP_CAMERA] = { "camera", cmdCamera },
+	[OP_HELLO] = { "hello", cmdHello },
+	[OP_HEARTBEAT] = { "heartbeat", cmdHeartbeat },
+	[OP_VELOCITY] = { "velocity", cmdVelocity },
+	[OP_UDP] = { "udp", cmdUdp },
+	[OP_REFLEX] = { "reflex", cmdReflex },
+	[OP_TRAJECTORY] = { "trajectory", cmdTrajectory },
+	[OP_POSE] = { "pose", cmdPose },
+	[OP_US] = { "us", cmdUs },
+};
+
+/*!
+ * Execute one command
+ *
+ * \param f command frame
+ * \param r data returned by the command
+ *
+ * \return ST_* status
+ */
+static int runCommand(const struct frame *f, struct reply *r) {
+	const struct command *cmd = &commands[f->hdr.opcode];
+	uint64_t start;
+	int status;
+
+	if (cmd->handler == NULL)
+		return ST_UNKNOWN_OP;
+#ifdef DEBUG
+	printf("[Client] %s seq %u\n", cmd->name, f->hdr.seq);
+#endif
+	start = monotonic_ns();
+	status = cmd->handler(f, r);
+	if (f->hdr.opcode < STATS_OPCODES)
+		hist_record(&latency[f->hdr.opcode][STAGE_EXEC], monotonic_ns() - start);
+	return status;
+}
+
+/*!
+ * Execute the commands of a batch in order and collect their status
+ */
+static int cmdBatch(const struct frame *f, struct reply *r) {
+	static unsigned char ack[FRAME_MAX_PAYLOAD - 2];
+	const unsigned char *p, *end = f->payload + f->hdr.length;
+	struct frame sub;
+	struct reply ignored;
+	size_t len = 2;
+	int status, failed = 0, count = 0;
+
+	if (f->hdr.length < 1)
+		return ST_BAD_PAYLOAD;
+
+	// check the whole batch before running any command of it
+	for (p = f->payload + 1; p < end; p += FRAME_HEADER_LEN + sub.hdr.length) {
+		if (end - p < FRAME_HEADER_LEN || frame_decode_header(p, &sub.hdr) < 0
+				|| (size_t) (end - p) < FRAME_HEADER_LEN + sub.hdr.length
+				|| sub.hdr.opcode == OP_BATCH)
+			return ST_BAD_PAYLOAD;
+		count++;
+	}
+	if (2 + 3 * count > sizeof(ack))
+		return ST_BAD_PAYLOAD;
+
+	for (p = f->payload + 1; p < end; p += FRAME_HEADER_LEN + sub.hdr.length) {
+		frame_decode_header(p, &sub.hdr);
+		sub.payload = p + FRAME_HEADER_LEN;
+		if (failed && (f->payload[0] & BATCH_ABORT_ON_ERROR)) {
+			status = ST_SKIPPED;
+		} else {
+			ignored.data = NULL;
+			ignored.len = 0;
+			status = runCommand(&sub, &ignored);
+			if (status != ST_OK)
+				failed = 1;
 		}
+		put_be16(ack + len, sub.hdr.seq);
+		ack[len + 2] = status;
+		len += 3;
+	}
+	put_be16(ack, count);
 
+	r->data = ack;
+	r->len = len;
+	return failed ? ST_FAILED : ST_OK;
+}
+
+/*!
+ * Execute one command frame and answer it
+ *
+ * \return 0 on success, -1 if the connection must be closed
+ */
+int dispatchFrame(struct connection *c, const struct frame *f) {
+	struct reply r = { NULL, 0 };
+	struct histogram *h;
+	uint64_t start, executed, end;
+	int status, rc;
+
+	start = monotonic_ns();
+	status = runCommand(f, &r);
+	executed = monotonic_ns();
+	rc = sendReply(c, f, status, r.data, r.len);
+	end = monotonic_ns();
+
+	if (f->hdr.opcode < STATS_OPCODES && status != ST_UNKNOWN_OP) {
+		h = latency[f->hdr.opcode];
+		hist_record(&h[STAGE_PARSE], start - c->rx_ns);
+		hist_record(&h[STAGE_REPLY], end - executed);
+		hist_record(&h[STAGE_TOTAL], end - c->rx_ns);
 	}
+	return rc;
+}
+
+/*!
+ * Datagram channel callback: execute the newest steering command
+ */
+void onUdp(struct evloop *l, int fd, uint32_t events, void *arg) {
+	struct udp_command cmd;
+	struct frame f;
+	struct reply ignored = { NULL, 0 };
+
+	if (!udpctl_receive(&udp, &cmd))
+		return;
+	f.hdr.version = FRAME_VERSION;
+	f.hdr.opcode = cmd.opcode;
+	f.hdr.seq = cmd.seq;
+	f.hdr.length = cmd.length;
+	f.payload = cmd.payload;
+	runCommand(&f, &ignored);
+}
+
+/*!
+ * Reflex callback: report the last bound change to the server
+ */
+void onReflex(struct evloop *l, int fd, uint32_t events, void *arg) {
+	struct connection *c = arg;
+	struct reflex_trigger t;
+	unsigned char evt[10];
+	uint64_t pending;
+
+	if (read(fd, &pending, sizeof(pending)) != sizeof(pending))
+		return;
+	trajObstacle();
+	reflex_last(&reflex, &t);
+	if (c->fd < 0)
+		return;
+	evt[0] = t.back;
+	evt[1] = t.level;
+	evt[2] = t.kind;
+	evt[3] = t.index;
+	put_be16(evt + 4, t.value);
+	putSaturated32(evt + 6, t.latency_ns);
+	if (sendEvent(c, OP_EVT_REFLEX, reflexSeq++, evt, sizeof(evt)) < 0)
+		linkLost(c);
 }
@@ -0,0 +1,114 @@
+/* \file protocol.c
+
+ *
+ * \brief
+ *         Frame parser and encoder for the client/server protocol
+ *
+ * See protocol.h for the wire format.
+ *
+ */
+#include <string.h>
+
+#include "protocol.h"
+
+/*--------------------------------------------------------------------*/
+/*!
+ * Reset the parser to an empty state
+ */
+void frame_parser_init(struct frame_parser *p) {
+	p->start = 0;
+	p->end = 0;
+}
+
+/*!
+ * Get the free area of the parser buffer to receive into
+ *
+ * Already consumed bytes are dropped first, so payload pointers returned by
+ * frame_parser_next() are only valid until this function is called again.
+ *
+ * \param p parser
+ * \param room size of the returned area
+ *
+ * \return pointer to the first free byte
+ */
+unsigned char *frame_parser_space(struct frame_parser *p, size_t *room) {
+	if (p->start > 0) {
+		memmove(p->buf, p->buf + p->start, p->end - p->start);
+		p->end -= p->start;
+		p->start = 0;
+	}
+	*room = sizeof(p->buf) - p->end;
+	return p->buf + p->end;
+}
+
+/*!
+ * Account for n bytes received into the area given by frame_parser_space()
+ */
+void frame_parser_commit(struct frame_parser *p, size_t n) {
+	p->end += n;
+}
+
+/*!
+ * Extract the next complete frame
+ *
+ * \param p parser
+ * \param f decoded frame, payload points into the parser buffer
+ *
+ * \return 1 if a frame was extracted, 0 if more bytes are needed,
+ *         -1 on a malformed header (wrong version or oversized payload)
+ */
+int frame_parser_next(struct frame_parser *p, struct frame *f) {
+	const unsigned char *h = p->buf + p->start;
+	size_t avail = p->end - p->start;
+
+	if (avail < FRAME_HEADER_LEN)
+		return 0;
+
+	if (frame_decode_header(h, &f->hdr) < 0)
+		return -1;
+
+	if (avail < FRAME_HEADER_LEN + f->hdr.length)
+		return 0;
+
+	f->payload = h + FRAME_HEADER_LEN;
+	p->start += FRAME_HEADER_LEN + f->hdr.length;
+	return 1;
+}
+
+/*!
+ * Decode and check a frame header
+ *
+ * \param in FRAME_HEADER_LEN bytes
+ * \param hdr decoded header
+ *
+ * \return 0 on success, -1 on a wrong version or an oversized payload
+ */
+int frame_decode_header(const unsigned char *in, struct frame_header *hdr) {
+	hdr->version = in[0];
+	hdr->opcode = in[1];
+	hdr->seq = get_be16(in + 2);
+	hdr->length = get_be32(in + 4);
+
+	if (hdr->version != FRAME_VERSION || hdr->length > FRAME_MAX_PAYLOAD)
+		return -1;
+	return 0;
+}
+
+/*!
+ * Write a frame header
+ *
+ * \param out destination, at least FRAME_HEADER_LEN bytes
+ * \param opcode frame opcode
+ * \param seq sequence number
+ * \param length payload length
+ *
+ * \return number of bytes written
+ */
+size_t frame_encode_header(unsigned char *out, uint8_t opcode, uint16_t seq,
+		uint32_t length) {
+	out[0] = FRAME_VERSION;
+	out[1] = opcode;
+	put_be16(out + 2, seq);
+	put_be32(out + 4, length);
+	return FRAME_HEADER_LEN;
+}
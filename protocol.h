@@ -0,0 +1,339 @@
+/* \file protocol.h
+
+ *
+ * \brief
+ *         Framed command protocol between the Khepera4 client and the server
+ *
+ * Every message on the TCP stream is a frame made of a fixed 8 byte header
+ * followed by an optional payload. All multi-byte fields are sent in network
+ * byte order (big endian):
+ *
+ *   offset  size  field
+ *        0     1  version   protocol version, FRAME_VERSION
+ *        1     1  opcode    OP_* command, or'ed with OP_REPLY in replies
+ *        2     2  seq       sequence number chosen by the server, echoed back
+ *        4     4  length    payload length in bytes (<= FRAME_MAX_PAYLOAD)
+ *
+ * The server may send any number of frames without waiting; the client
+ * answers every command with exactly one reply frame carrying the same
+ * sequence number. A reply payload always starts with a status byte
+ * (ST_*) followed by the battery remaining capacity in percent, then any
+ * command specific data.
+ *
+ * The client may also send events (OP_EVT_*) on its own, with a sequence
+ * number counting the events of that kind.
+ *
+ */
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FRAME_VERSION 1
+#define FRAME_HEADER_LEN 8
+#define FRAME_MAX_PAYLOAD 4096
+
+/* command opcodes, server -> client */
+enum {
+	OP_STOP = 0x01,       // stop the motors
+	OP_RUNSCRIPT = 0x02,  // run script.sh, see script.h; payload: optional
+	                      // uint8 RUNSCRIPT_* flags; reply data on a
+	                      // script error: uint16 faulty line
+	OP_LOADSCRIPT = 0x03, // payload: bytes appended to script.sh
+	OP_LINE = 0x04,       // payload: optional LINE_* action and settings
+	OP_UP = 0x05,
+	OP_DOWN = 0x06,
+	OP_LEFT = 0x07,
+	OP_RIGHT = 0x08,
+	OP_SPEED = 0x09,      // payload: int32 motor speed
+	OP_DIODE = 0x0A,      // payload: uint8 led number (1..3), color name
+	OP_ALLDATA = 0x0B,    // reply data: telemetry snapshot
+	OP_FORMAT = 0x0C,     // payload: uint8 TELEMETRY_* format for alldata
+	OP_SAMPLING = 0x0D,   // payload: uint16 rate [Hz] of proximity, ambient,
+	                      // ultrasound, motors, battery and optionally pose,
+	                      // 0 disables
+	OP_SUBSCRIBE = 0x0E,  // payload: uint16 GROUP_BIT() mask, uint16 rate [Hz],
+	                      // optional uint8 ENCODING_*, uint8 keyframe interval
+	OP_UNSUBSCRIBE = 0x0F, // stop the telemetry push
+	OP_BATCH = 0x10,      // payload: uint8 BATCH_* flags, then complete
+	                      // command frames (header and payload) back to back
+	OP_STATS = 0x11,      // payload: optional uint8, 1 resets after reading
+	OP_CACHE = 0x12,      // payload: optional uint32 freshness budget [us] of
+	                      // each sensor group (not the pose); reply data:
+	                      // uint32 budget, hits and misses of each group,
+	                      // uint32 bus transactions
+	OP_LEDANIM = 0x13,    // payload: uint8 mask of the leds (bit 0 is led 1),
+	                      // uint8 number of plays (0 forever), keyframes
+	OP_UPLOAD = 0x14,     // payload: uint32 length, uint32 CRC-32 of script.sh
+	OP_UPLOAD_DATA = 0x15, // payload: uint32 offset, bytes
+	OP_UPLOAD_END = 0x16, // check the checksum and replace script.sh
+	OP_SCRIPTSTATUS = 0x17, // payload: optional uint8, 1 resets the timings
+	OP_CAMERA = 0x18,     // payload: optional uint16 server port of the video
+	                      // stream (0 stops it), uint16 width, height, fps
+	OP_HELLO = 0x19,      // payload: uint64 session token (0 for a new one),
+	                      // optional uint16 heartbeat interval [ms]
+	OP_HEARTBEAT = 0x1A,  // no-op sent by the server at the heartbeat interval
+	OP_VELOCITY = 0x1B,   // payload: int32 left and right motor speeds
+	OP_UDP = 0x1C,        // payload: optional uint16 server UDP port, 0 closes
+	OP_REFLEX = 0x1D,     // payload: optional reflex settings, see below
+	OP_TRAJECTORY = 0x1E, // payload: trajectory segments, see below
+	OP_POSE = 0x1F,       // payload: optional uint8 POSE_* flags, see below
+	OP_US = 0x20          // payload: optional ultrasound settings, see below
+};
+
+/* OP_RUNSCRIPT flags */
+#define RUNSCRIPT_SHELL 0x01 // run script.sh through the shell instead
+
+/* OP_LINE actions */
+#define LINE_START 0x00  // start following the line (also without payload)
+#define LINE_STOP 0x01   // stop following and stop the motors
+#define LINE_REPORT 0x02 // change nothing but the settings
+
+/* OP_POSE flags */
+#define POSE_RESET 0x01     // set the pose
+#define POSE_CONFIGURE 0x02 // change the odometry settings
+
+/* OP_BATCH flags */
+#define BATCH_ABORT_ON_ERROR 0x01 // skip the commands after a failed one
+
+/*
+ * The commands of a batch run in order and are answered by the single
+ * OP_BATCH reply, whose data is a uint16 command count followed by, for
+ * each command, its uint16 sequence number and uint8 status. Data that the
+ * commands would return on their own (alldata...) is not part of it.
+ */
+
+/*
+ * OP_STATS reply data: uint8 number of commands, then for each command its
+ * uint8 opcode and, for the parse, exec, reply and total stages in that
+ * order, uint32 count, p50, p99, p99.9 and maximum latency in [ns].
+ * Commands run inside a batch only have exec samples.
+ */
+
+/*
+ * OP_LEDANIM keyframes are 6 bytes each: uint16 duration [ms], uint8 red,
+ * green and blue, uint8 KEYFRAME_* flags (see leds.h). The leds play them
+ * locally in a loop; without keyframes the animation stops and the leds
+ * keep their current color. For instance a blink is { 250, color, 0 },
+ * { 250, off, 0 }, a pulse { 500, color, KEYFRAME_FADE },
+ * { 500, off, KEYFRAME_FADE }, and a status code n short blinks followed
+ * by a pause.
+ */
+
+/*
+ * Script upload: OP_UPLOAD declares the new script.sh, the OP_UPLOAD_DATA
+ * chunks follow back to back without waiting for their replies, then
+ * OP_UPLOAD_END. The reply data of all three is the uint32 number of bytes
+ * received so far; for OP_UPLOAD it is where to start sending from, which
+ * is not 0 when an interrupted upload of the same file (same length and
+ * checksum) is resumed. A chunk may overlap data already received but not
+ * start past it (ST_BAD_PAYLOAD). OP_UPLOAD_END fails with ST_FAILED on a
+ * short file, which stays open: the missing chunks can be sent from the
+ * byte count of its reply, then OP_UPLOAD_END again. Only a checksum
+ * mismatch (also ST_FAILED) drops what was received, the file must then be
+ * uploaded again from 0. script.sh is only replaced by a complete and
+ * verified file.
+ */
+
+/*
+ * OP_SCRIPTSTATUS reply data: uint8 SCRIPT_* state, uint16 line being run,
+ * then for the script start latency (command received to first statement
+ * run) and the tick lateness in that order, uint32 count, p50, p99, p99.9
+ * and maximum in [ns].
+ */
+
+/*
+ * OP_CAMERA makes the client open a second TCP connection to the server
+ * at the given port and stream the frames on it, see camera.h. Its reply
+ * data, also returned with an empty payload: uint32 frames captured, sent
+ * and dropped, then uint32 p50, p99, p99.9 and maximum of the capture to
+ * socket latency in [ns].
+ */
+
+/*
+ * The client reconnects by itself when the link is lost, and stops the
+ * motors and any running script in the meantime. Its state (subscription,
+ * formats, leds...) belongs to a session: the server opens one with
+ * OP_HELLO and a 0 token, and gets a uint64 token followed by a uint8
+ * resumed flag in the reply data. Sending that token in the OP_HELLO of a
+ * later connection resumes the session (flag 1) with the state as it was,
+ * so the initial setup does not have to be replayed; any other token
+ * starts a new session as after a fresh start: the robot and any script
+ * stopped, no subscription, text telemetry, the default motor speed and
+ * reflex, line, odometry and ultrasound settings, the leds without
+ * animation, the camera stream and the UDP channel closed. Only the pose,
+ * the uploaded script and the sensor sampling rates are kept. With a
+ * heartbeat interval, the server has to send a frame (OP_HEARTBEAT when it
+ * has nothing else) at least at that interval, otherwise the link is
+ * declared dead after three intervals.
+ */
+
+/*
+ * OP_UDP opens the datagram channel of udpctl.h for OP_VELOCITY and
+ * OP_STOP, from the given port of the server. Reply data: uint16 client
+ * UDP port to send to, the UDP_KEY_LEN byte key of the datagram tags
+ * (zeros while closed), then uint32 datagrams executed, dropped as stale
+ * and dropped as invalid. Without payload it only reports.
+ * The channel is closed when the TCP link is lost.
+ */
+
+/*
+ * OP_REFLEX configures the local obstacle reflex of reflex.h, which bounds
+ * the motor speeds by itself when an obstacle gets near. Payload: uint16
+ * rate [Hz] (0 disables it), proximity IR slow and stop thresholds (raw
+ * values, nearer is higher), front ultrasound slow and stop thresholds
+ * [cm] (both 0 ignore the ultrasound), forward speed bound when slowed,
+ * then optionally the age [ms] above which an ultrasound measurement is
+ * left out (kept if absent). Reply data, also returned with an empty
+ * payload: the first six settings, uint8 front and back REFLEX_* levels,
+ * uint32 ticks, triggers and brakes, then for the time from the start of
+ * the tick reading the sensors to the end of the brake and for the tick
+ * lateness in that order, uint32 p50, p99, p99.9 and maximum in [ns], then
+ * uint16 the ultrasound age bound [ms]. Only the brakes the motors take
+ * count: in position mode (OP_TRAJECTORY) the speeds are not theirs.
+ * Every level change is reported with an OP_EVT_REFLEX event.
+ */
+
+/*
+ * OP_LINE runs the local line follower of linefollow.h, which steers the
+ * robot along a dark line from the ground IR sensors. Payload: uint8
+ * LINE_* action, then optionally the settings: uint16 control rate [Hz],
+ * int16 base speed, int32 kp, ki and kd in thousandths [speed / mm],
+ * [speed / (mm s)] and [speed / (mm / s)]. Reply data: uint8 following
+ * flag and line lost flag, the settings, int16 last line position
+ * [0.1 mm] (positive to the left), uint32 ticks and ticks with the line
+ * lost, then for the tick period and the tick lateness in that order,
+ * uint32 p50, p99, p99.9 and maximum in [ns]; the statistics start over
+ * with each start. Any other motion command stops following.
+ */
+
+/*
+ * OP_TRAJECTORY runs a whole trajectory on the robot, see trajectory.h.
+ * Payload: up to TRAJ_MAX_SEGMENTS segments of 8 bytes: uint8 TRAJ_* type,
+ * uint8 0, uint16 speed limit (lowered to the maximum speed of the motor
+ * profile), int16 a and b as described there. The trajectory replaces the
+ * running one, if any; OP_STOP or any other motion command stops it, and
+ * so does a reflex stop in the way it goes (state TRAJ_BLOCKED), while a
+ * reflex slow bound lowers its speed. On a bad segment the status is
+ * ST_BAD_PAYLOAD and the reply data its uint16 index. Reply data, also
+ * returned with an empty payload: uint8 TRAJ_* state, uint16 segment being
+ * run (the segment count once done), uint16 segment count and uint8
+ * progress of the current move [%] (a waypoint is a turn then a line). An
+ * OP_EVT_TRAJECTORY event reports the start of every segment after the
+ * first and the end.
+ */
+
+/*
+ * OP_POSE reads the pose integrated on the robot by odometry.h; the pose is
+ * also the GROUP_POSE telemetry group. Payload, all optional: uint8 POSE_*
+ * flags, then with POSE_RESET int32 x, y [0.1 mm] and theta [0.1 mrad] of
+ * the new pose, whose covariance starts over from 0, then with
+ * POSE_CONFIGURE uint16 rate [Hz], uint8 gyro correction (0 off, 1 on),
+ * uint8 0, uint16 wheel travel variance [1e-4 mm^2 / mm] and gyro heading
+ * variance [1e-6 rad^2 / s]. Reply data: uint64 time of the pose [us],
+ * the pose and its covariance as in the telemetry record, the settings,
+ * uint32 ticks, then uint32 p50, p99, p99.9 and maximum of the tick
+ * lateness in [ns].
+ */
+
+/*
+ * OP_US reads and sets the ultrasound ranging of ultrasound.h, which the
+ * GROUP_US telemetry and the reflex read. Payload, optional: uint8 mask of
+ * the enabled transducers (bit i is us[i]), then uint16 period [ms] of each
+ * transducer, 0 as often as the slots allow, up to US_MAX_PERIOD_MS. Reply
+ * data: the settings, then for each transducer int16 last measurement,
+ * uint32 its age [us] (0xFFFFFFFF if none) and uint32 measurements done,
+ * then uint32 failed reads and uint32 p50, p99, p99.9 and maximum of the
+ * lateness of the measurements after their due time in [ns].
+ */
+
+/* events, client -> server without request */
+enum {
+	OP_EVT_TELEMETRY = 0x40,      // payload: telemetry sample, see telemetry.h
+	OP_EVT_TELEMETRY_DELTA = 0x41, // payload: delta against the previous one
+	OP_EVT_REFLEX = 0x42,         // payload: uint8 side (0 front, 1 back),
+	                              // uint8 REFLEX_* level, uint8 sensor kind
+	                              // (0 IR, 1 US) and index, uint16 reading,
+	                              // uint32 tick start to brake done [ns] (0
+	                              // if the speeds needed no change or the
+	                              // motors are not in speed mode)
+	OP_EVT_TRAJECTORY = 0x43      // payload: uint8 TRAJ_* state, uint16
+	                              // segment being run, uint16 segment count
+};
+
+#define OP_REPLY 0x80 // set in the opcode of every client reply
+
+/* reply status */
+enum {
+	ST_OK = 0,
+	ST_BAD_PAYLOAD = 1, // payload too short or out of range
+	ST_UNKNOWN_OP = 2,  // opcode not handled by this client
+	ST_FAILED = 3,      // command understood but could not be executed
+	ST_SKIPPED = 4      // not run, an earlier command of the batch failed
+};
+
+struct frame_header {
+	uint8_t version;
+	uint8_t opcode;
+	uint16_t seq;
+	uint32_t length;
+};
+
+struct frame {
+	struct frame_header hdr;
+	const unsigned char *payload; // points into the parser buffer
+};
+
+/*!
+ * Incremental frame parser. Bytes are received straight into the parser
+ * buffer, so frames split across several reads or merged into one read are
+ * both handled without extra copies.
+ */
+struct frame_parser {
+	unsigned char buf[2 * (FRAME_HEADER_LEN + FRAME_MAX_PAYLOAD)];
+	size_t start; // first byte not yet consumed
+	size_t end;   // one past the last received byte
+};
+
+void frame_parser_init(struct frame_parser *p);
+unsigned char *frame_parser_space(struct frame_parser *p, size_t *room);
+void frame_parser_commit(struct frame_parser *p, size_t n);
+int frame_parser_next(struct frame_parser *p, struct frame *f);
+
+int frame_decode_header(const unsigned char *in, struct frame_header *hdr);
+size_t frame_encode_header(unsigned char *out, uint8_t opcode, uint16_t seq,
+		uint32_t length);
+
+/* big endian helpers for payload fields */
+static inline uint16_t get_be16(const unsigned char *p) {
+	return (uint16_t) (p[0] << 8 | p[1]);
+}
+
+static inline uint32_t get_be32(const unsigned char *p) {
+	return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8
+			| p[3];
+}
+
+static inline uint64_t get_be64(const unsigned char *p) {
+	return (uint64_t) get_be32(p) << 32 | get_be32(p + 4);
+}
+
+static inline void put_be16(unsigned char *p, uint16_t v) {
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static inline void put_be32(unsigned char *p, uint32_t v) {
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static inline void put_be64(unsigned char *p, uint64_t v) {
+	put_be32(p, v >> 32);
+	put_be32(p + 4, v);
+}
+
+#endif /* PROTOCOL_H */
@@ -0,0 +1,270 @@
+/* \file reflex.c
+
+ *
+ * \brief
+ *         Local obstacle reflex, see reflex.h
+ *
+ */
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "reflex.h"
+#include "robot.h"
+
+#define REFLEX_IDLE_SLEEP_US 100000 // poll period while disabled
+
+/* proximity IR sensors watched on each side, kh4_proximity_ir() order */
+static const int frontIr[] = { 2, 3, 4 };  // front left, front, front right
+static const int backIr[] = { 0, 7, 6 };   // back left, back, back right
+/* front ultrasound transducers, kh4_measure_us() order */
+static const int frontUs[] = { 1, 2, 3 };  // left 45, front, right 45
+
+/*--------------------------------------------------------------------*/
+/*!
+ * Raise a level from the IR sensors of one side
+ */
+static void checkIr(const struct reflex_config *c, const struct telemetry *t,
+		const int *idx, int n, int back, struct reflex_trigger *worst) {
+	int i, level, v;
+
+	for (i = 0; i < n; i++) {
+		v = t->proximity[idx[i]];
+		level = v >= (int) c->ir_stop ? REFLEX_STOP
+				: v >= (int) c->ir_slow ? REFLEX_SLOW : REFLEX_CLEAR;
+		if (level > worst->level) {
+			worst->back = back;
+			worst->level = level;
+			worst->kind = REFLEX_IR;
+			worst->index = idx[i];
+			worst->value = v;
+		}
+	}
+}
+
+/*!
+ * Raise the front level from the ultrasound transducers, leaving out the
+ * measurements older than us_max_age_ms
+ */
+static void checkUs(const struct reflex_config *c, const short *us,
+		const uint32_t *age_us, struct reflex_trigger *worst) {
+	int i, level, cm;
+
+	for (i = 0; i < (int) (sizeof(frontUs) / sizeof(frontUs[0])); i++) {
+		if (age_us[frontUs[i]] > c->us_max_age_ms * 1000ULL)
+			continue;
+		cm = us[frontUs[i]];
+		if (cm == ROBOT_US_OBJECT_NEAR)
+			cm = 24; // nearer than 25 cm
+		else if (cm >= ROBOT_US_NO_OBJECT)
+			continue;
+		level = cm <= (int) c->us_stop ? REFLEX_STOP
+				: cm <= (int) c->us_slow ? REFLEX_SLOW : REFLEX_CLEAR;
+		if (level > worst->level) {
+			worst->back = 0;
+			worst->level = level;
+			worst->kind = REFLEX_US;
+			worst->index = frontUs[i];
+			worst->value = us[frontUs[i]];
+		}
+	}
+}
+
+/*!
+ * Bound the forward part of the requested speeds by the current levels
+ */
+static void bound(const struct reflex *r, const int want[2], int out[2]) {
+	int v = (want[0] + want[1]) / 2, shift = 0;
+	int slow = r->config.slow_speed;
+
+	if (r->front == REFLEX_STOP && v > 0)
+		shift = -v;
+	else if (r->front == REFLEX_SLOW && v > slow)
+		shift = slow - v;
+	else if (r->back == REFLEX_STOP && v < 0)
+		shift = -v;
+	else if (r->back == REFLEX_SLOW && v < -slow)
+		shift = -slow - v;
+	out[0] = want[0] + shift;
+	out[1] = want[1] + shift;
+}
+
+/*!
+ * Write the bounded speeds, with the lock held
+ *
+ * \param force write them even if they are the ones last written
+ *
+ * \return 1 if the motors were written and took the speeds, 0 otherwise
+ */
+static int apply(struct reflex *r, int force) {
+	int out[2], taken;
+
+	bound(r, r->want, out);
+	if (!force && out[0] == r->applied[0] && out[1] == r->applied[1])
+		return 0;
+	taken = r->set_speed(out[0], out[1]) == 0;
+	r->applied[0] = out[0];
+	r->applied[1] = out[1];
+	return taken;
+}
+
+/*!
+ * Read the sensors once and update the bounds
+ */
+static void tick(struct reflex *r) {
+	struct reflex_config c;
+	struct reflex_trigger front, back, *changed = NULL;
+	struct telemetry t;
+	short us[ROBOT_US_COUNT];
+	uint32_t age_us[ROBOT_US_COUNT];
+	uint64_t start = monotonic_ns(), one = 1;
+
+	pthread_mutex_lock(&r->lock);
+	c = r->config;
+	pthread_mutex_unlock(&r->lock);
+
+	memset(&front, 0, sizeof(front));
+	memset(&back, 0, sizeof(back));
+	back.back = 1;
+	r->read_ir(&t);
+	checkIr(&c, &t, frontIr, 3, 0, &front);
+	if (c.us_slow != 0 || c.us_stop != 0) {
+		r->read_us(us, age_us);
+		checkUs(&c, us, age_us, &front);
+	}
+	checkIr(&c, &t, backIr, 3, 1, &back);
+
+	pthread_mutex_lock(&r->lock);
+	r->ticks++;
+	if (front.level != r->front) {
+		r->front = front.level;
+		changed = &front;
+	}
+	if (back.level != r->back) {
+		r->back = back.level;
+		if (changed == NULL || back.level > front.level)
+			changed = &back;
+	}
+	if (changed != NULL) {
+		if (changed->level != REFLEX_CLEAR)
+			r->triggers++;
+		// a brake the motor mode does not take is not one
+		if (apply(r, 0)) {
+			changed->latency_ns = monotonic_ns() - start;
+			hist_record(&r->latency, changed->latency_ns);
+			r->brakes++;
+		}
+		// a brake stands until the next request
+		r->want[0] = r->applied[0];
+		r->want[1] = r->applied[1];
+		r->last = *changed;
+	}
+	pthread_mutex_unlock(&r->lock);
+	if (changed != NULL && write(r->notify, &one, sizeof(one)) < 0)
+		return; // only fails while an earlier trigger is pending
+}
+
+static void *reflexThread(void *arg) {
+	struct reflex *r = arg;
+	struct timespec ts;
+	uint64_t next = monotonic_ns(), now;
+	unsigned hz;
+
+	while (__atomic_load_n(&r->running, __ATOMIC_RELAXED)) {
+		hz = __atomic_load_n(&r->config.rate_hz, __ATOMIC_RELAXED);
+		if (hz == 0) {
+			next = monotonic_ns() + REFLEX_IDLE_SLEEP_US * 1000ULL;
+		} else {
+			tick(r);
+			next += 1000000000ULL / hz;
+			// keep a fixed cadence, but do not try to catch up after a stall
+			now = monotonic_ns();
+			if (next <= now)
+				next = now + 1000000000ULL / hz;
+		}
+		ts.tv_sec = next / 1000000000;
+		ts.tv_nsec = next % 1000000000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+			;
+		if (hz != 0) {
+			pthread_mutex_lock(&r->lock);
+			hist_record(&r->lateness, monotonic_ns() - next);
+			pthread_mutex_unlock(&r->lock);
+		}
+	}
+	return NULL;
+}
+
+/*!
+ * Start the reflex thread
+ *
+ * The config, read_ir, read_us and set_speed fields must be set before the
+ * call, and the lock initialised: reflex_set_speed() may be called before
+ * the thread runs.
+ *
+ * \return 0 on success, -1 on error
+ */
+int reflex_start(struct reflex *r) {
+	r->want[0] = r->want[1] = 0;
+	r->applied[0] = r->applied[1] = 0;
+	r->front = r->back = REFLEX_CLEAR;
+	memset(&r->last, 0, sizeof(r->last));
+	r->ticks = r->triggers = r->brakes = 0;
+	hist_reset(&r->latency);
+	hist_reset(&r->lateness);
+	r->notify = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (r->notify < 0)
+		return -1;
+
+	r->running = 1;
+	if (pthread_create(&r->thread, NULL, reflexThread, r) != 0) {
+		r->running = 0;
+		close(r->notify);
+		return -1;
+	}
+	return 0;
+}
+
+/*!
+ * Stop the reflex thread and wait for it
+ */
+void reflex_stop(struct reflex *r) {
+	if (!r->running)
+		return;
+	__atomic_store_n(&r->running, 0, __ATOMIC_RELAXED);
+	pthread_join(r->thread, NULL);
+	close(r->notify);
+}
+
+/*!
+ * Request motor speeds, bounded by the obstacles currently detected
+ */
+void reflex_set_speed(struct reflex *r, int left, int right) {
+	pthread_mutex_lock(&r->lock);
+	r->want[0] = left;
+	r->want[1] = right;
+	apply(r, 1); // the motors may have been set to another mode meanwhile
+	pthread_mutex_unlock(&r->lock);
+}
+
+/*!
+ * Change the configuration; disabling the reflex lifts the bounds
+ */
+void reflex_configure(struct reflex *r, const struct reflex_config *c) {
+	pthread_mutex_lock(&r->lock);
+	r->config = *c;
+	if (c->rate_hz == 0)
+		r->front = r->back = REFLEX_CLEAR;
+	hist_reset(&r->lateness);
+	pthread_mutex_unlock(&r->lock);
+}
+
+/*!
+ * Get the last trigger
+ */
+void reflex_last(struct reflex *r, struct reflex_trigger *t) {
+	pthread_mutex_lock(&r->lock);
+	*t = r->last;
+	pthread_mutex_unlock(&r->lock);
+}
@@ -0,0 +1,106 @@
+/* \file reflex.h
+
+ *
+ * \brief
+ *         Local obstacle reflex
+ *
+ * A dedicated thread reads the proximity IR sensors and the last front
+ * ultrasound measurements (see ultrasound.h) at a high rate and bounds the
+ * speed of the robot when an obstacle gets near, without waiting for the
+ * server. Every speed request goes through reflex_set_speed(), which
+ * applies the current bounds before the speeds reach the motors, and the
+ * thread brakes by itself as soon as a reading crosses a threshold.
+ *
+ * Only the forward part of the speeds (the mean of the two wheels) is
+ * bounded, the turn part (their difference) is kept, so the robot can
+ * always turn away in place. An obstacle in front nearer than the slow
+ * threshold bounds the forward speed to slow_speed, nearer than the stop
+ * threshold to 0; the back IR sensors do the same when reversing. A brake
+ * is not undone when the obstacle goes away, the next request moves the
+ * robot again. The ultrasound transducers range less often than the
+ * reflex runs; a measurement older than us_max_age_ms is left out rather
+ * than acted upon.
+ *
+ * Each change of the front or back bound is kept as the last trigger, with
+ * the sensor that caused it and the time from the start of the tick that
+ * read it to the end of the brake, and signalled on the notify descriptor.
+ * A brake counts only if the motors take it: in position mode they do not
+ * follow speed writes.
+ *
+ */
+#ifndef REFLEX_H
+#define REFLEX_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "robot.h"
+#include "sampler.h"
+#include "stats.h"
+
+#define REFLEX_DEFAULT_HZ 200
+#define REFLEX_MAX_HZ 1000
+
+/* bound levels */
+enum {
+	REFLEX_CLEAR,
+	REFLEX_SLOW,
+	REFLEX_STOP
+};
+
+/* sensor kinds */
+enum {
+	REFLEX_IR,
+	REFLEX_US
+};
+
+struct reflex_config {
+	unsigned rate_hz;      // 0 disables the reflex
+	unsigned ir_slow;      // proximity IR thresholds, raw (nearer is higher)
+	unsigned ir_stop;
+	unsigned us_slow;      // front ultrasound thresholds [cm], 0 ignores them
+	unsigned us_stop;
+	int slow_speed;        // forward speed bound of REFLEX_SLOW
+	unsigned us_max_age_ms; // older ultrasound measurements are ignored
+};
+
+struct reflex_trigger {
+	int back;              // 0 front bound, 1 back bound
+	int level;             // REFLEX_CLEAR, SLOW or STOP
+	int kind;              // REFLEX_IR or REFLEX_US
+	int index;             // sensor index of its kind
+	int value;             // reading
+	uint64_t latency_ns;   // tick start -> brake done, 0 if no brake done
+};
+
+/* last ultrasound measurements [cm or ROBOT_US_*] and their age [us] */
+typedef void (*reflex_us_fn)(short value[ROBOT_US_COUNT],
+		uint32_t age_us[ROBOT_US_COUNT]);
+/* motor speed write, 0 if the motors take speeds in their current mode */
+typedef int (*reflex_speed_fn)(int left, int right);
+
+struct reflex {
+	struct reflex_config config;
+	sampler_read_fn read_ir;    // proximity IR read
+	reflex_us_fn read_us;       // ultrasound read
+	reflex_speed_fn set_speed;  // motor write
+	pthread_mutex_t lock;       // held across set_speed() calls
+	int want[2];                // last requested speeds
+	int applied[2];             // speeds last written
+	int front, back;            // current levels
+	struct reflex_trigger last;
+	uint32_t ticks, triggers, brakes;
+	struct histogram latency;   // tick start -> brake done [ns]
+	struct histogram lateness;  // tick lateness [ns]
+	int notify;                 // eventfd, readable after a trigger
+	int running;
+	pthread_t thread;
+};
+
+int reflex_start(struct reflex *r);
+void reflex_stop(struct reflex *r);
+void reflex_set_speed(struct reflex *r, int left, int right);
+void reflex_configure(struct reflex *r, const struct reflex_config *c);
+void reflex_last(struct reflex *r, struct reflex_trigger *t);
+
+#endif /* REFLEX_H */
@@ -0,0 +1,74 @@
+/* \file robot.h
+
+ *
+ * \brief
+ *         Robot hardware interface
+ *
+ * The libkhepera calls used by the client, without the device handle.
+ * Buffers and units are the libkhepera ones (little endian 16 bit values,
+ * raw sensor units, motor speed and encoder pulses), so callers decode
+ * them the same way whatever the backend. Two backends implement it, one
+ * is linked in:
+ *
+ *   robot_kh4.c  the Khepera IV dsPic through libkhepera
+ *   robot_sim.c  a simulated robot in a 2D world, which runs on any Linux
+ *                host, see there for its configuration
+ *
+ * Like libkhepera, the functions are not thread safe; the caller
+ * serialises them.
+ *
+ */
+#ifndef ROBOT_H
+#define ROBOT_H
+
+/* motor control modes, as kh4_SetMode() */
+enum {
+	ROBOT_IDLE,
+	ROBOT_SPEED,
+	ROBOT_SPEED_PROFILE,
+	ROBOT_POSITION
+};
+
+#define ROBOT_SPEED_TO_MM_S 0.678181 // speed unit [mm/s]
+#define ROBOT_PULSE_TO_MM 0.006781   // encoder pulse [mm]
+#define ROBOT_GYRO_DEG_S (66.0 / 1000.0) // gyroscope unit [deg/s]
+#define ROBOT_GYRO_PERIOD_US 10000 // gyroscope sample period
+#define ROBOT_WHEEL_BASE_MM 105.4
+
+/* ultrasound special values, others are distances [cm] */
+#define ROBOT_US_DISABLED 2000
+#define ROBOT_US_NO_OBJECT 1000
+#define ROBOT_US_OBJECT_NEAR 0
+
+#define ROBOT_US_COUNT 5
+#define ROBOT_US_ALL 0x1F // kh4_activate_us() mask of every transducer
+
+int robot_init(int argc, char *argv[]);
+int robot_revision(char *buf);
+
+int robot_set_mode(int mode);
+int robot_set_speed(int left, int right);
+int robot_set_position(int left, int right);
+int robot_get_speed(int *left, int *right);
+int robot_get_position(int *left, int *right);
+int robot_reset_encoders(void);
+int robot_set_speed_profile(int acc_inc, int acc_div, int min_speed_acc,
+		int min_speed_dec, int max_speed);
+int robot_configure_pid(int kp, int ki, int kd);
+int robot_set_position_margin(int margin);
+
+int robot_proximity_ir(char *buf);
+int robot_ambient_ir(char *buf);
+int robot_measure_us(char *buf);
+int robot_activate_us(int mask);
+int robot_measure_gyro(char *buf);
+int robot_battery_status(char *buf);
+int robot_battery_charge(void);
+
+int robot_set_rgb_leds(char left_r, char left_g, char left_b, char right_r,
+		char right_g, char right_b, char back_r, char back_g, char back_b);
+
+void robot_clear_screen(void);
+void robot_restore_terminal(void);
+
+#endif /* ROBOT_H */
@@ -0,0 +1,121 @@
+/* \file robot_kh4.c
+
+ *
+ * \brief
+ *         Robot hardware interface on the Khepera IV dsPic, see robot.h
+ *
+ */
+#include <khepera/khepera.h>
+
+#include "robot.h"
+
+static knet_dev_t * dsPic; // robot pic microcontroller access
+
+/*--------------------------------------------------------------------*/
+/*!
+ * Initiate libkhepera and open the dsPic
+ *
+ * \return 0 on success, -1 if libkhepera failed, -2 if the dsPic could not
+ *         be opened
+ */
+int robot_init(int argc, char *argv[]) {
+	if (kh4_init(argc, argv) != 0)
+		return -1;
+	dsPic = knet_open("Khepera4:dsPic", KNET_BUS_I2C, 0, NULL);
+	if (dsPic == NULL)
+		return -2;
+	return 0;
+}
+
+int robot_revision(char *buf) {
+	return kh4_revision(buf, dsPic);
+}
+
+int robot_set_mode(int mode) {
+	static const int modes[] = {
+		[ROBOT_IDLE] = kh4RegIdle,
+		[ROBOT_SPEED] = kh4RegSpeed,
+		[ROBOT_SPEED_PROFILE] = kh4RegSpeedProfile,
+		[ROBOT_POSITION] = kh4RegPosition,
+	};
+
+	if (mode < 0 || mode > ROBOT_POSITION)
+		return -1;
+	return kh4_SetMode(modes[mode], dsPic);
+}
+
+int robot_set_speed(int left, int right) {
+	return kh4_set_speed(left, right, dsPic);
+}
+
+int robot_set_position(int left, int right) {
+	return kh4_set_position(left, right, dsPic);
+}
+
+int robot_get_speed(int *left, int *right) {
+	return kh4_get_speed(left, right, dsPic);
+}
+
+int robot_get_position(int *left, int *right) {
+	return kh4_get_position(left, right, dsPic);
+}
+
+int robot_reset_encoders(void) {
+	return kh4_ResetEncoders(dsPic);
+}
+
+int robot_set_speed_profile(int acc_inc, int acc_div, int min_speed_acc,
+		int min_speed_dec, int max_speed) {
+	return kh4_SetSpeedProfile(acc_inc, acc_div, min_speed_acc, min_speed_dec,
+			max_speed, dsPic);
+}
+
+int robot_configure_pid(int kp, int ki, int kd) {
+	return kh4_ConfigurePID(kp, ki, kd, dsPic);
+}
+
+int robot_set_position_margin(int margin) {
+	return kh4_SetPositionMargin(margin, dsPic);
+}
+
+int robot_proximity_ir(char *buf) {
+	return kh4_proximity_ir(buf, dsPic);
+}
+
+int robot_ambient_ir(char *buf) {
+	return kh4_ambiant_ir(buf, dsPic);
+}
+
+int robot_measure_us(char *buf) {
+	return kh4_measure_us(buf, dsPic);
+}
+
+int robot_activate_us(int mask) {
+	return kh4_activate_us(mask, dsPic);
+}
+
+int robot_measure_gyro(char *buf) {
+	return kh4_measure_gyro(buf, dsPic);
+}
+
+int robot_battery_status(char *buf) {
+	return kh4_battery_status(buf, dsPic);
+}
+
+int robot_battery_charge(void) {
+	return kh4_battery_charge(dsPic);
+}
+
+int robot_set_rgb_leds(char left_r, char left_g, char left_b, char right_r,
+		char right_g, char right_b, char back_r, char back_g, char back_b) {
+	return kh4_SetRGBLeds(left_r, left_g, left_b, right_r, right_g, right_b,
+			back_r, back_g, back_b, dsPic);
+}
+
+void robot_clear_screen(void) {
+	kb_clrscr();
+}
+
+void robot_restore_terminal(void) {
+	kb_change_term_mode(0);
+}
@@ -0,0 +1,562 @@
+/* \file robot_sim.c
+
+ *
+ * \brief
+ *         Robot hardware interface on a simulated Khepera IV, see robot.h
+ *
+ * The robot drives in a flat 2D world made of walls, round obstacles and
+ * dark tape lines on the floor. Its state is advanced on every call from
+ * the time elapsed since the previous one:
+ *
+ *   - differential drive kinematics from the wheel speeds, in speed mode
+ *     the requested ones, in position mode the maximum speed of the profile
+ *     towards the targets; a move into a wall leaves the robot in place
+ *     with its wheels slipping
+ *   - encoder counts from the wheel travel
+ *   - proximity IR from rays cast around the body, ground IR from the
+ *     floor under the sensors, ultrasound from three rays per transducer
+ *     cone, gyroscope from the turn rate, fixed ambient light and battery
+ *
+ * Every call also waits for the time of a dsPic I2C transaction, so the bus
+ * load and locking of the client behave as on the robot.
+ *
+ * Configuration, from the environment:
+ *
+ *   ROBOT_SIM_WORLD   world file, the default world is a 2 x 2 m arena with
+ *                     a square tape loop and an obstacle in its middle
+ *   ROBOT_SIM_I2C_US  duration of a transaction [us], 200 by default
+ *
+ * A world file has one item per line, lengths in [mm], angles in [deg],
+ * '#' starts a comment:
+ *
+ *   arena <width> <height>            walls around (0, 0) - (width, height)
+ *   wall <x1> <y1> <x2> <y2>
+ *   box <x1> <y1> <x2> <y2>           rectangular obstacle
+ *   circle <x> <y> <radius>           round obstacle
+ *   tape <x1> <y1> <x2> <y2> <width>  dark line on the floor
+ *   start <x> <y> <heading>           initial pose, heading 0 along x
+ *
+ */
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "robot.h"
+
+#define SIM_MAX_ITEMS 64
+#define SIM_STEP_S 0.001     // integration step
+#define SIM_MAX_DT_S 10.0    // longest time integrated in one call
+
+#define BODY_RADIUS_MM 70.0
+#define IR_RANGE_MM 250.0
+#define US_RANGE_CM 250
+#define US_NEAR_CM 25
+#define US_CONE_DEG 15.0     // half angle of a transducer cone
+
+#define FLOOR_WHITE 950      // ground IR over the floor
+#define FLOOR_TAPE 120       // ground IR over a tape line
+#define AMBIENT_LEVEL 3900   // ambient IR, nothing is lit
+
+struct segment {
+	double x1, y1, x2, y2;
+	double width;            // tape only
+};
+
+struct circle {
+	double x, y, r;
+};
+
+static struct segment walls[SIM_MAX_ITEMS];
+static struct segment tapes[SIM_MAX_ITEMS];
+static struct circle circles[SIM_MAX_ITEMS];
+static int nwalls, ntapes, ncircles;
+
+/* proximity IR directions, kh4_proximity_ir() order [deg] */
+static const double irAngle[8] = { 135, 90, 45, 0, -45, -90, -135, 180 };
+
+/* ground IR positions in the robot frame, x forward, y left [mm] */
+static const double groundPos[4][2] = { { 45, 28 }, { 60, 9 }, { 60, -9 }, {
+		45, -28 } };
+
+/* ultrasound directions, kh4_measure_us() order [deg] */
+static const double usAngle[ROBOT_US_COUNT] = { 90, 45, 0, -45, -90 };
+
+static struct {
+	double x, y, theta;      // pose [mm], [rad]
+	double turn_rate;        // [rad/s]
+	double enc[2];           // encoders [pulses]
+	int mode;                // ROBOT_*
+	int speed[2];            // requested speeds
+	int wheel[2];            // current wheel speeds
+	int target[2];           // position mode targets [pulses]
+	int margin;              // position mode margin [pulses]
+	int max_speed;
+	int us_mask;
+	char leds[9];
+	struct timespec last;
+	long bus_ns;
+	uint32_t rng;
+} sim;
+
+/*--------------------------------------------------------------------*/
+/*!
+ * Small noise for the sensor readings
+ *
+ * \param amplitude largest absolute value
+ *
+ * \return a pseudo random value in [-amplitude, amplitude]
+ */
+static int noise(int amplitude) {
+	sim.rng ^= sim.rng << 13;
+	sim.rng ^= sim.rng >> 17;
+	sim.rng ^= sim.rng << 5;
+	return (int) (sim.rng % (2 * amplitude + 1)) - amplitude;
+}
+
+static void addWall(double x1, double y1, double x2, double y2) {
+	if (nwalls < SIM_MAX_ITEMS)
+		walls[nwalls++] = (struct segment) { x1, y1, x2, y2, 0 };
+}
+
+static void addBox(double x1, double y1, double x2, double y2) {
+	addWall(x1, y1, x2, y1);
+	addWall(x2, y1, x2, y2);
+	addWall(x2, y2, x1, y2);
+	addWall(x1, y2, x1, y1);
+}
+
+static void defaultWorld(void) {
+	addBox(0, 0, 2000, 2000);
+	circles[ncircles++] = (struct circle) { 1000, 1000, 150 };
+	tapes[ntapes++] = (struct segment) { 500, 500, 1500, 500, 20 };
+	tapes[ntapes++] = (struct segment) { 1500, 500, 1500, 1500, 20 };
+	tapes[ntapes++] = (struct segment) { 1500, 1500, 500, 1500, 20 };
+	tapes[ntapes++] = (struct segment) { 500, 1500, 500, 500, 20 };
+	sim.x = 1000;
+	sim.y = 500;
+	sim.theta = 0;
+}
+
+/*!
+ * Load a world file
+ *
+ * \param path file name
+ *
+ * \return 0 on success, -1 if it could not be read or has an invalid line
+ */
+static int loadWorld(const char *path) {
+	FILE *f = fopen(path, "r");
+	char line[256], kind[16];
+	double v[5];
+	int n, lineNo = 0;
+
+	if (f == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), f) != NULL) {
+		lineNo++;
+		line[strcspn(line, "#\r\n")] = 0;
+		n = sscanf(line, "%15s %lf %lf %lf %lf %lf", kind, &v[0], &v[1],
+				&v[2], &v[3], &v[4]);
+		if (n <= 0)
+			continue;
+		if (strcmp(kind, "arena") == 0 && n == 3)
+			addBox(0, 0, v[0], v[1]);
+		else if (strcmp(kind, "wall") == 0 && n == 5)
+			addWall(v[0], v[1], v[2], v[3]);
+		else if (strcmp(kind, "box") == 0 && n == 5)
+			addBox(v[0], v[1], v[2], v[3]);
+		else if (strcmp(kind, "circle") == 0 && n == 4
+				&& ncircles < SIM_MAX_ITEMS)
+			circles[ncircles++] = (struct circle) { v[0], v[1], v[2] };
+		else if (strcmp(kind, "tape") == 0 && n == 6 && ntapes < SIM_MAX_ITEMS)
+			tapes[ntapes++] = (struct segment) { v[0], v[1], v[2], v[3], v[4] };
+		else if (strcmp(kind, "start") == 0 && n == 4) {
+			sim.x = v[0];
+			sim.y = v[1];
+			sim.theta = v[2] * M_PI / 180;
+		} else {
+			fprintf(stderr, "%s:%d: invalid world item\n", path, lineNo);
+			fclose(f);
+			return -1;
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
+/*!
+ * Distance from a point to a segment
+ */
+static double segmentDistance(const struct segment *s, double x, double y) {
+	double dx = s->x2 - s->x1, dy = s->y2 - s->y1;
+	double len2 = dx * dx + dy * dy, t = 0;
+
+	if (len2 > 0)
+		t = fmin(1, fmax(0, ((x - s->x1) * dx + (y - s->y1) * dy) / len2));
+	return hypot(x - s->x1 - t * dx, y - s->y1 - t * dy);
+}
+
+/*!
+ * Check whether the robot body at a position touches a wall or obstacle
+ */
+static int collides(double x, double y) {
+	int i;
+
+	for (i = 0; i < nwalls; i++)
+		if (segmentDistance(&walls[i], x, y) < BODY_RADIUS_MM)
+			return 1;
+	for (i = 0; i < ncircles; i++)
+		if (hypot(x - circles[i].x, y - circles[i].y)
+				< circles[i].r + BODY_RADIUS_MM)
+			return 1;
+	return 0;
+}
+
+/*!
+ * Cast a ray against the walls and obstacles
+ *
+ * \param x, y    origin [mm]
+ * \param angle   direction in the world frame [rad]
+ * \param range   longest distance looked at [mm]
+ *
+ * \return the distance to the nearest hit, or range if there is none
+ */
+static double castRay(double x, double y, double angle, double range) {
+	double dx = cos(angle), dy = sin(angle), best = range;
+	int i;
+
+	for (i = 0; i < nwalls; i++) {
+		const struct segment *s = &walls[i];
+		double ex = s->x2 - s->x1, ey = s->y2 - s->y1;
+		double den = dx * ey - dy * ex, t, u;
+
+		if (fabs(den) < 1e-9)
+			continue;
+		t = ((s->x1 - x) * ey - (s->y1 - y) * ex) / den;
+		u = ((s->x1 - x) * dy - (s->y1 - y) * dx) / den;
+		if (t >= 0 && t < best && u >= 0 && u <= 1)
+			best = t;
+	}
+	for (i = 0; i < ncircles; i++) {
+		double cx = circles[i].x - x, cy = circles[i].y - y;
+		double along = cx * dx + cy * dy;
+		double off2 = cx * cx + cy * cy - along * along;
+		double r2 = circles[i].r * circles[i].r, t;
+
+		if (off2 > r2)
+			continue;
+		t = along - sqrt(r2 - off2);
+		if (t < 0)
+			t = 0; // origin inside the obstacle
+		if (along + sqrt(r2 - off2) >= 0 && t < best)
+			best = t;
+	}
+	return best;
+}
+
+/*!
+ * Distance from a sensor on the body rim to the nearest obstacle
+ *
+ * \param angle sensor direction in the robot frame [deg]
+ * \param range longest distance looked at [mm]
+ */
+static double rimDistance(double angle, double range) {
+	double a = sim.theta + angle * M_PI / 180;
+
+	return castRay(sim.x + BODY_RADIUS_MM * cos(a),
+			sim.y + BODY_RADIUS_MM * sin(a), a, range);
+}
+
+static double nowSeconds(const struct timespec *t) {
+	return t->tv_sec + t->tv_nsec * 1e-9;
+}
+
+/*!
+ * Wheel speed of one wheel for the current mode
+ */
+static int wheelSpeed(int i) {
+	int remaining;
+
+	switch (sim.mode) {
+	case ROBOT_SPEED:
+	case ROBOT_SPEED_PROFILE:
+		return sim.speed[i];
+	case ROBOT_POSITION:
+		remaining = sim.target[i] - (int) lround(sim.enc[i]);
+		if (abs(remaining) <= sim.margin)
+			return 0;
+		return remaining > 0 ? sim.max_speed : -sim.max_speed;
+	default:
+		return 0;
+	}
+}
+
+/*!
+ * Advance the simulation to the current time
+ */
+static void advance(void) {
+	struct timespec now;
+	double dt, step, vl, vr, v, w, nx, ny, pulses;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	dt = nowSeconds(&now) - nowSeconds(&sim.last);
+	sim.last = now;
+	if (dt > SIM_MAX_DT_S)
+		dt = SIM_MAX_DT_S;
+
+	while (dt > 0) {
+		step = fmin(dt, SIM_STEP_S);
+		dt -= step;
+		for (i = 0; i < 2; i++)
+			sim.wheel[i] = wheelSpeed(i);
+		if (sim.wheel[0] == 0 && sim.wheel[1] == 0)
+			continue;
+
+		vl = sim.wheel[0] * ROBOT_SPEED_TO_MM_S;
+		vr = sim.wheel[1] * ROBOT_SPEED_TO_MM_S;
+		for (i = 0; i < 2; i++) {
+			pulses = sim.wheel[i] * ROBOT_SPEED_TO_MM_S / ROBOT_PULSE_TO_MM
+					* step;
+			// do not overshoot a position target
+			if (sim.mode == ROBOT_POSITION
+					&& fabs(pulses) > fabs(sim.target[i] - sim.enc[i]))
+				pulses = sim.target[i] - sim.enc[i];
+			sim.enc[i] += pulses;
+		}
+
+		v = (vl + vr) / 2;
+		w = (vr - vl) / ROBOT_WHEEL_BASE_MM;
+		nx = sim.x + v * cos(sim.theta) * step;
+		ny = sim.y + v * sin(sim.theta) * step;
+		if (!collides(nx, ny)) {
+			sim.x = nx;
+			sim.y = ny;
+		}
+		sim.theta = remainder(sim.theta + w * step, 2 * M_PI);
+	}
+	sim.turn_rate = (sim.wheel[1] - sim.wheel[0]) * ROBOT_SPEED_TO_MM_S
+			/ ROBOT_WHEEL_BASE_MM;
+}
+
+/*!
+ * Spend the time of a dsPic transaction and bring the world up to date
+ */
+static void transaction(void) {
+	struct timespec d = { sim.bus_ns / 1000000000, sim.bus_ns % 1000000000 };
+
+	if (sim.bus_ns > 0)
+		nanosleep(&d, NULL);
+	advance();
+}
+
+static void putValue(char *buf, int i, int v) {
+	buf[i * 2] = v & 0xFF;
+	buf[i * 2 + 1] = (v >> 8) & 0xFF;
+}
+
+/*--------------------------------------------------------------------*/
+/*!
+ * Set up the world and the robot
+ *
+ * \return 0 on success, -1 if the world file could not be loaded
+ */
+int robot_init(int argc, char *argv[]) {
+	const char *world = getenv("ROBOT_SIM_WORLD");
+	const char *bus = getenv("ROBOT_SIM_I2C_US");
+
+	memset(&sim, 0, sizeof(sim));
+	nwalls = ntapes = ncircles = 0;
+	sim.bus_ns = (bus != NULL ? atol(bus) : 200) * 1000;
+	sim.margin = 20;
+	sim.max_speed = 400;
+	sim.us_mask = ROBOT_US_ALL;
+	sim.rng = 0x9E3779B9;
+	clock_gettime(CLOCK_MONOTONIC, &sim.last);
+
+	if (world == NULL)
+		defaultWorld();
+	else if (loadWorld(world) < 0)
+		return -1;
+	printf("simulated robot at (%.0f, %.0f) mm, %.0f deg\r\n", sim.x, sim.y,
+			sim.theta * 180 / M_PI);
+	return 0;
+}
+
+int robot_revision(char *buf) {
+	transaction();
+	buf[0] = 0x21; // version C, revision 1
+	return 0;
+}
+
+int robot_set_mode(int mode) {
+	if (mode < 0 || mode > ROBOT_POSITION)
+		return -1;
+	transaction();
+	sim.mode = mode;
+	return 0;
+}
+
+int robot_set_speed(int left, int right) {
+	transaction();
+	sim.speed[0] = left;
+	sim.speed[1] = right;
+	return 0;
+}
+
+int robot_set_position(int left, int right) {
+	transaction();
+	sim.target[0] = left;
+	sim.target[1] = right;
+	return 0;
+}
+
+int robot_get_speed(int *left, int *right) {
+	transaction();
+	*left = sim.wheel[0];
+	*right = sim.wheel[1];
+	return 0;
+}
+
+int robot_get_position(int *left, int *right) {
+	transaction();
+	*left = (int) lround(sim.enc[0]);
+	*right = (int) lround(sim.enc[1]);
+	return 0;
+}
+
+int robot_reset_encoders(void) {
+	transaction();
+	sim.enc[0] = sim.enc[1] = 0;
+	return 0;
+}
+
+int robot_set_speed_profile(int acc_inc, int acc_div, int min_speed_acc,
+		int min_speed_dec, int max_speed) {
+	transaction();
+	sim.max_speed = max_speed; // speed changes are immediate
+	return 0;
+}
+
+int robot_configure_pid(int kp, int ki, int kd) {
+	transaction();
+	return 0;
+}
+
+int robot_set_position_margin(int margin) {
+	transaction();
+	sim.margin = margin;
+	return 0;
+}
+
+int robot_proximity_ir(char *buf) {
+	double d, fx, fy, gx, gy, c = cos(sim.theta), s = sin(sim.theta);
+	int i, j, v;
+
+	transaction();
+	for (i = 0; i < 8; i++) {
+		d = rimDistance(irAngle[i], IR_RANGE_MM);
+		v = (int) (1000 * pow(1 - d / IR_RANGE_MM, 2)) + 5 + noise(3);
+		putValue(buf, i, v < 0 ? 0 : v > 1023 ? 1023 : v);
+	}
+	for (i = 0; i < 4; i++) {
+		fx = groundPos[i][0];
+		fy = groundPos[i][1];
+		gx = sim.x + fx * c - fy * s;
+		gy = sim.y + fx * s + fy * c;
+		v = FLOOR_WHITE;
+		for (j = 0; j < ntapes; j++)
+			if (segmentDistance(&tapes[j], gx, gy) <= tapes[j].width / 2)
+				v = FLOOR_TAPE;
+		putValue(buf, 8 + i, v + noise(10));
+	}
+	return 0;
+}
+
+int robot_ambient_ir(char *buf) {
+	int i;
+
+	transaction();
+	for (i = 0; i < 12; i++)
+		putValue(buf, i, AMBIENT_LEVEL + noise(20));
+	return 0;
+}
+
+int robot_measure_us(char *buf) {
+	double d;
+	int i, cm;
+
+	transaction();
+	for (i = 0; i < ROBOT_US_COUNT; i++) {
+		if (!(sim.us_mask & 1 << i)) {
+			putValue(buf, i, ROBOT_US_DISABLED);
+			continue;
+		}
+		d = fmin(rimDistance(usAngle[i], US_RANGE_CM * 10.0),
+				fmin(rimDistance(usAngle[i] - US_CONE_DEG, US_RANGE_CM * 10.0),
+						rimDistance(usAngle[i] + US_CONE_DEG,
+								US_RANGE_CM * 10.0)));
+		cm = (int) (d / 10);
+		if (cm >= US_RANGE_CM)
+			cm = ROBOT_US_NO_OBJECT;
+		else if (cm < US_NEAR_CM)
+			cm = ROBOT_US_OBJECT_NEAR;
+		putValue(buf, i, cm);
+	}
+	return 0;
+}
+
+int robot_activate_us(int mask) {
+	transaction();
+	sim.us_mask = mask & ROBOT_US_ALL;
+	return 0;
+}
+
+int robot_measure_gyro(char *buf) {
+	int i, z;
+
+	transaction();
+	z = (int) lround(sim.turn_rate * 180 / M_PI / ROBOT_GYRO_DEG_S);
+	for (i = 0; i < 10; i++) {
+		putValue(buf, i, noise(2));       // x
+		putValue(buf, 10 + i, noise(2));  // y
+		putValue(buf, 20 + i, z + noise(2));
+	}
+	return 0;
+}
+
+int robot_battery_status(char *buf) {
+	transaction();
+	buf[0] = 0;
+	putValue(buf + 1, 0, 1400); // 2240 mAh
+	buf[3] = 80;
+	putValue(buf + 4, 0, -1920); // -150 mA
+	putValue(buf + 6, 0, -1920);
+	putValue(buf + 8, 0, 6400);  // 25 C
+	putValue(buf + 10, 0, 760);  // 7.4 V
+	return 0;
+}
+
+int robot_battery_charge(void) {
+	transaction();
+	return 0;
+}
+
+int robot_set_rgb_leds(char left_r, char left_g, char left_b, char right_r,
+		char right_g, char right_b, char back_r, char back_g, char back_b) {
+	const char rgb[9] = { left_r, left_g, left_b, right_r, right_g, right_b,
+			back_r, back_g, back_b };
+
+	transaction();
+	memcpy(sim.leds, rgb, sizeof(rgb));
+	return 0;
+}
+
+void robot_clear_screen(void) {
+}
+
+void robot_restore_terminal(void) {
+}
@@ -0,0 +1,147 @@
+/* \file sampler.c
+
+ *
+ * \brief
+ *         Background sensor acquisition thread, see sampler.h
+ *
+ */
+#include <string.h>
+#include <time.h>
+
+#include "sampler.h"
+
+#define SAMPLER_MAX_SLEEP_US 100000 // bounds the time sampler_stop() waits
+
+/*--------------------------------------------------------------------*/
+/*!
+ * Publish the working copy as the latest snapshot
+ */
+static void publish(struct sampler *s) {
+	unsigned seq = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+
+	__atomic_store_n(&s->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&s->snap, &s->work, sizeof(s->snap));
+	__atomic_store_n(&s->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/*!
+ * Read every group that is due, then publish
+ *
+ * \return time of the next deadline in [us]
+ */
+static uint64_t sampleDue(struct sampler *s, uint64_t now) {
+	uint64_t wake = now + SAMPLER_MAX_SLEEP_US, period;
+	struct sampler_group *g;
+	unsigned hz;
+	int i, updated = 0;
+
+	for (i = 0; i < GROUP_COUNT; i++) {
+		g = &s->groups[i];
+		hz = __atomic_load_n(&g->rate_hz, __ATOMIC_RELAXED);
+		if (hz == 0 || g->read == NULL)
+			continue;
+		period = 1000000 / hz;
+		if (g->next_us <= now) {
+			g->read(&s->work);
+			updated = 1;
+			// keep a fixed cadence, but do not try to catch up after a stall
+			g->next_us += period;
+			if (g->next_us <= now)
+				g->next_us = now + period;
+		}
+		if (g->next_us < wake)
+			wake = g->next_us;
+	}
+
+	if (updated) {
+		s->work.timestamp_us = monotonic_us();
+		publish(s);
+	}
+	return wake;
+}
+
+static void *samplerThread(void *arg) {
+	struct sampler *s = arg;
+	struct timespec ts;
+	uint64_t wake;
+
+	while (__atomic_load_n(&s->running, __ATOMIC_RELAXED)) {
+		wake = sampleDue(s, monotonic_us());
+		ts.tv_sec = wake / 1000000;
+		ts.tv_nsec = (wake % 1000000) * 1000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+			;
+	}
+	return NULL;
+}
+
+/*!
+ * Take a first full reading and start the acquisition thread
+ *
+ * The read callbacks and rates of s->groups must be set before the call.
+ *
+ * \return 0 on success, -1 if the thread could not be created
+ */
+int sampler_start(struct sampler *s) {
+	uint64_t now = monotonic_us();
+	int i;
+
+	s->seq = 0;
+	memset(&s->work, 0, sizeof(s->work));
+	for (i = 0; i < GROUP_COUNT; i++) {
+		if (s->groups[i].read != NULL)
+			s->groups[i].read(&s->work);
+		s->groups[i].next_us = now;
+	}
+	s->work.timestamp_us = monotonic_us();
+	publish(s);
+
+	s->running = 1;
+	if (pthread_create(&s->thread, NULL, samplerThread, s) != 0) {
+		s->running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+/*!
+ * Stop the acquisition thread and wait for it
+ */
+void sampler_stop(struct sampler *s) {
+	if (!s->running)
+		return;
+	__atomic_store_n(&s->running, 0, __ATOMIC_RELAXED);
+	pthread_join(s->thread, NULL);
+}
+
+/*!
+ * Change the sampling rate of a group, 0 disables it
+ */
+void sampler_set_rate(struct sampler *s, int group, unsigned hz) {
+	if (group >= 0 && group < GROUP_COUNT)
+		__atomic_store_n(&s->groups[group].rate_hz, hz, __ATOMIC_RELAXED);
+}
+
+/*!
+ * Get the sampling rate of a group
+ */
+unsigned sampler_get_rate(struct sampler *s, int group) {
+	if (group < 0 || group >= GROUP_COUNT)
+		return 0;
+	return __atomic_load_n(&s->groups[group].rate_hz, __ATOMIC_RELAXED);
+}
+
+/*!
+ * Copy the latest snapshot, never blocks
+ */
+void sampler_get(struct sampler *s, struct telemetry *t) {
+	unsigned seq;
+
+	do {
+		while ((seq = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE)) & 1)
+			;
+		memcpy(t, &s->snap, sizeof(*t));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) != seq);
+}
@@ -0,0 +1,45 @@
+/* \file sampler.h
+
+ *
+ * \brief
+ *         Background sensor acquisition with a lock-free latest snapshot
+ *
+ * A dedicated thread reads every sensor group at its own rate and
+ * publishes the merged result through a sequence lock: the single writer
+ * bumps the sequence to an odd value, updates the snapshot and bumps it
+ * back to even; readers copy the snapshot and retry if the sequence was odd
+ * or changed meanwhile. Readers never block the writer nor each other.
+ *
+ */
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <pthread.h>
+
+#include "telemetry.h"
+
+typedef void (*sampler_read_fn)(struct telemetry *t);
+
+/* one sensor group (GROUP_* of telemetry.h), read by one callback */
+struct sampler_group {
+	sampler_read_fn read;
+	unsigned rate_hz;   // 0 disables the group
+	uint64_t next_us;   // next deadline, acquisition thread only
+};
+
+struct sampler {
+	struct sampler_group groups[GROUP_COUNT];
+	unsigned seq;            // odd while the snapshot is being written
+	struct telemetry snap;   // latest published snapshot
+	struct telemetry work;   // acquisition thread working copy
+	int running;
+	pthread_t thread;
+};
+
+int sampler_start(struct sampler *s);
+void sampler_stop(struct sampler *s);
+void sampler_set_rate(struct sampler *s, int group, unsigned hz);
+unsigned sampler_get_rate(struct sampler *s, int group);
+void sampler_get(struct sampler *s, struct telemetry *t);
+
+#endif /* SAMPLER_H */
@@ -0,0 +1,292 @@
+/* \file script.c
+
+ *
+ * \brief
+ *         In-process motion script engine, see script.h
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "script.h"
+
+/* instructions */
+enum {
+	I_GO,    // a left, b right
+	I_STOP,
+	I_LED,   // arg led, color
+	I_WAIT,  // a [ms]
+	I_REPEAT, // a count, 0 forever
+	I_END,
+	I_UNTIL, // arg sensor, a index, b value, color[0] '<' or '>'
+	I_HALT
+};
+
+static const struct {
+	const char *name;
+	int count; // number of valid indexes
+} sensors[SENSOR_KIND_COUNT] = {
+	[SENSOR_PROX] = { "prox", 12 },
+	[SENSOR_AMB] = { "amb", 12 },
+	[SENSOR_US] = { "us", 5 },
+	[SENSOR_SPEED] = { "speed", 2 },
+	[SENSOR_POS] = { "pos", 2 },
+};
+
+#define MAX_WORDS 6
+
+/*!
+ * Split a line into words, in place
+ *
+ * \return number of words, MAX_WORDS + 1 if there are too many
+ */
+static int splitWords(char *s, char *words[MAX_WORDS]) {
+	int n = 0;
+
+	while (1) {
+		while (*s == ' ' || *s == '\t' || *s == '\r')
+			s++;
+		if (*s == '\0' || *s == '#')
+			return n;
+		if (n == MAX_WORDS)
+			return MAX_WORDS + 1;
+		words[n++] = s;
+		while (*s != '\0' && *s != ' ' && *s != '\t' && *s != '\r' && *s != '#')
+			s++;
+		if (*s == '#') {
+			*s = '\0';
+			return n;
+		}
+		if (*s != '\0')
+			*s++ = '\0';
+	}
+}
+
+/*!
+ * Parse a decimal integer word
+ *
+ * \return 0 on success, -1 if the word is not a number
+ */
+static int number(const char *word, int32_t *v) {
+	char *end;
+	long l = strtol(word, &end, 10);
+
+	if (*end != '\0' || end == word || l < INT32_MIN || l > INT32_MAX)
+		return -1;
+	*v = l;
+	return 0;
+}
+
+/*!
+ * Compile one statement
+ *
+ * \return 0 on success, -1 on a syntax error
+ */
+static int compileLine(struct script_insn *in, char **w, int n,
+		const struct script_ops *ops) {
+	int k;
+
+	if (strcmp(w[0], "go") == 0 && n == 3) {
+		in->op = I_GO;
+		return number(w[1], &in->a) | number(w[2], &in->b);
+	}
+	if (strcmp(w[0], "stop") == 0 && n == 1) {
+		in->op = I_STOP;
+		return 0;
+	}
+	if (strcmp(w[0], "led") == 0 && n == 3) {
+		in->op = I_LED;
+		if (number(w[1], &in->a) < 0 || in->a < 1 || in->a > 3
+				|| strlen(w[2]) >= sizeof(in->color) || !ops->known_color(w[2]))
+			return -1;
+		in->arg = in->a;
+		strcpy(in->color, w[2]);
+		return 0;
+	}
+	if (strcmp(w[0], "wait") == 0 && n == 2) {
+		in->op = I_WAIT;
+		return number(w[1], &in->a) < 0 || in->a < 0 ? -1 : 0;
+	}
+	if (strcmp(w[0], "repeat") == 0 && n == 2) {
+		in->op = I_REPEAT;
+		return number(w[1], &in->a) < 0 || in->a < 0 ? -1 : 0;
+	}
+	if (strcmp(w[0], "end") == 0 && n == 1) {
+		in->op = I_END;
+		return 0;
+	}
+	if (strcmp(w[0], "until") == 0 && n == 5) {
+		in->op = I_UNTIL;
+		for (k = 0; k < SENSOR_KIND_COUNT; k++)
+			if (strcmp(w[1], sensors[k].name) == 0)
+				break;
+		if (k == SENSOR_KIND_COUNT || number(w[2], &in->a) < 0 || in->a < 0
+				|| in->a >= sensors[k].count || number(w[4], &in->b) < 0
+				|| (strcmp(w[3], "<") != 0 && strcmp(w[3], ">") != 0))
+			return -1;
+		in->arg = k;
+		in->color[0] = w[3][0];
+		return 0;
+	}
+	return -1;
+}
+
+/*--------------------------------------------------------------------*/
+/*!
+ * Compile a script
+ *
+ * \param p compiled program
+ * \param text script source
+ * \param len length of text
+ * \param ops callbacks, known_color is used to check the led statements
+ *
+ * \return 0 on success, or the number of the first faulty line
+ */
+int script_compile(struct script_program *p, const char *text, size_t len,
+		const struct script_ops *ops) {
+	char line[128], *words[MAX_WORDS];
+	const char *s = text, *end = text + len, *eol;
+	int n, lineNo = 0, depth = 0;
+
+	p->count = 0;
+	while (s < end) {
+		lineNo++;
+		eol = memchr(s, '\n', end - s);
+		if (eol == NULL)
+			eol = end;
+		if ((size_t) (eol - s) >= sizeof(line))
+			return lineNo;
+		memcpy(line, s, eol - s);
+		line[eol - s] = '\0';
+		s = eol + 1;
+
+		n = splitWords(line, words);
+		if (n == 0)
+			continue;
+		if (n > MAX_WORDS || p->count == SCRIPT_MAX_INSNS - 1)
+			return lineNo;
+		memset(&p->code[p->count], 0, sizeof(p->code[0]));
+		p->code[p->count].line = lineNo;
+		if (compileLine(&p->code[p->count], words, n, ops) < 0)
+			return lineNo;
+
+		if (p->code[p->count].op == I_REPEAT && ++depth > SCRIPT_MAX_DEPTH)
+			return lineNo;
+		if (p->code[p->count].op == I_END && --depth < 0)
+			return lineNo;
+		p->count++;
+	}
+	if (depth != 0)
+		return lineNo;
+
+	memset(&p->code[p->count], 0, sizeof(p->code[0]));
+	p->code[p->count].op = I_HALT;
+	p->code[p->count].line = lineNo;
+	p->count++;
+	return 0;
+}
+
+/*!
+ * Start running a compiled program
+ *
+ * \param vm machine
+ * \param p program, must stay valid while it runs
+ * \param ops hardware callbacks
+ * \param now_us time of the first tick
+ */
+void script_start(struct script_vm *vm, const struct script_program *p,
+		const struct script_ops *ops, uint64_t now_us) {
+	vm->prog = p;
+	vm->ops = ops;
+	vm->state = SCRIPT_RUNNING;
+	vm->pc = 0;
+	vm->clock_us = now_us;
+	vm->wake_us = now_us;
+	vm->depth = 0;
+}
+
+/*!
+ * Run the program until it waits
+ *
+ * \param vm machine
+ * \param tick_us scheduled time of this tick; waits are counted from it
+ *        rather than from the actual time, so they do not drift
+ *
+ * \return SCRIPT_RUNNING while the program has more to do, SCRIPT_IDLE
+ *         once it ended
+ */
+int script_step(struct script_vm *vm, uint64_t tick_us) {
+	const struct script_insn *in;
+	int budget = SCRIPT_STEP_BUDGET, v;
+
+	if (vm->state != SCRIPT_RUNNING)
+		return vm->state;
+	vm->clock_us = tick_us;
+	if (tick_us < vm->wake_us)
+		return SCRIPT_RUNNING;
+
+	while (budget-- > 0) {
+		in = &vm->prog->code[vm->pc];
+		switch (in->op) {
+		case I_GO:
+			vm->ops->go(in->a, in->b);
+			break;
+		case I_STOP:
+			vm->ops->stop();
+			break;
+		case I_LED:
+			vm->ops->led(in->arg, in->color);
+			break;
+		case I_WAIT:
+			// continue from the end of the wait, whatever tick runs it
+			vm->wake_us = (vm->wake_us > tick_us ? vm->wake_us : tick_us)
+					+ (uint64_t) in->a * 1000;
+			vm->pc++;
+			return SCRIPT_RUNNING;
+		case I_REPEAT:
+			vm->loops[vm->depth].body = vm->pc + 1;
+			vm->loops[vm->depth].left = in->a == 0 ? -1 : in->a;
+			vm->depth++;
+			break;
+		case I_END:
+			if (vm->loops[vm->depth - 1].left > 0)
+				vm->loops[vm->depth - 1].left--;
+			if (vm->loops[vm->depth - 1].left != 0) {
+				vm->pc = vm->loops[vm->depth - 1].body;
+				continue;
+			}
+			vm->depth--;
+			break;
+		case I_UNTIL:
+			v = vm->ops->sensor(in->arg, in->a);
+			if (in->color[0] == '<' ? !(v < in->b) : !(v > in->b)) {
+				vm->wake_us = tick_us;
+				return SCRIPT_RUNNING; // check again on the next tick
+			}
+			break;
+		case I_HALT:
+		default:
+			vm->state = SCRIPT_IDLE;
+			return SCRIPT_IDLE;
+		}
+		vm->pc++;
+	}
+	vm->wake_us = tick_us;
+	return SCRIPT_RUNNING;
+}
+
+/*!
+ * Stop the program, the motors are left as they are
+ */
+void script_stop(struct script_vm *vm) {
+	vm->state = SCRIPT_IDLE;
+}
+
+/*!
+ * Source line of the current instruction
+ */
+int script_line(const struct script_vm *vm) {
+	if (vm->prog == NULL)
+		return 0;
+	return vm->prog->code[vm->pc].line;
+}
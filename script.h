@@ -0,0 +1,92 @@
+/* \file script.h
+
+ *
+ * \brief
+ *         In-process motion script engine
+ *
+ * Scripts are plain text, one statement per line, '#' starts a comment:
+ *
+ *   go <left> <right>          motor speeds
+ *   stop                       stop the motors
+ *   led <1..3> <color>         led color, a name of the color table
+ *   wait <ms>                  pause
+ *   repeat <n> ... end         loop n times, 0 forever (nesting allowed)
+ *   until <sensor> <i> <op> <v> wait for a sensor condition, op is < or >,
+ *                              sensor is prox, amb, us, speed or pos
+ *
+ * script_compile() turns the text into a flat instruction array, checking
+ * everything that can be checked up front; script_step() then runs it on
+ * each tick of the caller's timer until the next wait, with no parsing and
+ * no allocation. Hardware access goes through the script_ops callbacks.
+ *
+ */
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SCRIPT_MAX_INSNS 1024
+#define SCRIPT_MAX_DEPTH 8    // nested repeat
+#define SCRIPT_STEP_BUDGET 256 // instructions per tick, for loops without wait
+
+/* sensors of the until statement */
+enum {
+	SENSOR_PROX,
+	SENSOR_AMB,
+	SENSOR_US,
+	SENSOR_SPEED,
+	SENSOR_POS,
+	SENSOR_KIND_COUNT
+};
+
+/* script_step() results and script states */
+enum {
+	SCRIPT_IDLE = 0,
+	SCRIPT_RUNNING = 1
+};
+
+struct script_ops {
+	void (*go)(int left, int right);
+	void (*stop)(void);
+	void (*led)(int nr, const char *color);
+	int (*known_color)(const char *color);
+	int (*sensor)(int kind, int index);
+};
+
+struct script_insn {
+	uint8_t op;
+	uint8_t arg;   // led number, sensor kind
+	uint16_t line; // source line, for error reports
+	int32_t a, b;
+	char color[8];
+};
+
+struct script_program {
+	struct script_insn code[SCRIPT_MAX_INSNS];
+	int count;
+};
+
+struct script_vm {
+	const struct script_program *prog;
+	const struct script_ops *ops;
+	int state;          // SCRIPT_*
+	int pc;
+	uint64_t clock_us;  // scheduled time of the current tick
+	uint64_t wake_us;   // end of the current wait
+	struct {
+		int body;       // first instruction of the loop body
+		int32_t left;   // iterations left, -1 forever
+	} loops[SCRIPT_MAX_DEPTH];
+	int depth;
+};
+
+int script_compile(struct script_program *p, const char *text, size_t len,
+		const struct script_ops *ops);
+void script_start(struct script_vm *vm, const struct script_program *p,
+		const struct script_ops *ops, uint64_t now_us);
+int script_step(struct script_vm *vm, uint64_t tick_us);
+void script_stop(struct script_vm *vm);
+int script_line(const struct script_vm *vm);
+
+#endif /* SCRIPT_H */
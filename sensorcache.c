@@ -0,0 +1,96 @@
+/* \file sensorcache.c
+
+ *
+ * \brief
+ *         Time-to-live cache in front of the sensor reads, see sensorcache.h
+ *
+ */
+#include "sensorcache.h"
+
+/*--------------------------------------------------------------------*/
+/*!
+ * Initialise the group locks; read callbacks and budgets are set by the
+ * caller, before or after
+ */
+void sensor_cache_init(struct sensor_cache *c) {
+	int i;
+
+	for (i = 0; i < GROUP_COUNT; i++) {
+		pthread_mutex_init(&c->groups[i].lock, NULL);
+		c->groups[i].stamp_us = 0;
+		c->groups[i].hits = 0;
+		c->groups[i].misses = 0;
+	}
+}
+
+/*!
+ * Read a sensor group, from the cache while it is fresh
+ *
+ * \param c cache
+ * \param group GROUP_*
+ * \param t destination, only the fields of the group are written
+ *
+ * \return 1 on a cache hit, 0 after a bus read, -1 for an unknown group
+ */
+int sensor_cache_read(struct sensor_cache *c, int group, struct telemetry *t) {
+	return sensor_cache_read_stamped(c, group, t, NULL);
+}
+
+/*!
+ * Read a sensor group like sensor_cache_read(), also telling when the bus
+ * read behind it was made, which tells a reading seen before from a new one
+ *
+ * \param stamp_us time of the bus read [us], may be NULL
+ */
+int sensor_cache_read_stamped(struct sensor_cache *c, int group,
+		struct telemetry *t, uint64_t *stamp_us) {
+	struct sensor_cache_entry *e;
+	uint64_t now;
+	int hit;
+
+	if (group < 0 || group >= GROUP_COUNT || c->groups[group].read == NULL)
+		return -1;
+	e = &c->groups[group];
+
+	pthread_mutex_lock(&e->lock);
+	now = monotonic_us();
+	hit = e->stamp_us != 0 && now - e->stamp_us < e->ttl_us;
+	if (hit) {
+		e->hits++;
+	} else {
+		e->read(&e->data);
+		e->stamp_us = now;
+		e->misses++;
+	}
+	telemetry_copy_groups(t, &e->data, GROUP_BIT(group));
+	if (stamp_us != NULL)
+		*stamp_us = e->stamp_us;
+	pthread_mutex_unlock(&e->lock);
+
+	return hit;
+}
+
+/*!
+ * Change the freshness budget of a group, 0 reads the bus every time
+ */
+void sensor_cache_set_ttl(struct sensor_cache *c, int group, uint64_t ttl_us) {
+	if (group < 0 || group >= GROUP_COUNT)
+		return;
+	pthread_mutex_lock(&c->groups[group].lock);
+	c->groups[group].ttl_us = ttl_us;
+	pthread_mutex_unlock(&c->groups[group].lock);
+}
+
+/*!
+ * Get the budget and the counters of a group
+ */
+void sensor_cache_counters(struct sensor_cache *c, int group, uint64_t *ttl_us,
+		uint32_t *hits, uint32_t *misses) {
+	struct sensor_cache_entry *e = &c->groups[group];
+
+	pthread_mutex_lock(&e->lock);
+	*ttl_us = e->ttl_us;
+	*hits = e->hits;
+	*misses = e->misses;
+	pthread_mutex_unlock(&e->lock);
+}
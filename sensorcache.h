@@ -0,0 +1,43 @@
+/* \file sensorcache.h
+
+ *
+ * \brief
+ *         Time-to-live cache in front of the sensor reads
+ *
+ * Every sensor group has a freshness budget: a read within that time of
+ * the last bus read is served from the cache. A miss reads the bus with
+ * the group lock held, so concurrent readers of the same group wait for
+ * that read instead of issuing their own.
+ *
+ */
+#ifndef SENSORCACHE_H
+#define SENSORCACHE_H
+
+#include <pthread.h>
+
+#include "sampler.h"
+#include "telemetry.h"
+
+struct sensor_cache_entry {
+	pthread_mutex_t lock;
+	sampler_read_fn read; // bus read of the group
+	uint64_t ttl_us;      // freshness budget
+	uint64_t stamp_us;    // time of the cached reading, 0 if none
+	struct telemetry data; // only the fields of this group are used
+	uint32_t hits;
+	uint32_t misses;
+};
+
+struct sensor_cache {
+	struct sensor_cache_entry groups[GROUP_COUNT];
+};
+
+void sensor_cache_init(struct sensor_cache *c);
+int sensor_cache_read(struct sensor_cache *c, int group, struct telemetry *t);
+int sensor_cache_read_stamped(struct sensor_cache *c, int group,
+		struct telemetry *t, uint64_t *stamp_us);
+void sensor_cache_set_ttl(struct sensor_cache *c, int group, uint64_t ttl_us);
+void sensor_cache_counters(struct sensor_cache *c, int group, uint64_t *ttl_us,
+		uint32_t *hits, uint32_t *misses);
+
+#endif /* SENSORCACHE_H */
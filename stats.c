@@ -0,0 +1,77 @@
+/* \file stats.c
+
+ *
+ * \brief
+ *         Fixed memory latency histograms, see stats.h
+ *
+ */
+#include <string.h>
+
+#include "stats.h"
+
+/*--------------------------------------------------------------------*/
+/*!
+ * Bucket of a value: the position of its highest bit selects the power of
+ * two, the next HIST_SUB_BITS bits the bucket within it
+ */
+static unsigned bucketOf(uint64_t v) {
+	unsigned msb, b;
+
+	if (v < (1u << HIST_SUB_BITS))
+		return v;
+	msb = 63 - __builtin_clzll(v);
+	b = ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+			| ((v >> (msb - HIST_SUB_BITS)) & ((1u << HIST_SUB_BITS) - 1));
+	return b < HIST_BUCKETS ? b : HIST_BUCKETS - 1;
+}
+
+/*!
+ * Highest value counted in a bucket
+ */
+static uint64_t bucketTop(unsigned b) {
+	unsigned shift;
+
+	if (b < (1u << HIST_SUB_BITS))
+		return b;
+	shift = (b >> HIST_SUB_BITS) - 1;
+	return ((uint64_t) ((b & ((1u << HIST_SUB_BITS) - 1))
+			| (1u << HIST_SUB_BITS)) << shift) + ((uint64_t) 1 << shift) - 1;
+}
+
+void hist_reset(struct histogram *h) {
+	memset(h, 0, sizeof(*h));
+}
+
+void hist_record(struct histogram *h, uint64_t value) {
+	h->bucket[bucketOf(value)]++;
+	h->count++;
+	if (value > h->max)
+		h->max = value;
+}
+
+/*!
+ * Get a percentile
+ *
+ * \param h histogram
+ * \param p percentile, 0..100
+ *
+ * \return upper bound of the bucket holding the percentile (never above the
+ *         maximum recorded value), 0 for an empty histogram
+ */
+uint64_t hist_percentile(const struct histogram *h, double p) {
+	uint64_t rank, seen = 0, top;
+	unsigned b;
+
+	if (h->count == 0)
+		return 0;
+	rank = (uint64_t) (p / 100.0 * h->count + 0.5);
+	if (rank < 1)
+		rank = 1;
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		seen += h->bucket[b];
+		if (seen >= rank)
+			break;
+	}
+	top = bucketTop(b);
+	return top < h->max ? top : h->max;
+}
@@ -0,0 +1,42 @@
+/* \file stats.h
+
+ *
+ * \brief
+ *         Fixed memory latency histograms
+ *
+ * Values are counted in log-linear buckets: four buckets per power of two,
+ * so a bucket is at most 25% wide and percentiles are reported within that
+ * precision, from 1 ns up to about an hour. Recording is a few integer
+ * operations and never allocates.
+ *
+ */
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define HIST_SUB_BITS 2
+#define HIST_BUCKETS ((40 + 1) << HIST_SUB_BITS)
+
+struct histogram {
+	uint32_t bucket[HIST_BUCKETS];
+	uint32_t count;
+	uint64_t max;
+};
+
+/*!
+ * Current CLOCK_MONOTONIC time in [ns]
+ */
+static inline uint64_t monotonic_ns(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void hist_reset(struct histogram *h);
+void hist_record(struct histogram *h, uint64_t value);
+uint64_t hist_percentile(const struct histogram *h, double p);
+
+#endif /* STATS_H */
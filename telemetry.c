@@ -0,0 +1,475 @@
+/* \file telemetry.c
+
+ *
+ * \brief
+ *         Binary telemetry record encoder and decoder
+ *
+ * See telemetry.h for the record layout. The decoder does not depend on
+ * libkhepera so a server can build it as is.
+ *
+ */
+#include "protocol.h"
+#include "telemetry.h"
+
+/* packed size of each sensor group */
+static const size_t groupLen[GROUP_COUNT] = {
+	[GROUP_PROXIMITY] = 24,
+	[GROUP_AMBIENT] = 24,
+	[GROUP_US] = 10,
+	[GROUP_MOTORS] = 16,
+	[GROUP_BATTERY] = 12,
+	[GROUP_POSE] = 36,
+};
+
+/*--------------------------------------------------------------------*/
+/*!
+ * Pack the fields of the groups in mask, in group order
+ *
+ * \return pointer past the last byte written
+ */
+static unsigned char *packGroups(const struct telemetry *t, unsigned mask,
+		unsigned char *p) {
+	int i;
+
+	if (mask & GROUP_BIT(GROUP_PROXIMITY))
+		for (i = 0; i < 12; i++, p += 2)
+			put_be16(p, t->proximity[i]);
+	if (mask & GROUP_BIT(GROUP_AMBIENT))
+		for (i = 0; i < 12; i++, p += 2)
+			put_be16(p, t->ambient[i]);
+	if (mask & GROUP_BIT(GROUP_US))
+		for (i = 0; i < 5; i++, p += 2)
+			put_be16(p, (uint16_t) t->us[i]);
+	if (mask & GROUP_BIT(GROUP_MOTORS)) {
+		for (i = 0; i < 2; i++, p += 4)
+			put_be32(p, (uint32_t) t->speed[i]);
+		for (i = 0; i < 2; i++, p += 4)
+			put_be32(p, (uint32_t) t->position[i]);
+	}
+	if (mask & GROUP_BIT(GROUP_BATTERY)) {
+		*p++ = t->battery_status;
+		*p++ = t->battery_percent;
+		put_be16(p, t->battery_capacity);
+		put_be16(p + 2, (uint16_t) t->battery_current);
+		put_be16(p + 4, (uint16_t) t->battery_avg_current);
+		put_be16(p + 6, (uint16_t) t->battery_temperature);
+		put_be16(p + 8, t->battery_voltage);
+		p += 10;
+	}
+	if (mask & GROUP_BIT(GROUP_POSE)) {
+		for (i = 0; i < 3; i++, p += 4)
+			put_be32(p, (uint32_t) t->pose[i]);
+		for (i = 0; i < 6; i++, p += 4)
+			put_be32(p, (uint32_t) t->pose_cov[i]);
+	}
+	return p;
+}
+
+/*!
+ * Unpack the fields of the groups in mask, in group order
+ *
+ * \return pointer past the last byte read
+ */
+static const unsigned char *unpackGroups(const unsigned char *p,
+		unsigned mask, struct telemetry *t) {
+	int i;
+
+	if (mask & GROUP_BIT(GROUP_PROXIMITY))
+		for (i = 0; i < 12; i++, p += 2)
+			t->proximity[i] = get_be16(p);
+	if (mask & GROUP_BIT(GROUP_AMBIENT))
+		for (i = 0; i < 12; i++, p += 2)
+			t->ambient[i] = get_be16(p);
+	if (mask & GROUP_BIT(GROUP_US))
+		for (i = 0; i < 5; i++, p += 2)
+			t->us[i] = (int16_t) get_be16(p);
+	if (mask & GROUP_BIT(GROUP_MOTORS)) {
+		for (i = 0; i < 2; i++, p += 4)
+			t->speed[i] = (int32_t) get_be32(p);
+		for (i = 0; i < 2; i++, p += 4)
+			t->position[i] = (int32_t) get_be32(p);
+	}
+	if (mask & GROUP_BIT(GROUP_BATTERY)) {
+		t->battery_status = *p++;
+		t->battery_percent = *p++;
+		t->battery_capacity = get_be16(p);
+		t->battery_current = (int16_t) get_be16(p + 2);
+		t->battery_avg_current = (int16_t) get_be16(p + 4);
+		t->battery_temperature = (int16_t) get_be16(p + 6);
+		t->battery_voltage = get_be16(p + 8);
+		p += 10;
+	}
+	if (mask & GROUP_BIT(GROUP_POSE)) {
+		for (i = 0; i < 3; i++, p += 4)
+			t->pose[i] = (int32_t) get_be32(p);
+		for (i = 0; i < 6; i++, p += 4)
+			t->pose_cov[i] = (int32_t) get_be32(p);
+	}
+	return p;
+}
+
+/*!
+ * Size of the group fields selected by mask
+ */
+static size_t groupsLen(unsigned mask) {
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < GROUP_COUNT; i++)
+		if (mask & GROUP_BIT(i))
+			len += groupLen[i];
+	return len;
+}
+
+/*!
+ * Copy the fields of the groups in mask from src to dst
+ */
+void telemetry_copy_groups(struct telemetry *dst, const struct telemetry *src,
+		unsigned mask) {
+	int i;
+
+	if (mask & GROUP_BIT(GROUP_PROXIMITY))
+		for (i = 0; i < 12; i++)
+			dst->proximity[i] = src->proximity[i];
+	if (mask & GROUP_BIT(GROUP_AMBIENT))
+		for (i = 0; i < 12; i++)
+			dst->ambient[i] = src->ambient[i];
+	if (mask & GROUP_BIT(GROUP_US))
+		for (i = 0; i < 5; i++)
+			dst->us[i] = src->us[i];
+	if (mask & GROUP_BIT(GROUP_MOTORS)) {
+		dst->speed[0] = src->speed[0];
+		dst->speed[1] = src->speed[1];
+		dst->position[0] = src->position[0];
+		dst->position[1] = src->position[1];
+	}
+	if (mask & GROUP_BIT(GROUP_BATTERY)) {
+		dst->battery_status = src->battery_status;
+		dst->battery_capacity = src->battery_capacity;
+		dst->battery_percent = src->battery_percent;
+		dst->battery_current = src->battery_current;
+		dst->battery_avg_current = src->battery_avg_current;
+		dst->battery_temperature = src->battery_temperature;
+		dst->battery_voltage = src->battery_voltage;
+		dst->battery_charger = src->battery_charger;
+	}
+	if (mask & GROUP_BIT(GROUP_POSE)) {
+		for (i = 0; i < 3; i++)
+			dst->pose[i] = src->pose[i];
+		for (i = 0; i < 6; i++)
+			dst->pose_cov[i] = src->pose_cov[i];
+	}
+}
+
+/*!
+ * Pack a snapshot into a binary record
+ *
+ * \param t snapshot
+ * \param out destination, at least TELEMETRY_RECORD_LEN bytes
+ *
+ * \return number of bytes written
+ */
+size_t telemetry_pack(const struct telemetry *t, unsigned char *out) {
+	unsigned char *p = out;
+
+	*p++ = TELEMETRY_SCHEMA;
+	*p++ = t->battery_charger ? 1 : 0;
+	put_be64(p, t->timestamp_us);
+	p = packGroups(t, GROUP_ALL, p + 8);
+
+	return p - out;
+}
+
+/*!
+ * Unpack a binary record
+ *
+ * \param in record
+ * \param len number of bytes available at in
+ * \param t decoded snapshot
+ *
+ * \return 0 on success, -1 if the record is too short or of an unknown schema
+ */
+int telemetry_unpack(const unsigned char *in, size_t len, struct telemetry *t) {
+	if (len < TELEMETRY_RECORD_LEN || in[0] != TELEMETRY_SCHEMA)
+		return -1;
+
+	t->battery_charger = in[1] & 1;
+	t->timestamp_us = get_be64(in + 2);
+	unpackGroups(in + 10, GROUP_ALL, t);
+
+	return 0;
+}
+
+/*!
+ * Pack the selected sensor groups of a snapshot into a sample
+ *
+ * \param t snapshot
+ * \param mask GROUP_BIT() of the groups to send
+ * \param out destination, at least TELEMETRY_SAMPLE_MAX bytes
+ *
+ * \return number of bytes written
+ */
+size_t telemetry_pack_sample(const struct telemetry *t, unsigned mask,
+		unsigned char *out) {
+	unsigned char *p = out;
+
+	mask &= GROUP_ALL;
+	*p++ = TELEMETRY_SCHEMA;
+	*p++ = t->battery_charger ? 1 : 0;
+	*p++ = mask;
+	put_be64(p, t->timestamp_us);
+	p = packGroups(t, mask, p + 8);
+
+	return p - out;
+}
+
+/*!
+ * Unpack a sample, only the groups present in it are written to t
+ *
+ * \param in sample
+ * \param len number of bytes available at in
+ * \param t decoded snapshot
+ *
+ * \return the group mask of the sample, -1 if the sample is malformed
+ */
+int telemetry_unpack_sample(const unsigned char *in, size_t len,
+		struct telemetry *t) {
+	unsigned mask;
+
+	if (len < TELEMETRY_SAMPLE_HEADER_LEN || in[0] != TELEMETRY_SCHEMA)
+		return -1;
+	mask = in[2] & GROUP_ALL;
+	if (len < TELEMETRY_SAMPLE_HEADER_LEN + groupsLen(mask))
+		return -1;
+
+	if (mask & GROUP_BIT(GROUP_BATTERY))
+		t->battery_charger = in[1] & 1;
+	t->timestamp_us = get_be64(in + 3);
+	unpackGroups(in + TELEMETRY_SAMPLE_HEADER_LEN, mask, t);
+
+	return mask;
+}
+
+/*--------------------------------------------------------------------*/
+/*!
+ * Flatten the fields of the groups in mask into one integer vector, in
+ * packing order
+ *
+ * \return number of fields
+ */
+static int flatten(const struct telemetry *t, unsigned mask, int64_t *v) {
+	int i, n = 0;
+
+	if (mask & GROUP_BIT(GROUP_PROXIMITY))
+		for (i = 0; i < 12; i++)
+			v[n++] = t->proximity[i];
+	if (mask & GROUP_BIT(GROUP_AMBIENT))
+		for (i = 0; i < 12; i++)
+			v[n++] = t->ambient[i];
+	if (mask & GROUP_BIT(GROUP_US))
+		for (i = 0; i < 5; i++)
+			v[n++] = t->us[i];
+	if (mask & GROUP_BIT(GROUP_MOTORS)) {
+		v[n++] = t->speed[0];
+		v[n++] = t->speed[1];
+		v[n++] = t->position[0];
+		v[n++] = t->position[1];
+	}
+	if (mask & GROUP_BIT(GROUP_BATTERY)) {
+		v[n++] = t->battery_status;
+		v[n++] = t->battery_percent;
+		v[n++] = t->battery_capacity;
+		v[n++] = t->battery_current;
+		v[n++] = t->battery_avg_current;
+		v[n++] = t->battery_temperature;
+		v[n++] = t->battery_voltage;
+	}
+	if (mask & GROUP_BIT(GROUP_POSE)) {
+		for (i = 0; i < 3; i++)
+			v[n++] = t->pose[i];
+		for (i = 0; i < 6; i++)
+			v[n++] = t->pose_cov[i];
+	}
+	return n;
+}
+
+/*!
+ * Inverse of flatten()
+ */
+static void unflatten(const int64_t *v, unsigned mask, struct telemetry *t) {
+	int i, n = 0;
+
+	if (mask & GROUP_BIT(GROUP_PROXIMITY))
+		for (i = 0; i < 12; i++)
+			t->proximity[i] = v[n++];
+	if (mask & GROUP_BIT(GROUP_AMBIENT))
+		for (i = 0; i < 12; i++)
+			t->ambient[i] = v[n++];
+	if (mask & GROUP_BIT(GROUP_US))
+		for (i = 0; i < 5; i++)
+			t->us[i] = v[n++];
+	if (mask & GROUP_BIT(GROUP_MOTORS)) {
+		t->speed[0] = v[n++];
+		t->speed[1] = v[n++];
+		t->position[0] = v[n++];
+		t->position[1] = v[n++];
+	}
+	if (mask & GROUP_BIT(GROUP_BATTERY)) {
+		t->battery_status = v[n++];
+		t->battery_percent = v[n++];
+		t->battery_capacity = v[n++];
+		t->battery_current = v[n++];
+		t->battery_avg_current = v[n++];
+		t->battery_temperature = v[n++];
+		t->battery_voltage = v[n++];
+	}
+	if (mask & GROUP_BIT(GROUP_POSE)) {
+		for (i = 0; i < 3; i++)
+			t->pose[i] = v[n++];
+		for (i = 0; i < 6; i++)
+			t->pose_cov[i] = v[n++];
+	}
+}
+
+static unsigned char *putVarint(unsigned char *p, uint64_t v) {
+	while (v >= 0x80) {
+		*p++ = (v & 0x7F) | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+/*!
+ * Read a varint
+ *
+ * \return pointer past the varint, NULL if it runs past end
+ */
+static const unsigned char *getVarint(const unsigned char *p,
+		const unsigned char *end, uint64_t *v) {
+	int shift = 0;
+
+	*v = 0;
+	while (p < end && shift < 64) {
+		*v |= (uint64_t) (*p & 0x7F) << shift;
+		if (!(*p++ & 0x80))
+			return p;
+		shift += 7;
+	}
+	return NULL;
+}
+
+static inline uint64_t zigzag(int64_t v) {
+	return ((uint64_t) v << 1) ^ (uint64_t) (v >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t v) {
+	return (int64_t) (v >> 1) ^ -(int64_t) (v & 1);
+}
+
+/*!
+ * Reset a codec, the next frame it encodes or accepts is a keyframe
+ */
+void telemetry_codec_init(struct telemetry_codec *c) {
+	c->valid = 0;
+	c->mask = 0;
+}
+
+/*!
+ * Encode a snapshot against the previous one
+ *
+ * \param c codec holding the previous frame
+ * \param t snapshot
+ * \param mask GROUP_BIT() of the groups to send
+ * \param key 1 to force a keyframe
+ * \param out destination, at least TELEMETRY_DELTA_MAX bytes
+ * \param len number of bytes written
+ *
+ * \return 1 if a keyframe (a plain sample) was written, 0 for a delta
+ */
+int telemetry_encode(struct telemetry_codec *c, const struct telemetry *t,
+		unsigned mask, int key, unsigned char *out, size_t *len) {
+	int64_t cur[TELEMETRY_FIELDS_MAX], prev[TELEMETRY_FIELDS_MAX];
+	unsigned char *p = out;
+	int i, n;
+
+	mask &= GROUP_ALL;
+	if (key || !c->valid || c->mask != mask) {
+		*len = telemetry_pack_sample(t, mask, out);
+		c->prev = *t;
+		c->mask = mask;
+		c->valid = 1;
+		return 1;
+	}
+
+	n = flatten(t, mask, cur);
+	flatten(&c->prev, mask, prev);
+
+	*p++ = t->battery_charger ? 1 : 0;
+	*p++ = mask;
+	p = putVarint(p, t->timestamp_us - c->prev.timestamp_us);
+	for (i = 0; i < n; i++)
+		p = putVarint(p, zigzag(cur[i] - prev[i]));
+
+	c->prev = *t;
+	*len = p - out;
+	return 0;
+}
+
+/*!
+ * Decode a keyframe or a delta frame
+ *
+ * \param c codec holding the previous frame
+ * \param delta 1 for an OP_EVT_TELEMETRY_DELTA payload, 0 for a keyframe
+ * \param in payload
+ * \param len payload length
+ * \param t decoded snapshot, only the groups of the mask are meaningful
+ *
+ * \return the group mask, -1 if the frame is malformed or a delta arrives
+ *         before any keyframe, in which case the codec is left unchanged
+ */
+int telemetry_decode(struct telemetry_codec *c, int delta,
+		const unsigned char *in, size_t len, struct telemetry *t) {
+	int64_t v[TELEMETRY_FIELDS_MAX];
+	const unsigned char *p = in, *end = in + len;
+	struct telemetry next;
+	uint64_t u;
+	int i, n, mask;
+
+	// decode into a copy, the codec only moves on once the whole frame
+	// is read
+	next = c->prev;
+	if (!delta) {
+		mask = telemetry_unpack_sample(in, len, &next);
+		if (mask < 0)
+			return -1;
+		c->prev = next;
+		c->mask = mask;
+		c->valid = 1;
+		*t = next;
+		return mask;
+	}
+
+	if (!c->valid || len < 2 || in[1] != c->mask)
+		return -1;
+	mask = c->mask;
+	if (mask & GROUP_BIT(GROUP_BATTERY))
+		next.battery_charger = p[0] & 1;
+	p += 2;
+
+	if ((p = getVarint(p, end, &u)) == NULL)
+		return -1;
+	next.timestamp_us += u;
+
+	n = flatten(&next, mask, v);
+	for (i = 0; i < n; i++) {
+		if ((p = getVarint(p, end, &u)) == NULL)
+			return -1;
+		v[i] += unzigzag(u);
+	}
+	unflatten(v, mask, &next);
+
+	c->prev = next;
+	*t = next;
+	return mask;
+}
@@ -0,0 +1,153 @@
+/* \file telemetry.h
+
+ *
+ * \brief
+ *         Sensor snapshot sent to the server by the alldata command
+ *
+ * The snapshot is sent either as the historical text report or, once the
+ * server selected it with OP_FORMAT, as a packed binary record of
+ * TELEMETRY_RECORD_LEN bytes. All fields of the record are in network byte
+ * order (big endian), signed values in two's complement:
+ *
+ *   offset  size  field
+ *        0     1  schema       TELEMETRY_SCHEMA
+ *        1     1  flags        bit 0: charger plugged
+ *        2     8  timestamp    u64 [us], CLOCK_MONOTONIC of the robot
+ *       10    24  proximity    12 x u16, back left .. ground right
+ *       34    24  ambient      12 x u16, same order
+ *       58    10  us           5 x i16, left 90 .. right 90
+ *       68     8  speed        2 x i32, left, right
+ *       76     8  position     2 x i32, left, right
+ *       84     1  bat. status  DS2781 status register
+ *       85     1  bat. percent remaining capacity [%]
+ *       86     2  capacity     u16 [1.6 mAh]
+ *       88     2  current      i16 [0.07813 mA]
+ *       90     2  avg current  i16 [0.07813 mA]
+ *       92     2  temperature  i16 [0.003906 C]
+ *       94     2  voltage      u16 [9.76 mV]
+ *       96    12  pose         3 x i32, x, y [0.1 mm], theta [0.1 mrad]
+ *      108    24  pose cov.    6 x i32, xx, xy, xtheta, yy, ytheta,
+ *                              thetatheta in the products of the pose units
+ *
+ * Fields are only ever appended; a new layout bumps TELEMETRY_SCHEMA.
+ *
+ * Subscribed telemetry (OP_SUBSCRIBE) is pushed as samples that only carry
+ * the selected sensor groups. A sample is a TELEMETRY_SAMPLE_HEADER_LEN byte
+ * header (schema, flags, uint8 GROUP_BIT() mask, u64 timestamp) followed by
+ * the fields of each selected group, in group order and with the same
+ * encoding as in the full record (bytes 10..131 hold all groups in order).
+ *
+ * A subscription may ask for delta encoding. Keyframes are then plain
+ * samples, and the frames in between (OP_EVT_TELEMETRY_DELTA) only carry
+ * the change from the previous frame:
+ *
+ *   uint8   flags     bit 0: charger plugged
+ *   uint8   mask      same as the last keyframe
+ *   varint  timestamp increase [us]
+ *   varint  zigzag delta of each field of the selected groups, in sample
+ *           order (battery: status, percent, capacity, current, average
+ *           current, temperature, voltage; pose: x, y, theta, then the
+ *           covariance)
+ *
+ * Varints are little endian base 128 (7 bits per byte, high bit set on all
+ * but the last byte); zigzag maps 0, -1, 1, -2... to 0, 1, 2, 3...
+ * telemetry_decode() implements the receiving side.
+ *
+ */
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define TELEMETRY_SCHEMA 2
+#define TELEMETRY_RECORD_LEN 132
+#define TELEMETRY_SAMPLE_HEADER_LEN 11
+#define TELEMETRY_SAMPLE_MAX (TELEMETRY_SAMPLE_HEADER_LEN + 122)
+#define TELEMETRY_FIELDS_MAX 49 // integer fields of all groups
+#define TELEMETRY_DELTA_MAX (2 + 10 * (1 + TELEMETRY_FIELDS_MAX))
+
+/* encoding of subscribed telemetry */
+enum {
+	ENCODING_PLAIN = 0, // every frame is a full sample
+	ENCODING_DELTA = 1  // keyframes and deltas
+};
+
+/* sensor groups, in record order */
+enum {
+	GROUP_PROXIMITY,
+	GROUP_AMBIENT,
+	GROUP_US,
+	GROUP_MOTORS,
+	GROUP_BATTERY,
+	GROUP_POSE,     // odometry, no bus read
+	GROUP_COUNT
+};
+
+#define GROUP_BIT(g) (1u << (g))
+#define GROUP_ALL (GROUP_BIT(GROUP_COUNT) - 1)
+
+/* alldata reply formats, selected with OP_FORMAT */
+enum {
+	TELEMETRY_TEXT = 0,  // human readable report (default)
+	TELEMETRY_BINARY = 1 // packed record described above
+};
+
+/*!
+ * One reading of every sensor group, in raw libkhepera units
+ */
+struct telemetry {
+	uint64_t timestamp_us;           // CLOCK_MONOTONIC time of the reading
+	unsigned short proximity[12];    // IR proximity, 0..1023
+	unsigned short ambient[12];      // IR ambient, 0..1023
+	short us[5];                     // ultrasound distance [cm] or ROBOT_US_* code
+	int speed[2];                    // left, right motor speed [pulse/10ms]
+	int position[2];                 // left, right encoder [pulse]
+	unsigned char battery_status;    // DS2781 status register
+	unsigned short battery_capacity; // remaining capacity [1.6 mAh]
+	unsigned char battery_percent;   // remaining capacity [%]
+	short battery_current;           // current [0.07813 mA]
+	short battery_avg_current;       // average current [0.07813 mA]
+	short battery_temperature;       // temperature [0.003906 C]
+	unsigned short battery_voltage;  // voltage [9.76 mV]
+	unsigned char battery_charger;   // 1 if the charger is plugged
+	int pose[3];                     // x, y [0.1 mm], theta [0.1 mrad]
+	int pose_cov[6];                 // xx, xy, xtheta, yy, ytheta, thetatheta
+};
+
+/*!
+ * Current time of the telemetry clock (CLOCK_MONOTONIC) in [us]
+ */
+static inline uint64_t monotonic_us(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void telemetry_copy_groups(struct telemetry *dst, const struct telemetry *src,
+		unsigned mask);
+size_t telemetry_pack(const struct telemetry *t, unsigned char *out);
+int telemetry_unpack(const unsigned char *in, size_t len, struct telemetry *t);
+size_t telemetry_pack_sample(const struct telemetry *t, unsigned mask,
+		unsigned char *out);
+int telemetry_unpack_sample(const unsigned char *in, size_t len,
+		struct telemetry *t);
+
+/*!
+ * Delta coding state of one telemetry stream, one on each side
+ */
+struct telemetry_codec {
+	struct telemetry prev; // last frame encoded or decoded
+	unsigned mask;         // groups of the last keyframe
+	int valid;             // 0 until the first keyframe
+};
+
+void telemetry_codec_init(struct telemetry_codec *c);
+int telemetry_encode(struct telemetry_codec *c, const struct telemetry *t,
+		unsigned mask, int key, unsigned char *out, size_t *len);
+int telemetry_decode(struct telemetry_codec *c, int delta,
+		const unsigned char *in, size_t len, struct telemetry *t);
+
+#endif /* TELEMETRY_H */
@@ -0,0 +1,340 @@
+/* \file trajectory.c
+
+ *
+ * \brief
+ *         Onboard trajectory executor, see trajectory.h
+ *
+ */
+#include <math.h>
+#include <stdlib.h>
+
+#include "protocol.h"
+#include "robot.h"
+#include "trajectory.h"
+
+#define PULSES_PER_MM (1.0 / ROBOT_PULSE_TO_MM)
+#define PULSES_PER_SPEED (ROBOT_SPEED_TO_MM_S / ROBOT_PULSE_TO_MM) // [pulses/s]
+#define DECIDEGREE (M_PI / 1800)
+
+/* planned pose while compiling [mm, rad] */
+struct pose {
+	double x, y, theta;
+};
+
+/*--------------------------------------------------------------------*/
+/*!
+ * Wheel travel along an arc, moving the planned pose to its end
+ *
+ * \param s travel of the middle of the robot [mm], negative backwards
+ * \param dtheta heading change [rad], positive to the left
+ */
+static void arc(struct pose *q, double s, double dtheta, double *left,
+		double *right) {
+	double rho;
+
+	*left = s - dtheta * ROBOT_WHEEL_BASE_MM / 2;
+	*right = s + dtheta * ROBOT_WHEEL_BASE_MM / 2;
+	if (dtheta == 0) {
+		q->x += s * cos(q->theta);
+		q->y += s * sin(q->theta);
+	} else {
+		rho = s / dtheta;
+		q->x += rho * (sin(q->theta + dtheta) - sin(q->theta));
+		q->y -= rho * (cos(q->theta + dtheta) - cos(q->theta));
+	}
+	q->theta = remainder(q->theta + dtheta, 2 * M_PI);
+}
+
+/*!
+ * Append a move, unless it is shorter than a pulse
+ *
+ * \param speed speed limit of the faster wheel
+ */
+static void addMove(struct traj_program *p, int segment, int position,
+		double left, double right, int speed) {
+	struct traj_move *m;
+	double longest = fmax(fabs(left), fabs(right));
+
+	if (longest * PULSES_PER_MM < 1)
+		return;
+	m = &p->moves[p->count++];
+	m->position = position;
+	m->segment = segment;
+	m->delta[0] = lround(left * PULSES_PER_MM);
+	m->delta[1] = lround(right * PULSES_PER_MM);
+	if (position) {
+		m->speed[0] = m->speed[1] = speed;
+	} else {
+		m->speed[0] = lround(speed * left / longest);
+		m->speed[1] = lround(speed * right / longest);
+	}
+}
+
+/*!
+ * Compile the segments of an OP_TRAJECTORY payload into wheel moves
+ *
+ * \param data segments, TRAJ_SEGMENT_LEN bytes each
+ * \param len length of data, a multiple of TRAJ_SEGMENT_LEN
+ * \param max_speed maximum speed of the motors, higher segment speed
+ *        limits are lowered to it
+ *
+ * \return 0 on success, otherwise 1 + the index of the first bad segment
+ */
+int traj_compile(struct traj_program *p, const unsigned char *data,
+		size_t len, int max_speed) {
+	struct pose q = { 0, 0, 0 };
+	const unsigned char *d;
+	double left, right, dx, dy, dist, dtheta;
+	int i, n = len / TRAJ_SEGMENT_LEN, speed, a, b;
+
+	p->count = 0;
+	p->segments = 0;
+	if (n > TRAJ_MAX_SEGMENTS)
+		return TRAJ_MAX_SEGMENTS + 1;
+	for (i = 0; i < n; i++) {
+		d = data + i * TRAJ_SEGMENT_LEN;
+		speed = get_be16(d + 2);
+		a = (int16_t) get_be16(d + 4);
+		b = (int16_t) get_be16(d + 6);
+		if (speed == 0 || speed > TRAJ_MAX_SPEED)
+			return i + 1;
+		if (speed > max_speed)
+			speed = max_speed;
+
+		switch (d[0]) {
+		case TRAJ_LINE:
+			arc(&q, a, 0, &left, &right);
+			addMove(p, i, 1, left, right, speed);
+			break;
+		case TRAJ_TURN:
+			arc(&q, 0, a * DECIDEGREE, &left, &right);
+			addMove(p, i, 1, left, right, speed);
+			break;
+		case TRAJ_ARC:
+			dtheta = b * DECIDEGREE;
+			arc(&q, a * fabs(dtheta), dtheta, &left, &right);
+			addMove(p, i, 0, left, right, speed);
+			break;
+		case TRAJ_WAYPOINT:
+			dx = a - q.x;
+			dy = b - q.y;
+			dist = hypot(dx, dy);
+			if (dist < 1)
+				break;
+			arc(&q, 0, remainder(atan2(dy, dx) - q.theta, 2 * M_PI), &left,
+					&right);
+			addMove(p, i, 1, left, right, speed);
+			arc(&q, dist, 0, &left, &right);
+			addMove(p, i, 1, left, right, speed);
+			break;
+		default:
+			return i + 1;
+		}
+	}
+	p->segments = n;
+	return 0;
+}
+
+/*!
+ * \return the position mode speed limit of a move, within the bound
+ */
+static inline int moveSpeed(const struct traj_exec *x,
+		const struct traj_move *m) {
+	return x->limit > 0 && x->limit < m->speed[0] ? x->limit : m->speed[0];
+}
+
+/*!
+ * Send the motors towards the end of the current move
+ */
+static void beginMove(struct traj_exec *x, uint64_t now_us) {
+	const struct traj_move *m = &x->prog->moves[x->move];
+	int i, pos[2];
+
+	x->ops->get_position(&pos[0], &pos[1]);
+	for (i = 0; i < 2; i++) {
+		x->start[i] = x->last[i] = pos[i];
+		x->target[i] = pos[i] + m->delta[i];
+	}
+	x->moved_us = now_us;
+	if (m->position) {
+		x->ops->set_max_speed(moveSpeed(x, m));
+		x->ops->set_mode(ROBOT_POSITION);
+		x->ops->set_position(x->target[0], x->target[1]);
+	} else {
+		x->ops->set_mode(ROBOT_SPEED);
+		x->ops->set_speed(m->speed[0], m->speed[1]);
+	}
+}
+
+/*!
+ * Stop the motors and end the trajectory in the given state
+ */
+static void finish(struct traj_exec *x, int state) {
+	x->state = state;
+	x->ops->set_speed(0, 0);
+	x->ops->set_mode(ROBOT_IDLE);
+	x->ops->set_max_speed(0);
+}
+
+/*!
+ * \return the wheel that travels the most in a move
+ */
+static inline int longerWheel(const struct traj_move *m) {
+	return abs(m->delta[1]) > abs(m->delta[0]);
+}
+
+/*!
+ * \return 1 once the encoders have reached the end of the current move
+ */
+static int moveDone(const struct traj_exec *x, const struct traj_move *m,
+		const int pos[2]) {
+	int i = longerWheel(m);
+
+	if (m->position)
+		return abs(x->target[0] - pos[0]) <= x->margin
+				&& abs(x->target[1] - pos[1]) <= x->margin;
+	return m->delta[i] > 0 ? pos[i] >= x->target[i] : pos[i] <= x->target[i];
+}
+
+/*!
+ * Start running a compiled trajectory
+ *
+ * \param now_us current time [us]
+ */
+void traj_start(struct traj_exec *x, const struct traj_program *p,
+		const struct traj_ops *ops, uint64_t now_us) {
+	x->prog = p;
+	x->ops = ops;
+	x->move = 0;
+	x->limit = 0;
+	x->last_us = now_us;
+	if (p->count == 0) {
+		x->state = TRAJ_DONE;
+		return;
+	}
+	x->state = TRAJ_RUNNING;
+	beginMove(x, now_us);
+}
+
+/*!
+ * Follow the trajectory, on each tick of the caller's timer
+ *
+ * \param now_us current time [us]
+ *
+ * \return 1 when a new segment started or the trajectory ended, which is
+ *         worth reporting, 0 otherwise
+ */
+int traj_step(struct traj_exec *x, uint64_t now_us) {
+	const struct traj_move *m;
+	double dt, remaining, travel, scale;
+	int i, pos[2], segment;
+
+	if (x->state != TRAJ_RUNNING)
+		return 0;
+	m = &x->prog->moves[x->move];
+	segment = m->segment;
+	x->ops->get_position(&pos[0], &pos[1]);
+	dt = (now_us - x->last_us) * 1e-6;
+	x->last_us = now_us;
+	if (pos[0] != x->last[0] || pos[1] != x->last[1]) {
+		x->moved_us = now_us;
+		x->last[0] = pos[0];
+		x->last[1] = pos[1];
+	}
+
+	if (moveDone(x, m, pos)) {
+		if (++x->move == x->prog->count) {
+			finish(x, TRAJ_DONE);
+			return 1;
+		}
+		beginMove(x, now_us);
+		return x->prog->moves[x->move].segment != segment;
+	}
+	if (now_us - x->moved_us > TRAJ_STALL_US) {
+		finish(x, TRAJ_STALLED);
+		return 1;
+	}
+
+	if (!m->position) {
+		// slow down so that the next tick does not overshoot the end
+		i = longerWheel(m);
+		remaining = abs(x->target[i] - pos[i]);
+		travel = abs(m->speed[i]) * PULSES_PER_SPEED * dt;
+		if (travel > remaining) {
+			scale = fmax(remaining / travel,
+					(double) TRAJ_MIN_SPEED / abs(m->speed[i]));
+			x->ops->set_speed(lround(m->speed[0] * scale),
+					lround(m->speed[1] * scale));
+		}
+	}
+	return 0;
+}
+
+/*!
+ * Stop a running trajectory in the given state (TRAJ_ABORTED...) and stop
+ * the motors
+ */
+void traj_stop(struct traj_exec *x, int state) {
+	if (x->state == TRAJ_RUNNING)
+		finish(x, state);
+}
+
+/*!
+ * \return 1 if the current move goes forward, -1 backward, 0 if it turns in
+ *         place or nothing runs
+ */
+int traj_direction(const struct traj_exec *x) {
+	const struct traj_move *m;
+	int forward;
+
+	if (x->state != TRAJ_RUNNING)
+		return 0;
+	m = &x->prog->moves[x->move];
+	forward = m->delta[0] + m->delta[1];
+	return forward > 0 ? 1 : forward < 0 ? -1 : 0;
+}
+
+/*!
+ * Bound the speed of the position mode moves, from the current one on
+ *
+ * \param speed bound, 0 lifts it
+ */
+void traj_limit(struct traj_exec *x, int speed) {
+	const struct traj_move *m;
+
+	if (speed == x->limit)
+		return;
+	x->limit = speed;
+	if (x->state != TRAJ_RUNNING)
+		return;
+	m = &x->prog->moves[x->move];
+	if (!m->position)
+		return;
+	// the new limit applies to the next position target
+	x->ops->set_max_speed(moveSpeed(x, m));
+	x->ops->set_position(x->target[0], x->target[1]);
+}
+
+/*!
+ * \return the index of the segment being run, the segment count once done
+ */
+int traj_segment(const struct traj_exec *x) {
+	if (x->prog == NULL || x->move >= x->prog->count)
+		return x->prog != NULL ? x->prog->segments : 0;
+	return x->prog->moves[x->move].segment;
+}
+
+/*!
+ * \return the progress of the current move [%]
+ */
+int traj_progress(const struct traj_exec *x) {
+	const struct traj_move *m;
+	int i, done;
+
+	if (x->prog == NULL || x->move >= x->prog->count)
+		return x->state == TRAJ_DONE ? 100 : 0;
+	m = &x->prog->moves[x->move];
+	i = longerWheel(m);
+	done = (int) (100LL * (x->last[i] - x->start[i]) / m->delta[i]);
+	return done < 0 ? 0 : done > 100 ? 100 : done;
+}
@@ -0,0 +1,105 @@
+/* \file trajectory.h
+
+ *
+ * \brief
+ *         Onboard trajectory executor
+ *
+ * A trajectory is a list of segments, each with its own speed limit:
+ *
+ *   TRAJ_LINE      a = distance [mm], negative backwards
+ *   TRAJ_TURN      a = heading change [0.1 deg] in place, positive to the left
+ *   TRAJ_ARC       a = radius [mm], negative backwards, b = heading change
+ *                  [0.1 deg], positive to the left
+ *   TRAJ_WAYPOINT  a, b = x, y [mm] in the frame of the trajectory start (x
+ *                  forward, y to the left), reached by a turn then a line
+ *
+ * traj_compile() turns the segments into wheel moves up front, tracking the
+ * planned pose for the waypoints. Lines and turns run in position mode with
+ * the speed limit as maximum speed of the profile; arcs, which need two
+ * different wheel speeds, run in speed mode until the outer wheel has gone
+ * its distance, slowing down for the last tick. traj_step() then follows
+ * the moves on each tick of the caller's timer, reading the encoders, and
+ * stops the trajectory when the wheels stop making progress. Position mode
+ * does not go through the speed bounds of the reflex: the caller lowers
+ * its speed limit with traj_limit() while an obstacle slows the way of
+ * traj_direction(), and stops the trajectory with traj_stop() when one
+ * blocks it. Hardware access goes through the traj_ops callbacks.
+ *
+ */
+#ifndef TRAJECTORY_H
+#define TRAJECTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TRAJ_MAX_SEGMENTS 256
+#define TRAJ_SEGMENT_LEN 8      // bytes per segment, see OP_TRAJECTORY
+#define TRAJ_MAX_SPEED 1200     // highest speed limit
+#define TRAJ_MIN_SPEED 20       // lowest speed when slowing down an arc
+#define TRAJ_STALL_US 2000000   // no encoder progress for that long stops
+
+/* segment types */
+enum {
+	TRAJ_LINE,
+	TRAJ_TURN,
+	TRAJ_ARC,
+	TRAJ_WAYPOINT
+};
+
+/* executor states */
+enum {
+	TRAJ_IDLE,
+	TRAJ_RUNNING,
+	TRAJ_DONE,
+	TRAJ_ABORTED,  // stopped by another command
+	TRAJ_BLOCKED,  // obstacle in the way
+	TRAJ_STALLED   // wheels not moving
+};
+
+struct traj_ops {
+	void (*set_mode)(int mode);              // ROBOT_* motor mode
+	void (*set_position)(int left, int right);
+	void (*set_speed)(int left, int right);
+	void (*set_max_speed)(int max);          // position mode limit, 0 default
+	void (*get_position)(int *left, int *right);
+};
+
+struct traj_move {
+	uint8_t position;  // 1 position mode, 0 speed mode
+	uint16_t segment;  // segment it belongs to
+	int32_t delta[2];  // wheel travel [pulses]
+	int speed[2];      // speed mode wheel speeds, position mode maximum
+};
+
+struct traj_program {
+	struct traj_move moves[2 * TRAJ_MAX_SEGMENTS];
+	int count;
+	int segments;
+};
+
+struct traj_exec {
+	const struct traj_program *prog;
+	const struct traj_ops *ops;
+	int margin;         // position control margin [pulses]
+	int limit;          // position mode speed bound, 0 none
+	int state;          // TRAJ_*
+	int move;           // current move
+	int32_t start[2];   // encoders at the start of the move
+	int32_t target[2];  // encoders at its end
+	int32_t last[2];    // encoders at the last tick
+	uint64_t last_us;   // time of the last tick
+	uint64_t moved_us;  // last encoder progress
+};
+
+int traj_compile(struct traj_program *p, const unsigned char *data,
+		size_t len, int max_speed);
+void traj_start(struct traj_exec *x, const struct traj_program *p,
+		const struct traj_ops *ops, uint64_t now_us);
+int traj_step(struct traj_exec *x, uint64_t now_us);
+void traj_stop(struct traj_exec *x, int state);
+int traj_direction(const struct traj_exec *x);
+void traj_limit(struct traj_exec *x, int speed);
+int traj_segment(const struct traj_exec *x);
+int traj_progress(const struct traj_exec *x);
+
+#endif /* TRAJECTORY_H */
@@ -0,0 +1,178 @@
+/* \file udpctl.c
+
+ *
+ * \brief
+ *         Datagram control channel, see udpctl.h
+ *
+ */
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "protocol.h"
+#include "udpctl.h"
+
+/*--------------------------------------------------------------------*/
+#define ROTL(x, b) (uint64_t) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND \
+	do { \
+		v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+		v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+		v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+		v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+	} while (0)
+
+static uint64_t getLe64(const unsigned char *p) {
+	uint64_t v = 0;
+	int i;
+
+	for (i = 7; i >= 0; i--)
+		v = v << 8 | p[i];
+	return v;
+}
+
+/*!
+ * SipHash-2-4 message authentication code
+ *
+ * \param key 128 bit key
+ * \param data message
+ * \param len message length
+ *
+ * \return 64 bit tag
+ */
+uint64_t siphash24(const unsigned char key[UDP_KEY_LEN], const void *data,
+		size_t len) {
+	const unsigned char *p = data, *end = p + (len & ~(size_t) 7);
+	uint64_t k0 = getLe64(key), k1 = getLe64(key + 8);
+	uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+	uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+	uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+	uint64_t v3 = 0x7465646279746573ULL ^ k1;
+	uint64_t m, b = (uint64_t) len << 56;
+	int i;
+
+	for (; p != end; p += 8) {
+		m = getLe64(p);
+		v3 ^= m;
+		SIPROUND;
+		SIPROUND;
+		v0 ^= m;
+	}
+	for (i = len & 7; i > 0; i--)
+		b |= (uint64_t) p[i - 1] << (8 * (i - 1));
+
+	v3 ^= b;
+	SIPROUND;
+	SIPROUND;
+	v0 ^= b;
+	v2 ^= 0xff;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	SIPROUND;
+	return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/*!
+ * Initialise a closed channel
+ */
+void udpctl_init(struct udp_channel *u) {
+	memset(u, 0, sizeof(*u));
+	u->fd = -1;
+}
+
+/*!
+ * Open the channel, replacing an open one
+ *
+ * \param u channel
+ * \param server address and port the datagrams come from; others are
+ *        filtered out by the kernel
+ * \param key channel key, given to the server over TCP
+ *
+ * \return local port to send to, -1 on error
+ */
+int udpctl_open(struct udp_channel *u, const struct sockaddr_in *server,
+		const unsigned char key[UDP_KEY_LEN]) {
+	struct sockaddr_in local;
+	socklen_t len = sizeof(local);
+
+	udpctl_close(u);
+	u->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (u->fd < 0)
+		return -1;
+	if (connect(u->fd, (const struct sockaddr *) server, sizeof(*server)) < 0
+			|| getsockname(u->fd, (struct sockaddr *) &local, &len) < 0) {
+		udpctl_close(u);
+		return -1;
+	}
+
+	memcpy(u->key, key, UDP_KEY_LEN);
+	u->have_seq = 0;
+	u->accepted = u->stale = u->rejected = 0;
+	return ntohs(local.sin_port);
+}
+
+/*!
+ * Read the waiting datagrams and keep the newest valid command
+ *
+ * \param u channel
+ * \param cmd newest command, its payload points into the channel buffer
+ *
+ * \return 1 if there is a command to execute, 0 otherwise
+ */
+int udpctl_receive(struct udp_channel *u, struct udp_command *cmd) {
+	unsigned char in[sizeof(u->buf)];
+	ssize_t n;
+	size_t body;
+	uint32_t seq;
+	int found = 0;
+
+	while (u->fd >= 0) {
+		n = recv(u->fd, in, sizeof(in), MSG_TRUNC);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			break; // EAGAIN, or an ICMP error of an earlier datagram
+		if (n < UDP_HEADER_LEN + UDP_TAG_LEN || (size_t) n > sizeof(in)
+				|| in[0] != FRAME_VERSION
+				|| (in[1] != OP_STOP && in[1] != OP_VELOCITY)) {
+			u->rejected++;
+			continue;
+		}
+		body = n - UDP_TAG_LEN;
+		if (siphash24(u->key, in, body) != get_be64(in + body)) {
+			u->rejected++;
+			continue;
+		}
+
+		seq = get_be32(in + 2);
+		if (u->have_seq && (int32_t) (seq - u->last_seq) <= 0) {
+			u->stale++;
+			continue;
+		}
+		if (found)
+			u->stale++; // superseded by this one
+		u->last_seq = seq;
+		u->have_seq = 1;
+		memcpy(u->buf, in, n);
+		cmd->opcode = u->buf[1];
+		cmd->seq = seq;
+		cmd->payload = u->buf + UDP_HEADER_LEN;
+		cmd->length = body - UDP_HEADER_LEN;
+		found = 1;
+	}
+	if (found)
+		u->accepted++;
+	return found;
+}
+
+/*!
+ * Close the channel
+ */
+void udpctl_close(struct udp_channel *u) {
+	if (u->fd >= 0)
+		close(u->fd);
+	u->fd = -1;
+}
@@ -0,0 +1,63 @@
+/* \file udpctl.h
+
+ *
+ * \brief
+ *         Datagram control channel for the time critical commands
+ *
+ * Steering commands sent on the TCP stream wait behind any lost segment
+ * and any bulk transfer. The server may send them as UDP datagrams
+ * instead, where a lost one is simply superseded by the next:
+ *
+ *   offset  size  field
+ *        0     1  version   FRAME_VERSION
+ *        1     1  opcode    OP_STOP or OP_VELOCITY
+ *        2     4  sequence  incremented for every datagram
+ *        6     n  payload   as for the same command on TCP
+ *      6+n     8  tag       SipHash-2-4 of the bytes before, keyed with the
+ *                           channel key given over TCP, big endian
+ *
+ * Only a datagram newer than every datagram accepted so far is executed,
+ * late or duplicated ones are dropped; of several datagrams waiting at
+ * once only the newest is executed. Datagrams with a wrong tag, from
+ * another address or with another opcode are dropped as well. Nothing is
+ * answered.
+ *
+ */
+#ifndef UDPCTL_H
+#define UDPCTL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define UDP_KEY_LEN 16
+#define UDP_HEADER_LEN 6
+#define UDP_TAG_LEN 8
+#define UDP_MAX_PAYLOAD 64
+
+struct udp_command {
+	uint8_t opcode;
+	uint32_t seq;
+	const unsigned char *payload;
+	size_t length;
+};
+
+struct udp_channel {
+	int fd;                 // -1 when closed
+	unsigned char key[UDP_KEY_LEN];
+	uint32_t last_seq;      // sequence of the newest accepted datagram
+	int have_seq;
+	unsigned char buf[UDP_HEADER_LEN + UDP_MAX_PAYLOAD + UDP_TAG_LEN];
+	uint32_t accepted, stale, rejected;
+};
+
+uint64_t siphash24(const unsigned char key[UDP_KEY_LEN], const void *data,
+		size_t len);
+
+void udpctl_init(struct udp_channel *u);
+int udpctl_open(struct udp_channel *u, const struct sockaddr_in *server,
+		const unsigned char key[UDP_KEY_LEN]);
+int udpctl_receive(struct udp_channel *u, struct udp_command *cmd);
+void udpctl_close(struct udp_channel *u);
+
+#endif /* UDPCTL_H */
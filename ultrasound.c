@@ -0,0 +1,193 @@
+/* \file ultrasound.c
+
+ *
+ * \brief
+ *         Ultrasound scheduler, see ultrasound.h
+ *
+ */
+#include <time.h>
+
+#include "telemetry.h"
+#include "ultrasound.h"
+
+/*--------------------------------------------------------------------*/
+/*!
+ * Sleep until an absolute CLOCK_MONOTONIC time [us]
+ */
+static void sleepUntil(uint64_t when_us) {
+	struct timespec ts;
+
+	ts.tv_sec = when_us / 1000000;
+	ts.tv_nsec = when_us % 1000000 * 1000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+		;
+}
+
+/*!
+ * Activate the given transducers, unless they already are
+ */
+static void activate(struct us_scheduler *s, int mask) {
+	if (s->active == mask)
+		return;
+	s->activate(mask);
+	s->active = mask;
+}
+
+/*!
+ * Range with one transducer for a slot and keep its result
+ */
+static void range(struct us_scheduler *s, int i, unsigned period_ms) {
+	short value[ROBOT_US_COUNT];
+	uint64_t start = monotonic_us(), end;
+	int ok;
+
+	activate(s, 1 << i);
+	sleepUntil(start + US_SLOT_US);
+	ok = s->measure(value) == 0;
+	end = monotonic_us();
+
+	pthread_mutex_lock(&s->lock);
+	hist_record(&s->lateness, (start - s->due_us[i]) * 1000);
+	// a transducer disabled meanwhile keeps reading ROBOT_US_DISABLED
+	if (ok && s->config.mask & 1 << i) {
+		s->value[i] = value[i];
+		s->stamp_us[i] = end;
+		s->count[i]++;
+	} else if (!ok) {
+		s->errors++;
+	}
+	pthread_mutex_unlock(&s->lock);
+
+	// keep the cadence, but do not try to catch up after a stall
+	s->due_us[i] += period_ms * 1000ULL;
+	if (s->due_us[i] < end)
+		s->due_us[i] = end;
+}
+
+static void *usThread(void *arg) {
+	struct us_scheduler *s = arg;
+	struct us_config c;
+	uint64_t now;
+	int i, next, joined;
+
+	while (__atomic_load_n(&s->running, __ATOMIC_RELAXED)) {
+		pthread_mutex_lock(&s->lock);
+		c = s->config;
+		pthread_mutex_unlock(&s->lock);
+
+		now = monotonic_us();
+		next = -1;
+		joined = 0;
+		for (i = 0; i < ROBOT_US_COUNT; i++) {
+			if (!(c.mask & 1 << i))
+				continue;
+			// newly enabled: due at once, one slot after the other so
+			// that equal periods do not keep asking for the same slot
+			if (!(s->enabled & 1 << i))
+				s->due_us[i] = now + joined++ * US_SLOT_US;
+			if (next < 0 || s->due_us[i] < s->due_us[next])
+				next = i;
+		}
+		s->enabled = c.mask;
+
+		if (next >= 0 && s->due_us[next] <= now) {
+			range(s, next, c.period_ms[next]);
+		} else if (next >= 0 && s->due_us[next] < now + US_SLOT_US) {
+			sleepUntil(s->due_us[next]);
+		} else {
+			// nothing due for a while: stop ranging, look again after a
+			// slot so that a new config applies soon
+			activate(s, 0);
+			sleepUntil(now + US_SLOT_US);
+		}
+	}
+	activate(s, 0);
+	return NULL;
+}
+
+/*!
+ * Start the scheduler thread
+ *
+ * The config, activate and measure fields must be set and the lock
+ * initialised before the call. Every transducer reads ROBOT_US_DISABLED
+ * until its first measurement.
+ *
+ * \return 0 on success, -1 on error
+ */
+int us_start(struct us_scheduler *s) {
+	int i;
+
+	pthread_mutex_lock(&s->lock);
+	for (i = 0; i < ROBOT_US_COUNT; i++) {
+		s->value[i] = ROBOT_US_DISABLED;
+		s->stamp_us[i] = 0;
+		s->count[i] = 0;
+	}
+	s->errors = 0;
+	hist_reset(&s->lateness);
+	pthread_mutex_unlock(&s->lock);
+	s->enabled = 0;
+	// unknown state, have activate() write the first mask
+	s->active = -1;
+
+	s->running = 1;
+	if (pthread_create(&s->thread, NULL, usThread, s) != 0) {
+		s->running = 0;
+		return -1;
+	}
+	return 0;
+}
+
+/*!
+ * Stop the scheduler thread and wait for it; the transducers are left
+ * deactivated
+ */
+void us_stop(struct us_scheduler *s) {
+	if (!s->running)
+		return;
+	__atomic_store_n(&s->running, 0, __ATOMIC_RELAXED);
+	pthread_join(s->thread, NULL);
+}
+
+/*!
+ * Get the last completed measurement of every transducer
+ *
+ * \param value distance [cm] or ROBOT_US_* code
+ * \param age_us time since each measurement [us], US_NEVER if none; may be
+ *        NULL
+ */
+void us_get(struct us_scheduler *s, short value[ROBOT_US_COUNT],
+		uint32_t age_us[ROBOT_US_COUNT]) {
+	uint64_t now = age_us != NULL ? monotonic_us() : 0, age;
+	int i;
+
+	pthread_mutex_lock(&s->lock);
+	for (i = 0; i < ROBOT_US_COUNT; i++) {
+		value[i] = s->value[i];
+		if (age_us == NULL)
+			continue;
+		age = now - s->stamp_us[i];
+		age_us[i] = s->stamp_us[i] == 0 || age >= US_NEVER ? US_NEVER : age;
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+/*!
+ * Change the mask or the periods, also while running
+ *
+ * The transducers leaving the mask read ROBOT_US_DISABLED from now on; the
+ * ones joining it are measured from the next slot on.
+ */
+void us_configure(struct us_scheduler *s, const struct us_config *c) {
+	int i;
+
+	pthread_mutex_lock(&s->lock);
+	for (i = 0; i < ROBOT_US_COUNT; i++)
+		if (!(c->mask & 1 << i)) {
+			s->value[i] = ROBOT_US_DISABLED;
+			s->stamp_us[i] = 0;
+		}
+	s->config = *c;
+	hist_reset(&s->lateness);
+	pthread_mutex_unlock(&s->lock);
+}
@@ -0,0 +1,67 @@
+/* \file ultrasound.h
+
+ *
+ * \brief
+ *         Ultrasound scheduler
+ *
+ * Ranging is the slowest sensor of the robot: an echo from the end of the
+ * range takes about 15 ms to come back. Rather than measuring whenever a
+ * reading is wanted, a dedicated thread ranges in the background and the
+ * readers get the last completed measurement of each transducer, with its
+ * age, without touching the bus.
+ *
+ * The thread activates one transducer at a time for a slot of
+ * US_SLOT_US, so that no transducer hears the echo of another, then reads
+ * its result. Each enabled transducer has its own period; the slot goes to
+ * the one the most overdue, and no transducer ranges (none is activated)
+ * while none is due for a slot or more. The transducers enabled together
+ * start one slot apart, which keeps the ones with equal periods out of
+ * each other's slots. A transducer disabled in the mask reads
+ * ROBOT_US_DISABLED at once.
+ *
+ */
+#ifndef ULTRASOUND_H
+#define ULTRASOUND_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "robot.h"
+#include "stats.h"
+
+#define US_SLOT_US 20000       // one ranging, echo from 250 cm and margin
+#define US_MAX_PERIOD_MS 60000
+#define US_NEVER UINT32_MAX    // age of a transducer without measurement
+
+struct us_config {
+	unsigned mask;                       // enabled transducers, bit i is us[i]
+	unsigned period_ms[ROBOT_US_COUNT];  // cadence, 0 as often as possible
+};
+
+typedef int (*us_activate_fn)(int mask);
+typedef int (*us_measure_fn)(short value[ROBOT_US_COUNT]); // 0 on success
+
+struct us_scheduler {
+	struct us_config config;
+	us_activate_fn activate;
+	us_measure_fn measure;
+	pthread_mutex_t lock;                // readings, config and statistics
+	short value[ROBOT_US_COUNT];         // last completed measurements
+	uint64_t stamp_us[ROBOT_US_COUNT];   // their completion time, 0 none
+	uint32_t count[ROBOT_US_COUNT];      // completed measurements
+	uint32_t errors;                     // failed reads
+	struct histogram lateness;           // slot start after due time [ns]
+	uint64_t due_us[ROBOT_US_COUNT];     // next measurement, thread only
+	unsigned enabled;                    // mask seen last, thread only
+	int active;                          // activated transducers, thread only
+	int running;
+	pthread_t thread;
+};
+
+int us_start(struct us_scheduler *s);
+void us_stop(struct us_scheduler *s);
+void us_get(struct us_scheduler *s, short value[ROBOT_US_COUNT],
+		uint32_t age_us[ROBOT_US_COUNT]);
+void us_configure(struct us_scheduler *s, const struct us_config *c);
+
+#endif /* ULTRASOUND_H */
@@ -0,0 +1,196 @@
+/* \file upload.c
+
+ *
+ * \brief
+ *         Resumable, checksummed file upload, see upload.h
+ *
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "upload.h"
+
+/*--------------------------------------------------------------------*/
+/*!
+ * Update a CRC-32 (IEEE 802.3, as zlib's crc32()) with more data
+ *
+ * \param crc CRC of the previous data, 0 to start
+ * \param data next bytes
+ * \param len number of bytes
+ *
+ * \return CRC of all the data
+ */
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len) {
+	static uint32_t table[256];
+	const unsigned char *p = data;
+	uint32_t c;
+	int i, k;
+
+	if (table[1] == 0) {
+		for (i = 0; i < 256; i++) {
+			for (c = i, k = 0; k < 8; k++)
+				c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+			table[i] = c;
+		}
+	}
+
+	crc = ~crc;
+	while (len--)
+		crc = table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+/*!
+ * Initialise an upload with nothing in progress
+ */
+void upload_init(struct upload *u) {
+	u->fd = -1;
+	u->offset = 0;
+}
+
+/*!
+ * Start or resume an upload
+ *
+ * A previous upload in progress is abandoned, its temporary file is kept
+ * so that it can still be resumed.
+ *
+ * \param u upload
+ * \param path destination file
+ * \param length declared file length
+ * \param crc declared CRC-32 of the file
+ *
+ * \return offset to send from, -1 on error
+ */
+int upload_begin(struct upload *u, const char *path, uint32_t length,
+		uint32_t crc) {
+	unsigned char buf[4096];
+	size_t want;
+	ssize_t n;
+	off_t size;
+
+	upload_abort(u);
+	if ((size_t) snprintf(u->path, sizeof(u->path), "%s", path)
+			>= sizeof(u->path)
+			|| (size_t) snprintf(u->tmp, sizeof(u->tmp), "%s.%u.%08x.part",
+					path, length, crc) >= sizeof(u->tmp))
+		return -1;
+
+	u->fd = open(u->tmp, O_RDWR | O_CREAT | O_CLOEXEC, 0755);
+	if (u->fd < 0)
+		return -1;
+	u->length = length;
+	u->crc = crc;
+
+	// resume: the checksum of what is already there is needed at the end
+	size = lseek(u->fd, 0, SEEK_END);
+	if (size < 0 || size > length) {
+		size = 0;
+		if (ftruncate(u->fd, 0) < 0)
+			goto fail;
+	}
+	u->offset = 0;
+	u->running = 0;
+	if (lseek(u->fd, 0, SEEK_SET) < 0)
+		goto fail;
+	while (u->offset < size) {
+		want = size - u->offset;
+		n = read(u->fd, buf, want < sizeof(buf) ? want : sizeof(buf));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			goto fail;
+		u->running = crc32_update(u->running, buf, n);
+		u->offset += n;
+	}
+	return u->offset;
+
+fail:
+	close(u->fd);
+	u->fd = -1;
+	return -1;
+}
+
+/*!
+ * Write a chunk
+ *
+ * A chunk may overlap what is already written, as when the sender resends
+ * its unacknowledged chunks after a reconnection; only the new part is
+ * written.
+ *
+ * \param u upload
+ * \param offset position of the chunk in the file
+ * \param data chunk
+ * \param len chunk length
+ *
+ * \return UPLOAD_OK or an UPLOAD_* error
+ */
+int upload_write(struct upload *u, uint32_t offset, const void *data,
+		size_t len) {
+	const unsigned char *p = data;
+	uint32_t skip;
+	ssize_t n;
+
+	if (u->fd < 0)
+		return UPLOAD_IO;
+	if (offset > u->offset)
+		return UPLOAD_GAP;
+	if ((uint64_t) offset + len > u->length)
+		return UPLOAD_RANGE;
+
+	skip = u->offset - offset;
+	if (skip >= len)
+		return UPLOAD_OK;
+	p += skip;
+	len -= skip;
+
+	while (len > 0) {
+		n = pwrite(u->fd, p, len, u->offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return UPLOAD_IO;
+		u->running = crc32_update(u->running, p, n);
+		u->offset += n;
+		p += n;
+		len -= n;
+	}
+	return UPLOAD_OK;
+}
+
+/*!
+ * Check the upload and move it to its destination
+ *
+ * On a checksum mismatch the temporary file is removed, the upload has to
+ * start over.
+ *
+ * \return 0 on success, -1 if the file is incomplete, corrupted or could
+ *         not be renamed
+ */
+int upload_finish(struct upload *u) {
+	int rc = -1;
+
+	if (u->fd < 0 || u->offset != u->length)
+		return -1;
+
+	if (u->running == u->crc && fsync(u->fd) == 0
+			&& rename(u->tmp, u->path) == 0)
+		rc = 0;
+	else
+		unlink(u->tmp);
+	close(u->fd);
+	u->fd = -1;
+	u->offset = 0;
+	return rc;
+}
+
+/*!
+ * Stop the upload in progress, keeping its data for a later resume
+ */
+void upload_abort(struct upload *u) {
+	if (u->fd >= 0)
+		close(u->fd);
+	u->fd = -1;
+	u->offset = 0;
+}
@@ -0,0 +1,52 @@
+/* \file upload.h
+
+ *
+ * \brief
+ *         Resumable, checksummed file upload
+ *
+ * The sender declares the length and the CRC-32 of the file, then streams
+ * chunks at increasing offsets without waiting for each acknowledge. The
+ * data goes to a temporary file next to the destination, named after the
+ * declared length and checksum, which is renamed over the destination
+ * once the checksum matches. An interrupted upload of the same file
+ * resumes from what the temporary file already holds, even after a
+ * restart of the client.
+ *
+ */
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define UPLOAD_PATH_MAX 256
+
+/* upload_write() results */
+enum {
+	UPLOAD_OK = 0,
+	UPLOAD_GAP = -1,    // chunk starts past the acknowledged offset
+	UPLOAD_RANGE = -2,  // chunk ends past the declared length
+	UPLOAD_IO = -3,     // write error, or no upload in progress
+};
+
+struct upload {
+	char path[UPLOAD_PATH_MAX]; // destination
+	char tmp[UPLOAD_PATH_MAX];  // data received so far
+	int fd;                      // tmp, -1 when no upload is in progress
+	uint32_t length;             // declared length
+	uint32_t crc;                // declared CRC-32
+	uint32_t offset;             // bytes written, the acknowledged offset
+	uint32_t running;            // CRC-32 of the bytes written
+};
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len);
+
+void upload_init(struct upload *u);
+int upload_begin(struct upload *u, const char *path, uint32_t length,
+		uint32_t crc);
+int upload_write(struct upload *u, uint32_t offset, const void *data,
+		size_t len);
+int upload_finish(struct upload *u);
+void upload_abort(struct upload *u);
+
+#endif /* UPLOAD_H */